@@ -1,129 +1,948 @@
+#ifdef __cplusplus // this file is embedded into library as C++ raw string literal, see fas_cl_source.cpp
+R"FAS_CL(
+#endif
 #ifndef NULL
 	#define NULL 0
 #endif
 #define INDEX2D(x, y) ((size_t)(y) * (size_t)x_size + (size_t)(x))
 #define INDEX3D(x, y, z) ((size_t)(z) * (size_t)x_size * (size_t)y_size + (size_t)(y) * (size_t)x_size + (size_t)(x))
 
+// type of all calculations (and of storage if not FAS_HALF)
+// FAS_DOUBLE is passed to compiler by host if field.double_precision is set (see field::BuildOptions())
+#ifdef FAS_DOUBLE
+	#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+	typedef double real_t;
+#else
+	typedef float real_t;
+#endif
+
+// storage type of pressure buffers (field.A/B/C/D), all calculations are done in real_t
+// FAS_HALF is passed to compiler by host if field.half_storage is set
+#ifdef FAS_HALF
+	typedef half store_t;
+	#define LOAD_P(arr, idx) vload_half((idx), (arr))
+	#define STORE_P(arr, idx, v) vstore_half((v), (idx), (arr))
+#else
+	typedef real_t store_t;
+	#define LOAD_P(arr, idx) ((arr)[idx])
+	#define STORE_P(arr, idx, v) ((arr)[idx] = (v))
+#endif
+// storage type of field.buff_rms, FAS_HALF_RMS is set if field.half_rms
+#ifdef FAS_HALF_RMS
+	typedef half rms_t;
+	#define LOAD_RMS(arr, idx) vload_half((idx), (arr))
+	#define STORE_RMS(arr, idx, v) vstore_half((v), (idx), (arr))
+#else
+	typedef real_t rms_t;
+	#define LOAD_RMS(arr, idx) ((arr)[idx])
+	#define STORE_RMS(arr, idx, v) ((arr)[idx] = (v))
+#endif
+
+// field constants baked into program by host if field.specialize is set (see field::BuildOptions()),
+// compiler can then fold index math and unroll loops; otherwise values passed as kernel arguments are used
+#ifdef FAS_X_SIZE
+	#define FIELD_X(arg) ((uint)FAS_X_SIZE)
+	#define FIELD_Y(arg) ((uint)FAS_Y_SIZE)
+	#define FIELD_Z(arg) ((uint)FAS_Z_SIZE)
+	#define FIELD_N_MAT(arg) ((uint)FAS_N_MAT)
+#else
+	#define FIELD_X(arg) (arg)
+	#define FIELD_Y(arg) (arg)
+	#define FIELD_Z(arg) (arg)
+	#define FIELD_N_MAT(arg) (arg)
+#endif
+
+// brick-sparse storage (see field::Sparsify()), must be same as in C++ source, passed to compiler by host
+#ifndef FAS_BRICK
+	#define FAS_BRICK 8 // edge of brick [elements]
+#endif
+#define BRICK_ELEMENTS (FAS_BRICK * FAS_BRICK * FAS_BRICK)
+#define FAS_NO_BRICK 0xFFFFFFFFu // entry of brick table: brick isn't allocated
+
+// order of elements in field arrays (pressure, rms, materials), see field::layout, passed to compiler by host
+// dense arrays are addressed by FIELD_INDEX(), kernels using INDEX3D() directly need linear layout
+#define FAS_LAYOUT_LINEAR 0 // x fastest, then y, then z
+#define FAS_LAYOUT_BRICKED 1 // bricks of FAS_BRICK^3 elements in linear order, x fastest inside of brick; sizes padded to whole bricks
+#define FAS_LAYOUT_MORTON 2 // same bricks, elements inside of brick in Morton (Z-)order
+#ifndef FAS_LAYOUT
+	#define FAS_LAYOUT FAS_LAYOUT_LINEAR
+#endif
+#if FAS_LAYOUT == FAS_LAYOUT_LINEAR
+	#define FIELD_INDEX(x, y, z) INDEX3D(x, y, z)
+#else
+	#define BRICKS(n) (((size_t)(n) + FAS_BRICK - 1) / FAS_BRICK)
+	#if FAS_LAYOUT == FAS_LAYOUT_MORTON
+		// interleaves bits of coordinates inside of brick: x0 y0 z0 x1 y1 z1 ...
+		inline size_t morton3 ( uint x, uint y, uint z ) {
+			size_t m = 0;
+			for(uint b = 0; (1u << b) < FAS_BRICK; b++)
+				m |= (size_t)(((x >> b) & 1u) | (((y >> b) & 1u) << 1) | (((z >> b) & 1u) << 2)) << (3 * b);
+			return m;
+		}
+		#define IN_BRICK(x, y, z) morton3((x) % FAS_BRICK, (y) % FAS_BRICK, (z) % FAS_BRICK)
+	#else
+		#define IN_BRICK(x, y, z) ((((size_t)(z) % FAS_BRICK) * FAS_BRICK + (y) % FAS_BRICK) * FAS_BRICK + (x) % FAS_BRICK)
+	#endif
+	#define FIELD_INDEX(x, y, z) (((((size_t)(z) / FAS_BRICK) * BRICKS(y_size) + (y) / FAS_BRICK) * BRICKS(x_size) + (x) / FAS_BRICK) * BRICK_ELEMENTS + IN_BRICK(x, y, z))
+#endif
+
+#ifndef FAS_ELEMENT_T
+	#define FAS_ELEMENT_T uint // passed to compiler by host, ulong if field has more than 2^32 elements
+#endif
+typedef FAS_ELEMENT_T element_t; // index of element of driver / scanner in buffers of field (FIELD_INDEX)
+
+// kernel groups, compiled lazily by host as separate programs (FAS_GROUP is passed to compiler), see program::Require()
+#define FAS_GROUP_CORE 1 // simulation, RMS, drivers and scanners
+#define FAS_GROUP_OBJECTS 2 // rasterization of 2D/3D objects
+#define FAS_GROUP_INDEXING 3 // collecting of transducer's elements, prefix sums
+#ifndef FAS_GROUP
+	#define FAS_GROUP 0 // all groups
+#endif
+#define IN_GROUP(g) (FAS_GROUP == 0 || FAS_GROUP == (g))
+
+#if IN_GROUP(FAS_GROUP_CORE)
+
 /*******************************/
 /* Acoustic field calculations */
 /*******************************/
 
 // run this kernel in 3D range { field.size.x, field.size.y, field.size.z }
-kernel void clear ( global float * pressure, global float * pressure_tm1, global uchar * material, global float * rms_sum ) {
+kernel void clear ( global store_t * pressure, global store_t * pressure_tm1, global uchar * material, global rms_t * rms_sum ) {
 
 	size_t x_size = get_global_size(0);
 	size_t y_size = get_global_size(1);
-	size_t my_idx = INDEX3D(get_global_id(0), get_global_id(1), get_global_id(2));
+	size_t my_idx = FIELD_INDEX(get_global_id(0), get_global_id(1), get_global_id(2));
 
-	pressure [my_idx] = 0.0f;
-	pressure_tm1 [my_idx] = 0.0f;
+	STORE_P(pressure, my_idx, 0.0f);
+	STORE_P(pressure_tm1, my_idx, 0.0f);
 	material[my_idx] = 0;
 	if (rms_sum != NULL)
-		rms_sum[my_idx] = 0.0f;
+		STORE_RMS(rms_sum, my_idx, 0.0f);
 }
 
-// run this kernel in 3D range { field.size.x, field.size.y }
-kernel void sim_step (	global float * p_t, // field.A/B (see C++ source)
-						global float * p_tm1, // field.A/B (see C++ soucre)
+// calculates p(t+1) of one element from pressure of it and of adjacent elements
+// shared by all variants of sim_step kernel
+// wave from each neighbour is transmitted with Tcoef = 2*r_my / (r_my + r_neigh) and my own wave is reflected
+// with Rcoef = (r_neigh - r_my) / (r_neigh + r_my) = 1 - Tcoef, so:
+// sum(T * p_neigh) + sum(R * p_my) - 6 * p_my = sum(T * (p_neigh - p_my))
+// Tcoef is taken from table precomputed by host (field.buff_tr), so there is no division in hot loop
+inline real_t cell_update (	real_t my_p, // actual pressure of my element
+							real_t my_p_tm1, // pressure of my element in previous step
+							real_t k, // (c * dt / dx)^2 of my material
+							real_t xp1_p, real_t xm1_p, real_t yp1_p, real_t ym1_p, real_t zp1_p, real_t zm1_p, // actual pressure in adjacent elements
+							real_t xp1_t, real_t xm1_t, real_t yp1_t, real_t ym1_t, real_t zp1_t, real_t zm1_t // Tcoef from adjacent elements
+							) {
+	real_t acc;
+	acc =  xp1_t * (xp1_p - my_p);
+	acc += yp1_t * (yp1_p - my_p);
+	acc += zp1_t * (zp1_p - my_p);
+	acc += xm1_t * (xm1_p - my_p);
+	acc += ym1_t * (ym1_p - my_p);
+	acc += zm1_t * (zm1_p - my_p);
+
+	return k * acc + 2.0f * my_p - my_p_tm1;
+}
+
+// boundary mode of each face of calculated range (see field::boundary), packed by host to 2 bits per face
+// faces in order: x-, x+, y-, y+, z-, z+ (face 0 = bits 0..1)
+#define FAS_BND_NONE 0 // adjacent element behind face is read as is (z faces by default, halo of slab)
+#define FAS_BND_RIGID 1 // adjacent element is virtual "copy" of boundary element itself
+#define FAS_BND_MIRROR 2 // plane of symmetry passes through boundary element, adjacent element is copy of its inner neighbour
+#define FAS_BND_PERIODIC 3 // adjacent element is boundary element of opposite face
+#define FACE_MODE(bnd, face) (((bnd) >> (2 * (face))) & 3u)
+
+// index of element adjacent to boundary element across face with given mode
+// step: index difference to adjacent element in memory, wrap: index difference to boundary element of opposite face
+inline size_t face_neighbour ( uint mode, size_t my_idx, long step, long wrap ) {
+	if(mode == FAS_BND_RIGID)
+		return my_idx;
+	if(mode == FAS_BND_MIRROR)
+		return my_idx - step;
+	if(mode == FAS_BND_PERIODIC)
+		return my_idx + wrap;
+	return my_idx + step;
+}
+
+// indices of adjacent elements (x+1, x-1, y+1, y-1, z+1, z-1) of calculated element, with boundary modes applied
+inline void neighbours ( size_t * n, size_t my_idx, uint my_x, uint my_y, uint my_z, uint x_size, uint y_size, uint z_size, uint bnd ) {
+	long row = x_size;
+	long plane = (long)x_size * y_size;
+	n[0] = my_x == x_size - 2 ? face_neighbour(FACE_MODE(bnd, 1), my_idx, 1, -(long)(x_size - 3)) : my_idx + 1;
+	n[1] = my_x == 1 ? face_neighbour(FACE_MODE(bnd, 0), my_idx, -1, x_size - 3) : my_idx - 1;
+	n[2] = my_y == y_size - 2 ? face_neighbour(FACE_MODE(bnd, 3), my_idx, row, -(long)(y_size - 3) * row) : my_idx + row;
+	n[3] = my_y == 1 ? face_neighbour(FACE_MODE(bnd, 2), my_idx, -row, (long)(y_size - 3) * row) : my_idx - row;
+	n[4] = my_z == z_size - 3 ? face_neighbour(FACE_MODE(bnd, 5), my_idx, plane, -(long)(z_size - 4) * plane) : my_idx + plane;
+	n[5] = my_z == 1 ? face_neighbour(FACE_MODE(bnd, 4), my_idx, -plane, (long)(z_size - 4) * plane) : my_idx - plane;
+}
+
+#if FAS_LAYOUT != FAS_LAYOUT_LINEAR
+// coordinate of element adjacent to boundary element across face with given mode, same as face_neighbour()
+// step: +1 / -1 along axis, opposite: coordinate of boundary element of opposite face
+inline uint face_coord ( uint mode, uint my, int step, uint opposite ) {
+	if(mode == FAS_BND_RIGID)
+		return my;
+	if(mode == FAS_BND_MIRROR)
+		return my - step;
+	if(mode == FAS_BND_PERIODIC)
+		return opposite;
+	return my + step;
+}
+
+// same as neighbours() for field arrays in non-linear layout (see FIELD_INDEX()), neighbours are found by coordinates
+inline void field_neighbours ( size_t * n, uint my_x, uint my_y, uint my_z, uint x_size, uint y_size, uint z_size, uint bnd ) {
+	n[0] = FIELD_INDEX(my_x == x_size - 2 ? face_coord(FACE_MODE(bnd, 1), my_x, 1, 1) : my_x + 1, my_y, my_z);
+	n[1] = FIELD_INDEX(my_x == 1 ? face_coord(FACE_MODE(bnd, 0), my_x, -1, x_size - 2) : my_x - 1, my_y, my_z);
+	n[2] = FIELD_INDEX(my_x, my_y == y_size - 2 ? face_coord(FACE_MODE(bnd, 3), my_y, 1, 1) : my_y + 1, my_z);
+	n[3] = FIELD_INDEX(my_x, my_y == 1 ? face_coord(FACE_MODE(bnd, 2), my_y, -1, y_size - 2) : my_y - 1, my_z);
+	n[4] = FIELD_INDEX(my_x, my_y, my_z == z_size - 3 ? face_coord(FACE_MODE(bnd, 5), my_z, 1, 1) : my_z + 1);
+	n[5] = FIELD_INDEX(my_x, my_y, my_z == 1 ? face_coord(FACE_MODE(bnd, 4), my_z, -1, z_size - 3) : my_z - 1);
+}
+#endif
+
+// true if calculated element lies on face with mirror / periodic mode - its adjacent element is not the one next to it in memory
+inline bool on_wrapped_face ( uint bnd, uint my_x, uint my_y, uint my_z, uint x_size, uint y_size, uint z_size ) {
+	return	(my_x == 1 && FACE_MODE(bnd, 0) >= FAS_BND_MIRROR) || (my_x == x_size - 2 && FACE_MODE(bnd, 1) >= FAS_BND_MIRROR) ||
+			(my_y == 1 && FACE_MODE(bnd, 2) >= FAS_BND_MIRROR) || (my_y == y_size - 2 && FACE_MODE(bnd, 3) >= FAS_BND_MIRROR) ||
+			(my_z == 1 && FACE_MODE(bnd, 4) >= FAS_BND_MIRROR) || (my_z == z_size - 3 && FACE_MODE(bnd, 5) >= FAS_BND_MIRROR);
+}
+
+// run this kernel in 2D range { field.size.x, field.size.y }, or over XY of active box (offset and range, see field::active_lo)
+kernel void sim_step (	global store_t * p_t, // field.A/B (see C++ source)
+						global store_t * p_tm1, // field.A/B (see C++ soucre)
 						global const uchar * material, // field.buff_mat
-						constant float * r, // arrays[256] of material properties
-						constant float * c, // ...
-						uint z_size,
-						// TODO: use k = dt*dt/(dx*dx) instead of following two params
-						float dx, // edge of cubic elements [m]
-						float dt // time step [s]
+						constant real_t * tr, // table[n_mat][n_mat] of transmission coefficients, see cell_update()
+						constant real_t * k, // array[n_mat] of (c * dt / dx)^2 of each material
+						uint _n_mat, // number of materials (field.materials.size())
+						uint _x_size, uint _y_size, uint _z_size, // field.size
+						uint halo_lo, // 1: plane 0 is halo of slab of multi_field (not boundary of field) - no boundary copy
+						uint z_lo, uint z_hi, // calculated planes [z_lo, z_hi), whole range is [1, z_size - 2)
+						uint bnd // boundary modes of faces, see FACE_MODE()
 						) {
 
-	uint x_size = get_global_size(0);
-	uint y_size = get_global_size(1);
+	const uint x_size = FIELD_X(_x_size);
+	const uint y_size = FIELD_Y(_y_size);
+	const uint z_size = FIELD_Z(_z_size);
+	const uint n_mat = FIELD_N_MAT(_n_mat);
 
 	uint my_x = get_global_id(0);
 	uint my_y = get_global_id(1);
 
-	// layer 0 - copy pressure from layer 1
-	p_t[INDEX3D(my_x, my_y, 1)] = p_t[INDEX2D(my_x, my_y)];
+	// layer 0 - copy pressure from layer 1 (only if z- face reads plane 0 as is)
+	if(!halo_lo && FACE_MODE(bnd, 4) == FAS_BND_NONE)
+		STORE_P(p_t, FIELD_INDEX(my_x, my_y, 1), LOAD_P(p_t, FIELD_INDEX(my_x, my_y, 0)));
 
 	// last layer - copy from pre-last layer
-	p_t[INDEX3D(my_x, my_y, z_size - 1)] = p_t[INDEX3D(my_x, my_y, z_size - 2)];
+	STORE_P(p_t, FIELD_INDEX(my_x, my_y, z_size - 1), LOAD_P(p_t, FIELD_INDEX(my_x, my_y, z_size - 2)));
 
 	// all other layers
 	// skip y == 0 and y == y_size - 1
 	if(my_y > 0 && my_y < y_size - 1) {
-		for(uint my_z = 1; my_z < z_size - 2; my_z++) {
+		for(uint my_z = z_lo; my_z < z_hi; my_z++) {
 			// skip x boundaries
 			if(my_x > 0 && my_x < x_size - 1) {
-				size_t my_idx = INDEX3D(my_x, my_y, my_z);
-				float my_r = r[material[my_idx]]; // characteristic acoustic impedance of my element
-				float my_c = c[material[my_idx]]; // my speed of sound
-				float my_p = p_t[my_idx]; // actual pressure of my element
-
-				// characteristic acoustic impedance of adjacent elements
-				float xp1_r = r[material[my_idx + 1]];
-				float xm1_r = r[material[my_idx - 1]];
-				float yp1_r = r[material[my_idx + x_size]];
-				float ym1_r = r[material[my_idx - x_size]];
-				float zp1_r = r[material[my_idx + x_size * y_size]];
-				float zm1_r = r[material[my_idx - x_size * y_size]];
-
-				// actual pressure in adjacent elements
-				float xp1_p = my_x == x_size - 2 ? my_p : p_t[my_idx + 1]; // virtual "copy" of boundary elements
-				float xm1_p = my_x == 1 ? my_p : p_t[my_idx - 1];
-				float yp1_p = my_y == y_size - 2 ? my_p : p_t[my_idx + x_size];
-				float ym1_p = my_y == 1 ? my_p : p_t[my_idx - x_size];
-				float zp1_p = p_t[my_idx + x_size * y_size];
-				float zm1_p = p_t[my_idx - x_size * y_size];
-
-				float acc;
-				// calc influence of neighboring elements:
-				// transmission wave from neighboring elements ( Tcoef = 2*r_my / (r_my + r_neigh) )
-				acc =  2.0f * my_r / (my_r + xp1_r) * xp1_p; // "* 2.0f" can be moved to wave eq bellow
-				acc += 2.0f * my_r / (my_r + yp1_r) * yp1_p;
-				acc += 2.0f * my_r / (my_r + zp1_r) * zp1_p;
-				acc += 2.0f * my_r / (my_r + xm1_r) * xm1_p;
-				acc += 2.0f * my_r / (my_r + ym1_r) * ym1_p;
-				acc += 2.0f * my_r / (my_r + zm1_r) * zm1_p;
-				
-				// myself influence - reflected wave from boundary (0 if same material: r_my = r_neigh)
-				acc += (xp1_r - my_r) / (xp1_r + my_r) * my_p;
-				acc += (yp1_r - my_r) / (yp1_r + my_r) * my_p;
-				acc += (zp1_r - my_r) / (zp1_r + my_r) * my_p;
-				acc += (xm1_r - my_r) / (xm1_r + my_r) * my_p;
-				acc += (ym1_r - my_r) / (ym1_r + my_r) * my_p;
-				acc += (zm1_r - my_r) / (zm1_r + my_r) * my_p;
+				size_t my_idx = FIELD_INDEX(my_x, my_y, my_z);
+				real_t my_p = LOAD_P(p_t, my_idx); // actual pressure of my element
+
+				// adjacent elements, behind boundary faces given by boundary mode (rigid: virtual "copy" of boundary element)
+				size_t n[6];
+#if FAS_LAYOUT == FAS_LAYOUT_LINEAR
+				neighbours(n, my_idx, my_x, my_y, my_z, x_size, y_size, z_size, bnd);
+#else
+				field_neighbours(n, my_x, my_y, my_z, x_size, y_size, z_size, bnd);
+#endif
+
+				// row of transmission table for my material
+				uint my_m = material[my_idx];
+				constant real_t * my_tr = tr + my_m * n_mat;
 
 				// from now, for this element, p_tm1 will be p(t + 1); after finish of this simulation-step, buffers will be swapped by host code
-				p_tm1[my_idx] = dt * dt * my_c * my_c / (dx * dx) * (acc - 6.0f * my_p) + 2.0f * my_p - p_tm1[my_idx];
+				STORE_P(p_tm1, my_idx, cell_update(my_p, LOAD_P(p_tm1, my_idx), k[my_m],
+											LOAD_P(p_t, n[0]), LOAD_P(p_t, n[1]), LOAD_P(p_t, n[2]),
+											LOAD_P(p_t, n[3]), LOAD_P(p_t, n[4]), LOAD_P(p_t, n[5]),
+											my_tr[material[n[0]]], my_tr[material[n[1]]], my_tr[material[n[2]]],
+											my_tr[material[n[3]]], my_tr[material[n[4]]], my_tr[material[n[5]]]));
 			}
 		}
 	}
 }
 
-// run this kernel in 3D range { field.size.x, field.size.y, field.size.z }
+#ifndef FAS_TILE_X
+	#define FAS_TILE_X 32 // must be same as in C++ source, passed to compiler by host
+#endif
+#ifndef FAS_TILE_Y
+	#define FAS_TILE_Y 8
+#endif
+#define TILE_W (FAS_TILE_X + 2) // tile with 1-element halo
+#define TILE_H (FAS_TILE_Y + 2)
+#if FAS_TILE_X * FAS_TILE_Y < 2 * TILE_W + 2 * FAS_TILE_Y
+	#error "tile of sim_step_tiled is too small - halo can't be loaded by one pass of work-group"
+#endif
+
+// run this kernel in 2D range { field.size.x, field.size.y } (or XY of active box with offset) rounded up to multiple of
+// { FAS_TILE_X, FAS_TILE_Y } and with local range { FAS_TILE_X, FAS_TILE_Y }
+// same as sim_step, but each work-group stages actual z-plane of its XY tile (+ halo) in local memory
+// and each work-item keeps z-1 / z / z+1 values of its own column in registers while marching along z
+kernel __attribute__((reqd_work_group_size(FAS_TILE_X, FAS_TILE_Y, 1)))
+void sim_step_tiled (	global store_t * p_t, // field.A/B (see C++ source)
+						global store_t * p_tm1, // field.A/B (see C++ soucre)
+						global const uchar * material, // field.buff_mat
+						constant real_t * tr, // table[n_mat][n_mat] of transmission coefficients, see cell_update()
+						constant real_t * k, // array[n_mat] of (c * dt / dx)^2 of each material
+						uint _n_mat, // number of materials (field.materials.size())
+						uint _x_size, uint _y_size, uint _z_size, // field.size (global range is rounded up)
+						uint halo_lo, // 1: plane 0 is halo of slab of multi_field - no boundary copy
+						uint z_lo, uint z_hi, // calculated planes [z_lo, z_hi), see sim_step
+						uint bnd // boundary modes of faces, see FACE_MODE()
+						) {
+
+	const uint x_size = FIELD_X(_x_size);
+	const uint y_size = FIELD_Y(_y_size);
+	const uint z_size = FIELD_Z(_z_size);
+	const uint n_mat = FIELD_N_MAT(_n_mat);
+
+	local real_t p_tile[TILE_H][TILE_W]; // actual z-plane of p_t
+	local uchar m_tile[TILE_H][TILE_W]; // actual z-plane of material
+
+	uint my_x = get_global_id(0);
+	uint my_y = get_global_id(1);
+	uint loc_x = get_local_id(0) + 1; // my position in tile
+	uint loc_y = get_local_id(1) + 1;
+	uint loc_idx = get_local_id(1) * FAS_TILE_X + get_local_id(0);
+	size_t plane = (size_t)x_size * y_size;
+
+	// work-items out of field (range is rounded up) only help with loading of tile
+	bool in_field = my_x < x_size && my_y < y_size;
+	bool calc = my_x > 0 && my_x < x_size - 1 && my_y > 0 && my_y < y_size - 1;
+	uint cl_x = min(my_x, x_size - 1); // clamped coords, for safe loads
+	uint cl_y = min(my_y, y_size - 1);
+
+	// same boundary handling as sim_step
+	if(in_field) {
+		if(!halo_lo && FACE_MODE(bnd, 4) == FAS_BND_NONE)
+			STORE_P(p_t, INDEX3D(my_x, my_y, 1), LOAD_P(p_t, INDEX2D(my_x, my_y)));
+		STORE_P(p_t, INDEX3D(my_x, my_y, z_size - 1), LOAD_P(p_t, INDEX3D(my_x, my_y, z_size - 2)));
+	}
+	barrier(CLK_GLOBAL_MEM_FENCE);
+
+	// halo element handled by me (if any), top & bottom rows first, then left & right columns
+	int halo_x = -1, halo_y = -1;
+	if(loc_idx < 2 * TILE_W) {
+		halo_x = loc_idx % TILE_W;
+		halo_y = loc_idx < TILE_W ? 0 : TILE_H - 1;
+	}
+	else if(loc_idx < 2 * TILE_W + 2 * (TILE_H - 2)) {
+		uint i = loc_idx - 2 * TILE_W;
+		halo_x = i < TILE_H - 2 ? 0 : TILE_W - 1;
+		halo_y = i % (TILE_H - 2) + 1;
+	}
+	size_t halo_idx = 0;
+	if(halo_x >= 0) {
+		int gx = (int)(get_global_id(0) - get_local_id(0)) + halo_x - 1; // origin of tile includes global offset
+		int gy = (int)(get_global_id(1) - get_local_id(1)) + halo_y - 1;
+		halo_idx = INDEX2D(clamp(gx, 0, (int)x_size - 1), clamp(gy, 0, (int)y_size - 1));
+	}
+
+	// z-column of my element kept in registers
+	size_t my_idx = INDEX3D(cl_x, cl_y, z_lo - 1);
+	real_t zm1_p = LOAD_P(p_t, my_idx);
+	real_t my_p = LOAD_P(p_t, my_idx + plane);
+	uchar zm1_m = material[my_idx];
+	uchar my_m = material[my_idx + plane];
+
+	for(uint my_z = z_lo; my_z < z_hi; my_z++) {
+		my_idx += plane;
+		real_t zp1_p = LOAD_P(p_t, my_idx + plane);
+		uchar zp1_m = material[my_idx + plane];
+
+		// stage actual plane
+		p_tile[loc_y][loc_x] = my_p;
+		m_tile[loc_y][loc_x] = my_m;
+		if(halo_x >= 0) {
+			p_tile[halo_y][halo_x] = LOAD_P(p_t, halo_idx + my_z * plane);
+			m_tile[halo_y][halo_x] = material[halo_idx + my_z * plane];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		if(calc) {
+			// actual pressure in adjacent elements
+			real_t xp1_p = p_tile[loc_y][loc_x + 1], xm1_p = p_tile[loc_y][loc_x - 1];
+			real_t yp1_p = p_tile[loc_y + 1][loc_x], ym1_p = p_tile[loc_y - 1][loc_x];
+			real_t zp1_v = zp1_p, zm1_v = zm1_p;
+			uchar xp1_m = m_tile[loc_y][loc_x + 1], xm1_m = m_tile[loc_y][loc_x - 1];
+			uchar yp1_m = m_tile[loc_y + 1][loc_x], ym1_m = m_tile[loc_y - 1][loc_x];
+			uchar zp1_v_m = zp1_m, zm1_v_m = zm1_m;
+
+			// boundary elements - adjacent elements given by boundary mode are loaded from global memory
+			if(my_x == 1 || my_x == x_size - 2 || my_y == 1 || my_y == y_size - 2 || my_z == 1 || my_z == z_size - 3) {
+				size_t n[6];
+				neighbours(n, my_idx, my_x, my_y, my_z, x_size, y_size, z_size, bnd);
+				xp1_p = LOAD_P(p_t, n[0]); xm1_p = LOAD_P(p_t, n[1]); yp1_p = LOAD_P(p_t, n[2]);
+				ym1_p = LOAD_P(p_t, n[3]); zp1_v = LOAD_P(p_t, n[4]); zm1_v = LOAD_P(p_t, n[5]);
+				xp1_m = material[n[0]]; xm1_m = material[n[1]]; yp1_m = material[n[2]];
+				ym1_m = material[n[3]]; zp1_v_m = material[n[4]]; zm1_v_m = material[n[5]];
+			}
+
+			constant real_t * my_tr = tr + my_m * n_mat;
+
+			STORE_P(p_tm1, my_idx, cell_update(my_p, LOAD_P(p_tm1, my_idx), k[my_m],
+										xp1_p, xm1_p, yp1_p, ym1_p, zp1_v, zm1_v,
+										my_tr[xp1_m], my_tr[xm1_m], my_tr[yp1_m], my_tr[ym1_m], my_tr[zp1_v_m], my_tr[zm1_v_m]));
+		}
+		barrier(CLK_LOCAL_MEM_FENCE); // tile will be overwritten
+
+		// march along z
+		zm1_p = my_p;
+		my_p = zp1_p;
+		zm1_m = my_m;
+		my_m = zp1_m;
+	}
+}
+
+// run this kernel in 2D range { field.size.x, field.size.y }, or over XY of active box (see sim_step)
+// lean variant of sim_step - pure Laplacian, valid only for elements surrounded by elements of same material
+// elements on material interface are corrected by sim_step_iface kernel afterwards
+kernel void sim_step_lean (	global store_t * p_t, // field.A/B (see C++ source)
+							global store_t * p_tm1, // field.A/B (see C++ soucre)
+							global const uchar * material, // field.buff_mat
+							constant real_t * k, // array[n_mat] of (c * dt / dx)^2 of each material
+							uint _x_size, uint _y_size, uint _z_size, // field.size
+							uint halo_lo, // 1: plane 0 is halo of slab of multi_field - no boundary copy
+							uint z_lo, uint z_hi, // calculated planes [z_lo, z_hi), see sim_step
+							uint bnd // boundary modes of faces, see FACE_MODE()
+							) {
+
+	const uint x_size = FIELD_X(_x_size);
+	const uint y_size = FIELD_Y(_y_size);
+	const uint z_size = FIELD_Z(_z_size);
+
+	uint my_x = get_global_id(0);
+	uint my_y = get_global_id(1);
+
+	// same boundary handling as sim_step
+	if(!halo_lo && FACE_MODE(bnd, 4) == FAS_BND_NONE)
+		STORE_P(p_t, INDEX3D(my_x, my_y, 1), LOAD_P(p_t, INDEX2D(my_x, my_y)));
+	STORE_P(p_t, INDEX3D(my_x, my_y, z_size - 1), LOAD_P(p_t, INDEX3D(my_x, my_y, z_size - 2)));
+
+	if(my_y > 0 && my_y < y_size - 1 && my_x > 0 && my_x < x_size - 1) {
+		for(uint my_z = z_lo; my_z < z_hi; my_z++) {
+			size_t my_idx = INDEX3D(my_x, my_y, my_z);
+			real_t my_p = LOAD_P(p_t, my_idx);
+
+			size_t n[6];
+			neighbours(n, my_idx, my_x, my_y, my_z, x_size, y_size, z_size, bnd);
+
+			real_t acc;
+			acc =  LOAD_P(p_t, n[0]);
+			acc += LOAD_P(p_t, n[1]);
+			acc += LOAD_P(p_t, n[2]);
+			acc += LOAD_P(p_t, n[3]);
+			acc += LOAD_P(p_t, n[4]);
+			acc += LOAD_P(p_t, n[5]);
+
+			STORE_P(p_tm1, my_idx, k[material[my_idx]] * (acc - 6.0f * my_p) + 2.0f * my_p - LOAD_P(p_tm1, my_idx));
+		}
+	}
+}
+
+// run this kernel in 1D range { number of elements on material interface }, after sim_step_lean
+// adds reflection / transmission terms to elements on material interface
+// difference between cell_update() and Laplacian of sim_step_lean is k * sum((Tcoef - 1) * (p_neigh - p_my))
+kernel void sim_step_iface (	global const store_t * p_t, // field.A/B (see C++ source)
+								global store_t * p_tm1, // field.A/B, already updated by sim_step_lean
+								global const uchar * material, // field.buff_mat
+								constant real_t * tr, // table[n_mat][n_mat] of transmission coefficients, see cell_update()
+								constant real_t * k, // array[n_mat] of (c * dt / dx)^2 of each material
+								uint _n_mat, // number of materials (field.materials.size())
+								global const ulong * iface, // indices of elements on material interface, see iface_collect kernel
+								uint _x_size, uint _y_size, uint _z_size, // field.size
+								uint bnd // boundary modes of faces, see FACE_MODE()
+								) {
+
+	const uint x_size = FIELD_X(_x_size);
+	const uint y_size = FIELD_Y(_y_size);
+	const uint z_size = FIELD_Z(_z_size);
+	const uint n_mat = FIELD_N_MAT(_n_mat);
+
+	size_t my_idx = iface[get_global_id(0)];
+	uint my_x = my_idx % x_size;
+	uint my_y = (my_idx / x_size) % y_size;
+	uint my_z = my_idx / ((size_t)x_size * y_size);
+
+	uint my_m = material[my_idx];
+	constant real_t * my_tr = tr + my_m * n_mat;
+	real_t my_p = LOAD_P(p_t, my_idx);
+
+	// virtual "copy" of boundary elements (rigid face) gives zero difference of pressure
+	size_t n[6];
+	neighbours(n, my_idx, my_x, my_y, my_z, x_size, y_size, z_size, bnd);
+	real_t acc = 0.0f;
+	for(uint i = 0; i < 6; i++)
+		acc += (my_tr[material[n[i]]] - 1.0f) * (LOAD_P(p_t, n[i]) - my_p);
+
+	STORE_P(p_tm1, my_idx, LOAD_P(p_tm1, my_idx) + k[my_m] * acc);
+}
+
+// true if element lies on material interface (any adjacent element is made of other material)
+// elements on mirror / periodic faces (see on_wrapped_face()) are handled by sim_step_iface too
+inline bool is_iface ( global const uchar * mat_arr, size_t my_idx, size_t x_size, size_t plane ) {
+	uchar my_m = mat_arr[my_idx];
+	return	mat_arr[my_idx + 1] != my_m || mat_arr[my_idx - 1] != my_m ||
+			mat_arr[my_idx + x_size] != my_m || mat_arr[my_idx - x_size] != my_m ||
+			mat_arr[my_idx + plane] != my_m || mat_arr[my_idx - plane] != my_m;
+}
+
+// run this kernel in 2D range { field.size.y, field.size.z }
+// counts elements on material interface in each line along the x-axis, only elements calculated by sim_step are taken into account
+kernel void iface_count (	global const uchar * mat_arr, // field.buff_mat array
+							global uint * count_mat, // array of size { field.size.y, field.size.z }, interface elements count - output of kernel
+							uint x_size, // field.size.x [elements]
+							uint bnd // boundary modes of faces, see FACE_MODE()
+							) {
+	size_t my_y = get_global_id(0);
+	size_t my_z = get_global_id(1);
+	size_t y_size = get_global_size(0);
+	size_t z_size = get_global_size(1);
+
+	uint counter = 0;
+	if( my_y > 0 && my_y < y_size - 1 && my_z > 0 && my_z < z_size - 2 ) {
+		for( uint my_x = 1; my_x < x_size - 1; my_x++ ) {
+			if( is_iface( mat_arr, INDEX3D( my_x, my_y, my_z ), x_size, x_size * y_size ) ||
+				on_wrapped_face( bnd, my_x, my_y, my_z, x_size, y_size, z_size ) )
+				counter++;
+		}
+	}
+
+	// store result
+	count_mat[my_y + my_z * y_size] = counter;
+}
+
+// run this kernel in 2D range { field.size.y, field.size.z }
+// store indices of elements on material interface in each line along the x-axis
+kernel void iface_collect (	global const uchar * mat_arr, // field.buff_mat array
+							global const ulong * psum, // output of prefix sum kernels { field.size.y, filed.size.z }
+							global ulong * iface, // array of element's indices - output of kernel
+							uint x_size, // field.size.x [elements]
+							uint bnd // boundary modes of faces, see FACE_MODE()
+							) {
+	size_t my_y = get_global_id(0);
+	size_t my_z = get_global_id(1);
+	size_t y_size = get_global_size(0);
+	size_t z_size = get_global_size(1);
+	size_t offset; // offset of first my element in iface array
+	if( my_y == 0 && my_z == 0 )
+		offset = 0;
+	else
+		offset = psum[my_y + my_z * y_size - 1];
+
+	if( my_y > 0 && my_y < y_size - 1 && my_z > 0 && my_z < z_size - 2 ) {
+		for( uint my_x = 1; my_x < x_size - 1; my_x++ ) {
+			size_t my_idx = INDEX3D( my_x, my_y, my_z );
+			if( is_iface( mat_arr, my_idx, x_size, x_size * y_size ) ||
+				on_wrapped_face( bnd, my_x, my_y, my_z, x_size, y_size, z_size ) )
+				iface[offset++] = my_idx;
+		}
+	}
+}
+
+#ifndef FAS_TB_X
+	#define FAS_TB_X 16 // must be same as in C++ source, passed to compiler by host
+#endif
+#ifndef FAS_TB_Y
+	#define FAS_TB_Y 16
+#endif
+#ifndef FAS_TB_MAX_STEPS
+	#define FAS_TB_MAX_STEPS 4
+#endif
+#define TB_RING (FAS_TB_MAX_STEPS + 2) // planes in ring-buffers of materials and driver slots
+
+// applies drivers and boundary copies (same as sequence driver.Drive() + sim_step) to just calculated
+// element of plane my_z of one time-level
+inline real_t tb_modify (	real_t v, // calculated value
+							uchar slot, // driver slot of element, 0 = not driven
+							constant float * sig, // drive signal of each driver slot for this time-level
+							uint my_z, uint z_size,
+							real_t p_z0, // value of plane 0 of this time-level
+							real_t p_zs2 // value of plane z_size - 2 of this time-level
+							) {
+	if(slot)
+		v = sig[slot - 1];
+	if(my_z == 1)
+		v = p_z0;
+	else if(my_z == z_size - 1)
+		v = p_zs2;
+	return v;
+}
+
+// run this kernel in 2D range { FAS_TB_X * groups_x, FAS_TB_Y * groups_y }, local range { FAS_TB_X, FAS_TB_Y },
+// where groups_x = ceil(field.size.x / (FAS_TB_X - 2 * steps)), groups_y = ceil(field.size.y / (FAS_TB_Y - 2 * steps))
+// advances field by "steps" simulation steps at once (temporal blocking), out-of-place: { p_t, p_tm1 } -> { p_out, p_out_tm1 }
+// each work-group calculates its XY tile extended by halo of "steps" elements (redundantly with neighbouring tiles)
+// and marches along z as wavefront - time-level s is calculated in plane z - s
+// all time-levels of my column are kept in registers, only actual plane of each time-level is staged in local memory
+// results are same as "steps" times repeated driver.Drive() + sim_step
+kernel __attribute__((reqd_work_group_size(FAS_TB_X, FAS_TB_Y, 1)))
+void sim_steps_blocked (	global const store_t * p_t, // field.A/B (see C++ source)
+							global const store_t * p_tm1, // field.A/B
+							global store_t * p_out, // p(t + steps), field.C/D
+							global store_t * p_out_tm1, // p(t + steps - 1), field.C/D
+							global const uchar * material, // field.buff_mat
+							constant real_t * tr, // table[n_mat][n_mat] of transmission coefficients, see cell_update()
+							constant real_t * k, // array[n_mat] of (c * dt / dx)^2 of each material
+							uint _n_mat, // number of materials (field.materials.size())
+							global const uchar * drv, // driver slot of each element (0 = not driven), NULL if n_drv == 0
+							constant float * sig, // drive signals [steps][n_drv], NULL if n_drv == 0
+							uint n_drv, // number of drivers
+							uint _x_size, uint _y_size, uint _z_size, // field.size
+							uint steps // number of steps, 1 .. FAS_TB_MAX_STEPS
+							) {
+
+	const uint x_size = FIELD_X(_x_size);
+	const uint y_size = FIELD_Y(_y_size);
+	const uint z_size = FIELD_Z(_z_size);
+	const uint n_mat = FIELD_N_MAT(_n_mat);
+
+	local real_t p_pl[FAS_TB_Y][FAS_TB_X]; // actual plane of one time-level
+	local uchar m_pl[FAS_TB_Y][FAS_TB_X]; // materials of this plane
+
+	real_t lvl[FAS_TB_MAX_STEPS + 2][3]; // [time-level + 1][plane % 3] of my column, level -1 = p_tm1, level 0 = p_t
+	uchar mat[TB_RING]; // [plane % TB_RING] materials of my column
+	uchar slot[TB_RING]; // [plane % TB_RING] driver slots of my column
+
+	uint lx = get_local_id(0);
+	uint ly = get_local_id(1);
+	uint lxp = min(lx + 1, (uint)FAS_TB_X - 1); // neighbours in tile, clamped (values out of tile aren't valid anyway)
+	uint lxm = lx ? lx - 1 : 0;
+	uint lyp = min(ly + 1, (uint)FAS_TB_Y - 1);
+	uint lym = ly ? ly - 1 : 0;
+	int my_x = (int)(get_group_id(0) * (FAS_TB_X - 2 * steps) + lx) - (int)steps;
+	int my_y = (int)(get_group_id(1) * (FAS_TB_Y - 2 * steps) + ly) - (int)steps;
+
+	bool in_field = my_x >= 0 && my_x < (int)x_size && my_y >= 0 && my_y < (int)y_size;
+	// only inner part of tile (without halo) is valid after all steps
+	bool store = in_field && lx >= steps && lx < FAS_TB_X - steps && ly >= steps && ly < FAS_TB_Y - steps;
+	bool xy_calc = my_x > 0 && my_x < (int)x_size - 1 && my_y > 0 && my_y < (int)y_size - 1;
+	size_t plane = (size_t)x_size * y_size;
+	size_t col = INDEX2D(clamp(my_x, 0, (int)x_size - 1), clamp(my_y, 0, (int)y_size - 1));
+
+	for(uint front = 0; front < z_size + steps; front++) {
+		// new plane of time-levels -1 and 0
+		if(front < z_size) {
+			size_t my_idx = col + front * plane;
+			uchar my_slot = n_drv ? drv[my_idx] : 0;
+			mat[front % TB_RING] = material[my_idx];
+			slot[front % TB_RING] = my_slot;
+			lvl[0][front % 3] = LOAD_P(p_tm1, my_idx);
+			real_t v = tb_modify(LOAD_P(p_t, my_idx), my_slot, sig, front, z_size, lvl[1][0], lvl[1][(z_size - 2) % 3]);
+			lvl[1][front % 3] = v;
+			if(store && steps == 1)
+				STORE_P(p_out_tm1, my_idx, v);
+		}
+
+		// time-level s in plane z = front - s (same for whole work-group)
+		for(uint s = 1; s <= steps; s++) {
+			if(front < s || front - s >= z_size)
+				continue;
+			uint my_z = front - s;
+			real_t my_p = lvl[s][my_z % 3];
+			uchar my_m = mat[my_z % TB_RING];
+			p_pl[ly][lx] = my_p;
+			m_pl[ly][lx] = my_m;
+			barrier(CLK_LOCAL_MEM_FENCE);
+
+			real_t v;
+			if(xy_calc && my_z > 0 && my_z < z_size - 2) {
+				constant real_t * my_tr = tr + my_m * n_mat;
+				v = cell_update(my_p, lvl[s - 1][my_z % 3], k[my_m],
+								my_x == x_size - 2 ? my_p : p_pl[ly][lxp], // virtual "copy" of boundary elements
+								my_x == 1 ? my_p : p_pl[ly][lxm],
+								my_y == y_size - 2 ? my_p : p_pl[lyp][lx],
+								my_y == 1 ? my_p : p_pl[lym][lx],
+								lvl[s][(my_z + 1) % 3], lvl[s][(my_z + 2) % 3], // z + 1, z - 1
+								my_tr[m_pl[ly][lxp]], my_tr[m_pl[ly][lxm]],
+								my_tr[m_pl[lyp][lx]], my_tr[m_pl[lym][lx]],
+								my_tr[mat[(my_z + 1) % TB_RING]], my_tr[mat[(my_z + TB_RING - 1) % TB_RING]]);
+			}
+			else
+				v = lvl[s - 1][my_z % 3]; // not calculated by sim_step, holds value of previous step
+			barrier(CLK_LOCAL_MEM_FENCE); // plane will be overwritten
+
+			if(s < steps)
+				v = tb_modify(v, slot[my_z % TB_RING], sig + s * n_drv, my_z, z_size, lvl[s + 1][0], lvl[s + 1][(z_size - 2) % 3]);
+			lvl[s + 1][my_z % 3] = v;
+			if(store) {
+				if(s == steps)
+					STORE_P(p_out, col + my_z * plane, v);
+				else if(s == steps - 1)
+					STORE_P(p_out_tm1, col + my_z * plane, v);
+			}
+		}
+	}
+}
+
+// run this kernel in 1D range { elements.number_of_elements }
+// marks elements of one driver in field.buff_drv by its slot number (used by sim_steps_blocked kernel)
+kernel void drv_mark (	global uchar * drv, // field.buff_drv
+						global const element_t * elements, // index of each element of transducer
+						uchar slot // slot of driver, 1 .. 255
+						) {
+	drv[elements[get_global_id(0)]] = slot;
+}
+
+// run this kernel in 3D range { field.size.x, field.size.y, field.size.z }, planes of active box can be selected by z offset
 // "integrates" actual-value of pressure
-kernel void rms_sum (	global const float* p_t,
-						global float* sum,
+kernel void rms_sum (	global const store_t * p_t,
+						global rms_t * sum,
 						float window
 						) {
 	size_t x_size = get_global_size(0);
 	size_t y_size = get_global_size(1);
-	size_t my_idx = INDEX3D(get_global_id(0), get_global_id(1), get_global_id(2));
+	size_t my_idx = FIELD_INDEX(get_global_id(0), get_global_id(1), get_global_id(2));
 
-	float my_p_ = p_t[my_idx] * window; // "windowed" pressure
-	sum[my_idx] += my_p_ * my_p_; // p^2
+	real_t my_p_ = LOAD_P(p_t, my_idx) * window; // "windowed" pressure
+	STORE_RMS(sum, my_idx, LOAD_RMS(sum, my_idx) + my_p_ * my_p_); // p^2
 }
 
 // run this kernel in 3D range { field.size.x, field.size.y, field.size.z }
-kernel void rms_final(	global float* sum,
+kernel void rms_final(	global rms_t * sum,
 						float inv_steps, // 1/(total number of simulation steps)
 						float inv_sqrt_nnpg // 1/sqrt(nnpg)
 						) {
 	size_t x_size = get_global_size(0);
 	size_t y_size = get_global_size(1);
-	size_t my_idx = INDEX3D(get_global_id(0), get_global_id(1), get_global_id(2));
+	size_t my_idx = FIELD_INDEX(get_global_id(0), get_global_id(1), get_global_id(2));
+
+	STORE_RMS(sum, my_idx, inv_sqrt_nnpg * sqrt(inv_steps * LOAD_RMS(sum, my_idx)));
+}
+
+// depth of element in absorbing layer of thickness n along one axis (0 = outside of layer), calculated range of axis is [1, last]
+inline uint pml_depth ( uint my, uint last, uint n ) {
+	return my <= n ? n + 1 - my : (my + n > last ? my + n - last : 0);
+}
+
+// run this kernel in 3D range { extent of box of PML shell } after sim_step, see field::PmlBoxes()
+// split-field PML: p = p_x + p_y + p_z, each component is damped by sigma of its axis:
+// d2p_i/dt2 + 2 sigma_i dp_i/dt + sigma_i^2 p_i = c^2 d2p/dx_i^2, sigma_i = sigma_max * ((depth - 0.5) / n)^2
+// p(t+1) calculated by sim_step is replaced in shell elements (p_tm1 isn't read, p(t-1) is sum of stored components)
+kernel void pml_step (	global const store_t * p_t, // field.A/B (see C++ source)
+						global store_t * p_tm1, // field.A/B (see C++ soucre), p(t+1) of shell elements is overwritten
+						global const uchar * material, // field.buff_mat
+						constant real_t * tr, // table[n_mat][n_mat] of transmission coefficients, see cell_update()
+						constant real_t * k, // array[n_mat] of (c * dt / dx)^2 of each material
+						uint _n_mat, // number of materials (field.materials.size())
+						global real_t * pml, // field.buff_pml, 6 values per shell element: { p_x, p_y, p_z } (t), { p_x, p_y, p_z } (t-1)
+						ulong base, // index of first element of this box in pml
+						uint x0, uint y0, uint z0, // origin of box in field
+						uint _x_size, uint _y_size, uint _z_size,
+						uint n, // thickness of layer [elements]
+						float coef // sigma_max * dt / sqrt(k) = 1.5 * ln(1/R) / n
+						) {
+
+	const uint x_size = FIELD_X(_x_size);
+	const uint y_size = FIELD_Y(_y_size);
+	const uint z_size = FIELD_Z(_z_size);
+	const uint n_mat = FIELD_N_MAT(_n_mat);
+
+	uint my_x = x0 + get_global_id(0);
+	uint my_y = y0 + get_global_id(1);
+	uint my_z = z0 + get_global_id(2);
+	size_t my_idx = INDEX3D(my_x, my_y, my_z);
+	global real_t * st = pml + 6 * (base + (get_global_id(2) * get_global_size(1) + get_global_id(1)) * get_global_size(0) + get_global_id(0));
+
+	real_t my_p = LOAD_P(p_t, my_idx);
+	real_t xp1_p = my_x == x_size - 2 ? my_p : LOAD_P(p_t, my_idx + 1); // virtual "copy" of boundary elements
+	real_t xm1_p = my_x == 1 ? my_p : LOAD_P(p_t, my_idx - 1);
+	real_t yp1_p = my_y == y_size - 2 ? my_p : LOAD_P(p_t, my_idx + x_size);
+	real_t ym1_p = my_y == 1 ? my_p : LOAD_P(p_t, my_idx - x_size);
+	real_t zp1_p = LOAD_P(p_t, my_idx + x_size * y_size);
+	real_t zm1_p = LOAD_P(p_t, my_idx - x_size * y_size);
+
+	uint my_m = material[my_idx];
+	constant real_t * my_tr = tr + my_m * n_mat;
+	real_t my_k = k[my_m];
+
+	// Laplacian split by axis, same terms as cell_update()
+	real_t lap[3];
+	lap[0] = my_tr[material[my_idx + 1]] * (xp1_p - my_p) + my_tr[material[my_idx - 1]] * (xm1_p - my_p);
+	lap[1] = my_tr[material[my_idx + x_size]] * (yp1_p - my_p) + my_tr[material[my_idx - x_size]] * (ym1_p - my_p);
+	lap[2] = my_tr[material[my_idx + x_size * y_size]] * (zp1_p - my_p) + my_tr[material[my_idx - x_size * y_size]] * (zm1_p - my_p);
+
+	uint depth[3];
+	depth[0] = pml_depth(my_x, x_size - 2, n);
+	depth[1] = pml_depth(my_y, y_size - 2, n);
+	depth[2] = pml_depth(my_z, z_size - 3, n);
+
+	// components must sum to p(t), which could be changed by drivers - difference is distributed equally
+	real_t corr = (my_p - (st[0] + st[1] + st[2])) * (1.0f / 3.0f);
+	real_t sdt_max = coef * sqrt(my_k);
+	real_t p_new = 0.0f;
+	for (int i = 0; i < 3; i++) {
+		real_t rel = depth[i] ? (depth[i] - 0.5f) / n : 0.0f;
+		real_t sdt = sdt_max * rel * rel; // sigma_i * dt
+		real_t cur = st[i] + corr;
+		real_t prev = st[3 + i];
+		real_t next = (2.0f * cur - (1.0f - sdt) * prev - sdt * sdt * cur + my_k * lap[i]) / (1.0f + sdt);
+		st[3 + i] = cur;
+		st[i] = next;
+		p_new += next;
+	}
+	STORE_P(p_tm1, my_idx, p_new);
+}
+
+// index of element { x, y, z } in brick-sparse buffer, -1 if its brick isn't allocated
+// bricks: table of bricks of field (x fastest), grid is { x_size, y_size, z_size } / FAS_BRICK rounded up
+inline long sparse_index ( global const uint * bricks, uint x, uint y, uint z, uint x_size, uint y_size ) {
+	uint bx_size = (x_size + FAS_BRICK - 1) / FAS_BRICK;
+	uint by_size = (y_size + FAS_BRICK - 1) / FAS_BRICK;
+	uint b = bricks[((size_t)(z / FAS_BRICK) * by_size + y / FAS_BRICK) * bx_size + x / FAS_BRICK];
+	if(b == FAS_NO_BRICK)
+		return -1;
+	return (long)b * BRICK_ELEMENTS + ((z % FAS_BRICK) * FAS_BRICK + y % FAS_BRICK) * FAS_BRICK + x % FAS_BRICK;
+}
+
+// index into brick-sparse buffers of element of dense linear field (index of driver / scanner), -1 = not allocated brick
+inline long sparse_element ( global const uint * bricks, ulong i, uint x_size, uint y_size ) {
+	ulong r = i / x_size;
+	return sparse_index(bricks, i % x_size, r % y_size, r / y_size, x_size, y_size);
+}
+
+// run this kernel in 1D range { number of allocated bricks * BRICK_ELEMENTS }, buffers are brick-sparse (see field::Sparsify())
+// same as sim_step, neighbour in not allocated brick is virtual "copy" of my element (rigid wall, same as boundary of field);
+// sim_step copies plane 0 to plane 1 before calculation, so pressure of plane 1 is read from plane 0 here (same brick)
+kernel void sim_step_sparse (	global const store_t * p_t, // field.A/B (see C++ source)
+								global store_t * p_tm1, // field.A/B (see C++ soucre)
+								global const uchar * material, // field.buff_mat
+								constant real_t * tr, // table[n_mat][n_mat] of transmission coefficients, see cell_update()
+								constant real_t * k, // array[n_mat] of (c * dt / dx)^2 of each material
+								uint _n_mat, // number of materials (field.materials.size())
+								global const uint * bricks, // field.buff_bricks
+								global const uint * brick_list, // field.buff_brick_list
+								uint _x_size, uint _y_size, uint _z_size // field.size
+								) {
+
+	const uint x_size = FIELD_X(_x_size);
+	const uint y_size = FIELD_Y(_y_size);
+	const uint z_size = FIELD_Z(_z_size);
+	const uint n_mat = FIELD_N_MAT(_n_mat);
+
+	// position of my element in field
+	size_t my_idx = get_global_id(0);
+	uint b = brick_list[my_idx / BRICK_ELEMENTS];
+	uint e = my_idx % BRICK_ELEMENTS;
+	uint bx_size = (x_size + FAS_BRICK - 1) / FAS_BRICK;
+	uint by_size = (y_size + FAS_BRICK - 1) / FAS_BRICK;
+	uint my_x = (b % bx_size) * FAS_BRICK + e % FAS_BRICK;
+	uint my_y = ((b / bx_size) % by_size) * FAS_BRICK + (e / FAS_BRICK) % FAS_BRICK;
+	uint my_z = (b / (bx_size * by_size)) * FAS_BRICK + e / (FAS_BRICK * FAS_BRICK);
+	if(my_x < 1 || my_x > x_size - 2 || my_y < 1 || my_y > y_size - 2 || my_z < 1 || my_z > z_size - 3)
+		return;
+
+	const long plane = (long)FAS_BRICK * FAS_BRICK; // plane 0 -> plane 1 in brick
+	real_t my_p = LOAD_P(p_t, my_z == 1 ? my_idx - plane : my_idx);
+	uint my_m = material[my_idx];
+	constant real_t * my_tr = tr + my_m * n_mat;
+
+	// neighbours: x+1, x-1, y+1, y-1, z+1, z-1 (-1: boundary or not allocated brick)
+	long n_idx[6];
+	n_idx[0] = my_x == x_size - 2 ? -1 : sparse_index(bricks, my_x + 1, my_y, my_z, x_size, y_size);
+	n_idx[1] = my_x == 1 ? -1 : sparse_index(bricks, my_x - 1, my_y, my_z, x_size, y_size);
+	n_idx[2] = my_y == y_size - 2 ? -1 : sparse_index(bricks, my_x, my_y + 1, my_z, x_size, y_size);
+	n_idx[3] = my_y == 1 ? -1 : sparse_index(bricks, my_x, my_y - 1, my_z, x_size, y_size);
+	n_idx[4] = sparse_index(bricks, my_x, my_y, my_z + 1, x_size, y_size);
+	n_idx[5] = sparse_index(bricks, my_x, my_y, my_z - 1, x_size, y_size);
+	real_t n_p[6], n_t[6];
+	for(int i = 0; i < 6; i++) {
+		n_p[i] = n_idx[i] < 0 ? my_p : LOAD_P(p_t, n_idx[i]);
+		n_t[i] = n_idx[i] < 0 ? 1.0f : my_tr[material[n_idx[i]]];
+	}
+	if(my_z == 1) {
+		for(int i = 0; i < 4; i++) {
+			if(n_idx[i] >= 0)
+				n_p[i] = LOAD_P(p_t, n_idx[i] - plane); // neighbours in plane 1
+		}
+	}
+	if(my_z == 2 && n_idx[5] >= 0)
+		n_p[5] = LOAD_P(p_t, n_idx[5] - plane);
+
+	// p(t-1) of plane 1 is copy of plane 0 made by previous step of sim_step too
+	STORE_P(p_tm1, my_idx, cell_update(my_p, LOAD_P(p_tm1, my_z == 1 ? my_idx - plane : my_idx), k[my_m],
+								n_p[0], n_p[1], n_p[2], n_p[3], n_p[4], n_p[5],
+								n_t[0], n_t[1], n_t[2], n_t[3], n_t[4], n_t[5]));
+}
+
+// run this kernel in 3D range { field_batch.size.x, field_batch.size.y, field_batch.count }
+// same as sim_step for each member of batch, buffers hold all members (member is slowest index)
+// each member has its own tables of materials (n_mat materials each), tables of all members don't fit in constant memory
+kernel void sim_step_batch (	global store_t * p_t, // field_batch.A/B (see C++ source)
+								global store_t * p_tm1, // field_batch.A/B
+								global const uchar * material, // field_batch.buff_mat
+								global const real_t * tr, // tables[count][n_mat][n_mat] of transmission coefficients, see cell_update()
+								global const real_t * k, // arrays[count][n_mat] of (c * dt / dx)^2 of each material
+								uint n_mat, // size of material table of each member
+								uint x_size, uint y_size, uint z_size, // size of one member
+								uint bnd // boundary modes of faces, see FACE_MODE()
+								) {
+
+	uint my_x = get_global_id(0);
+	uint my_y = get_global_id(1);
+	size_t member = get_global_id(2);
+	size_t base = member * x_size * y_size * z_size;
+	p_t += base;
+	p_tm1 += base;
+	material += base;
+	tr += member * n_mat * n_mat;
+	k += member * n_mat;
+
+	// same boundary handling as sim_step
+	if(FACE_MODE(bnd, 4) == FAS_BND_NONE)
+		STORE_P(p_t, INDEX3D(my_x, my_y, 1), LOAD_P(p_t, INDEX2D(my_x, my_y)));
+	STORE_P(p_t, INDEX3D(my_x, my_y, z_size - 1), LOAD_P(p_t, INDEX3D(my_x, my_y, z_size - 2)));
+
+	if(my_y > 0 && my_y < y_size - 1 && my_x > 0 && my_x < x_size - 1) {
+		for(uint my_z = 1; my_z < z_size - 2; my_z++) {
+			size_t my_idx = INDEX3D(my_x, my_y, my_z);
+			real_t my_p = LOAD_P(p_t, my_idx);
+			size_t n[6];
+			neighbours(n, my_idx, my_x, my_y, my_z, x_size, y_size, z_size, bnd);
+
+			uint my_m = material[my_idx];
+			global const real_t * my_tr = tr + my_m * n_mat;
+
+			STORE_P(p_tm1, my_idx, cell_update(my_p, LOAD_P(p_tm1, my_idx), k[my_m],
+										LOAD_P(p_t, n[0]), LOAD_P(p_t, n[1]), LOAD_P(p_t, n[2]),
+										LOAD_P(p_t, n[3]), LOAD_P(p_t, n[4]), LOAD_P(p_t, n[5]),
+										my_tr[material[n[0]]], my_tr[material[n[1]]], my_tr[material[n[2]]],
+										my_tr[material[n[3]]], my_tr[material[n[4]]], my_tr[material[n[5]]]));
+		}
+	}
+}
 
-	sum[my_idx] = inv_sqrt_nnpg * sqrt(inv_steps * sum[my_idx]);
+// run this kernel in 1D range { number of elements of all drivers of field_batch }
+// same as drive kernel for all drivers of all members at once
+kernel void drive_batch (	global store_t * p_t,
+							global const ulong * elements, // index of each element in buffers of batch (member included)
+							global const uint * slot, // driver of each element
+							global const float * signal, // samples of drivers for this step, array[n_drivers]
+							uint step, uint n_drv // signal of this step begins at signal[step * n_drv]
+							) {
+	size_t i = get_global_id(0);
+	STORE_P(p_t, elements[i], signal[(size_t)step * n_drv + slot[i]]);
 }
 
+// run this kernel in 1D range { number of elements of all scanners of field_batch }
+// same as scan kernel for all scanners of all members at once, frame is stored at p_out[frame * get_global_size(0)]
+kernel void scan_batch (	global const store_t * p_t,
+							global const ulong * elements, // index of each element in buffers of batch (member included)
+							global float * p_out, // frames of all scanners, output of kernel
+							uint frame // slot of frame in p_out
+							) {
+	size_t i = get_global_id(0);
+	p_out[(size_t)frame * get_global_size(0) + i] = LOAD_P(p_t, elements[i]);
+}
+
+#endif // FAS_GROUP_CORE
+
+#if IN_GROUP(FAS_GROUP_OBJECTS)
+
 /********************************/
 /* Acoustic field 2D/3D objects */
 /********************************/
@@ -156,7 +975,7 @@ kernel void object_rect (	global uchar * mat_arr, // field.buff_mat
 		my_yff >= 0.0f && my_y < y_size &&
 		my_zff >= 0.0f && my_z < z_size ) {
 		// store
-		size_t my_idx = INDEX3D(my_x, my_y, my_z);
+		size_t my_idx = FIELD_INDEX(my_x, my_y, my_z);
 		mat_arr[my_idx] = material;
 	}
 }
@@ -195,7 +1014,7 @@ kernel void object_ellipse (	global uchar * mat_arr, // field.buff_mat
 			my_yff >= 0.0f && my_y < y_size &&
 			my_zff >= 0.0f && my_z < z_size ) {
 			// store
-			size_t my_idx = INDEX3D(my_x, my_y, my_z);
+			size_t my_idx = FIELD_INDEX(my_x, my_y, my_z);
 			mat_arr[my_idx] = material;
 		}
 	}
@@ -229,7 +1048,7 @@ kernel void object_box (	global uchar * mat_arr, // field.buff_mat
 		my_yff >= 0.0f && my_y < y_size &&
 		my_zff >= 0.0f && my_z < z_size ) {
 		// store
-		size_t my_idx = INDEX3D(my_x, my_y, my_z);
+		size_t my_idx = FIELD_INDEX(my_x, my_y, my_z);
 		mat_arr[my_idx] = material;
 	}
 }
@@ -270,7 +1089,7 @@ kernel void object_cylinder (	global uchar * mat_arr, // field.buff_mat
 				my_yff >= 0.0f && my_y < y_size &&
 				my_zff >= 0.0f && my_z < z_size ) {
 				// store
-				size_t my_idx = INDEX3D(my_x, my_y, my_z);
+				size_t my_idx = FIELD_INDEX(my_x, my_y, my_z);
 				mat_arr[my_idx] = material;
 			}
 		}
@@ -312,109 +1131,427 @@ kernel void object_ellipsoid (	global uchar * mat_arr, // field.buff_mat
 			my_yff >= 0.0f && my_y < y_size &&
 			my_zff >= 0.0f && my_z < z_size ) {
 			// store
-			size_t my_idx = INDEX3D(my_x, my_y, my_z);
+			size_t my_idx = FIELD_INDEX(my_x, my_y, my_z);
 			mat_arr[my_idx] = material;
 		}
 	}
 }
 
+#endif // FAS_GROUP_OBJECTS
+
 /*********************************/
 /* Transducer - driver / scanner */
 /*********************************/
 
-// run this kernel in 2D range { field.size.y, field.size.z }
-// counts number of transducer's elements (with MSB set) in each line along the x-axis
-kernel void tdcr_count_elements (	global const uchar * mat_arr, // field.buff_mat array
-									global uint * count_mat, // array of size { field.size.y, field.size.z }, drv elements count - output of kernel
-									uint x_size, // field.size.x [elements]
-									uchar wanted_mat // material # we looking for
-									) {
-	size_t my_y = get_global_id(0);
-	size_t my_z = get_global_id(1);
-	size_t y_size = get_global_size(0);
+#if IN_GROUP(FAS_GROUP_INDEXING)
 
-	uint counter = 0;
-	for( uint my_x = 0; my_x < x_size; my_x++ ) {
-		if( mat_arr[INDEX3D( my_x, my_y, my_z )] == wanted_mat )
-			counter++; // MSB is set, inc counter
+#ifndef FAS_COMPACT_WG
+	#define FAS_COMPACT_WG 256 // must be same as in C++ source, passed to compiler by host
+#endif
+#define COMPACT_WORDS (FAS_COMPACT_WG / 32) // bit-mask of work-group in uints
+#define COMPACT_SLOTS 255 // max. number of collected materials, slot 0xFF = material isn't collected
+
+// Stream compaction of transducer's elements: count -> scan -> compact, see transducer::CollectElements()
+// elements are visited in order of storage (FIELD_INDEX), so collected elements of each material are sorted by address
+// each work-group processes contiguous chunk of field buffers, chunk is multiple of FAS_COMPACT_WG
+
+#if FAS_LAYOUT == FAS_LAYOUT_LINEAR
+	#define STORAGE_INSIDE(e) true
+#else
+	#define STORAGE_INSIDE(e) storage_inside(e, x_size, y_size, z_size)
+	// false for padding of bricks on edge of field, inverse of FIELD_INDEX
+	inline bool storage_inside ( ulong e, uint x_size, uint y_size, uint z_size ) {
+		ulong brick = e / BRICK_ELEMENTS;
+		uint i = e % BRICK_ELEMENTS;
+		uint bx = brick % BRICKS(x_size);
+		ulong r = brick / BRICKS(x_size);
+		uint by = r % BRICKS(y_size);
+		uint bz = r / BRICKS(y_size);
+	#if FAS_LAYOUT == FAS_LAYOUT_MORTON
+		uint x = 0, y = 0, z = 0;
+		for(uint b = 0; (1u << b) < FAS_BRICK; b++) {
+			x |= ((i >> (3 * b)) & 1u) << b;
+			y |= ((i >> (3 * b + 1)) & 1u) << b;
+			z |= ((i >> (3 * b + 2)) & 1u) << b;
+		}
+	#else
+		uint x = i % FAS_BRICK, y = i / FAS_BRICK % FAS_BRICK, z = i / (FAS_BRICK * FAS_BRICK);
+	#endif
+		return bx * FAS_BRICK + x < x_size && by * FAS_BRICK + y < y_size && bz * FAS_BRICK + z < z_size;
 	}
+#endif
 
-	// store result
-	count_mat[my_y + my_z * y_size] = counter;
-}
+// run this kernel in 1D range { groups * FAS_COMPACT_WG } with local range { FAS_COMPACT_WG }
+// counts elements of each collected material in chunk of work-group
+kernel __attribute__((reqd_work_group_size(FAS_COMPACT_WG, 1, 1)))
+void tdcr_count_chunks (	global const uchar * mat_arr, // field.buff_mat array
+							global const uchar * slot_of, // slot of each material (256 entries), 0xFF = not collected
+							global ulong * counts, // { groups, n_slots } - output of kernel
+							uint x_size, uint y_size, uint z_size, // field.size
+							ulong n, // number of elements of field buffers (field.StorageElements())
+							ulong chunk, // elements per work-group
+							uint n_slots // number of collected materials
+							) {
+	local uchar lut[256];
+	local uint cnt[COMPACT_SLOTS];
+	uint lid = get_local_id(0);
+	for(uint i = lid; i < 256; i += FAS_COMPACT_WG)
+		lut[i] = slot_of[i];
+	for(uint s = lid; s < n_slots; s += FAS_COMPACT_WG)
+		cnt[s] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	ulong begin = get_group_id(0) * chunk;
+	ulong end = min(begin + chunk, n);
+	for(ulong e = begin + lid; e < end; e += FAS_COMPACT_WG) {
+		uchar s = STORAGE_INSIDE(e) ? lut[mat_arr[e]] : 0xFF;
+		if(s != 0xFF)
+			atomic_inc(&cnt[s]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-// run this kernel in 2D range { field.size.y, field.size.z }
-// store coordinates of transducer's elements (with MSB set) in each line along the x-axis
-kernel void tdcr_collect_elements (	global const uchar * mat_arr, // field.buff_mat array with MSBs set in transducer's elements
-									global const ulong * psum, // output of prefix sum kernels { field.size.y, filed.size.z }
-									global uint * elements, // array of element's coordinates, format: { x0, x1 ... xn, y1 .. yn, z1 .. zn } - output of kernel
-									uint x_size, // field.size.x [elements]
-									ulong no_elements, // total number of transducer's elements ( = psum[last])
-									uchar wanted_mat // material # we looking for
-									) {
-	size_t my_y = get_global_id(0);
-	size_t my_z = get_global_id(1);
-	size_t y_size = get_global_size(0);
-	size_t offset; // offset of first my element in elements array
-	if( my_y == 0 && my_z == 0 )
-		offset = 0;
-	else
-		offset = psum[my_y + my_z * y_size - 1];
+	for(uint s = lid; s < n_slots; s += FAS_COMPACT_WG)
+		counts[(size_t)s * get_num_groups(0) + get_group_id(0)] = cnt[s];
+}
 
-	for( uint my_x = 0; my_x < x_size; my_x++ ) {
-		if( mat_arr[INDEX3D( my_x, my_y, my_z )] == wanted_mat ) {
-			// store coordinates
-			elements[offset] = my_x;
-			elements[offset + no_elements] = (uint)my_y;
-			elements[offset + 2 * no_elements] = (uint)my_z;
-			offset++;
+// run this kernel in 1D range { n_slots * FAS_COMPACT_WG } with local range { FAS_COMPACT_WG }
+// work-efficient (Blelloch) exclusive scan of counts of each slot (one work-group per slot), in place
+// counts are scanned in blocks of 2 * FAS_COMPACT_WG, sum of previous blocks is carried
+kernel __attribute__((reqd_work_group_size(FAS_COMPACT_WG, 1, 1)))
+void tdcr_scan_counts (	global ulong * counts, // { groups, n_slots } from tdcr_count_chunks; output: offset of first element of each chunk
+						global ulong * totals, // number of elements of each slot - output of kernel
+						uint groups // number of chunks
+						) {
+	local ulong tmp[2 * FAS_COMPACT_WG];
+	uint lid = get_local_id(0);
+	global ulong * arr = counts + (size_t)get_group_id(0) * groups;
+	ulong carry = 0;
+
+	for(uint block = 0; block < groups; block += 2 * FAS_COMPACT_WG) {
+		uint a = block + 2 * lid, b = a + 1;
+		tmp[2 * lid] = a < groups ? arr[a] : 0;
+		tmp[2 * lid + 1] = b < groups ? arr[b] : 0;
+		// up-sweep (reduce)
+		uint offset = 1;
+		for(uint d = FAS_COMPACT_WG; d > 0; d >>= 1) {
+			barrier(CLK_LOCAL_MEM_FENCE);
+			if(lid < d)
+				tmp[offset * (2 * lid + 2) - 1] += tmp[offset * (2 * lid + 1) - 1];
+			offset <<= 1;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		ulong block_sum = tmp[2 * FAS_COMPACT_WG - 1];
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if(lid == 0)
+			tmp[2 * FAS_COMPACT_WG - 1] = 0;
+		// down-sweep
+		for(uint d = 1; d <= FAS_COMPACT_WG; d <<= 1) {
+			offset >>= 1;
+			barrier(CLK_LOCAL_MEM_FENCE);
+			if(lid < d) {
+				uint l = offset * (2 * lid + 1) - 1;
+				uint r = offset * (2 * lid + 2) - 1;
+				ulong t = tmp[l];
+				tmp[l] = tmp[r];
+				tmp[r] += t;
+			}
 		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if(a < groups)
+			arr[a] = tmp[2 * lid] + carry;
+		if(b < groups)
+			arr[b] = tmp[2 * lid + 1] + carry;
+		carry += block_sum;
 	}
+	if(lid == 0)
+		totals[get_group_id(0)] = carry;
 }
 
-// run this kernel in 3D range { field.size.x, field.size.y, field.size.z }
-// clears MSB bits in all field.buff_mat (MSB is used for transducer creation)
-kernel void tdcr_clear_mat_MSBs ( global uchar * mat ) {
-	size_t x_size = get_global_size(0);
-	size_t y_size = get_global_size(1);
+// run this kernel in 1D range { groups * FAS_COMPACT_WG } with local range { FAS_COMPACT_WG }, same as tdcr_count_chunks
+// stores index of collected elements and clears MSBs of all materials (MSB is used for transducer creation)
+// rank of element inside of its round (FAS_COMPACT_WG elements) is number of preceding set bits in bit-mask of its slot
+kernel __attribute__((reqd_work_group_size(FAS_COMPACT_WG, 1, 1)))
+void tdcr_compact (	global uchar * mat_arr, // field.buff_mat array
+					global const uchar * slot_of, // slot of each material (256 entries), 0xFF = not collected
+					global const ulong * offsets, // { groups, n_slots } output of tdcr_scan_counts
+					global const ulong * base, // begin of each slot in elements array
+					global element_t * elements, // index (FIELD_INDEX) of elements of each slot - output of kernel
+					uint x_size, uint y_size, uint z_size, // field.size
+					ulong n, // number of elements of field buffers (field.StorageElements())
+					ulong chunk, // elements per work-group
+					uint n_slots // number of collected materials
+					) {
+	local uchar lut[256];
+	local ulong run[COMPACT_SLOTS]; // next free position of each slot
+	local uint mask[COMPACT_SLOTS * COMPACT_WORDS];
+	uint lid = get_local_id(0);
+	uint word = lid / 32;
+	uint bit = 1u << (lid % 32);
+	for(uint i = lid; i < 256; i += FAS_COMPACT_WG)
+		lut[i] = slot_of[i];
+	for(uint s = lid; s < n_slots; s += FAS_COMPACT_WG)
+		run[s] = offsets[(size_t)s * get_num_groups(0) + get_group_id(0)];
+
+	ulong begin = get_group_id(0) * chunk;
+	ulong end = min(begin + chunk, n);
+	for(ulong e0 = begin; e0 < end; e0 += FAS_COMPACT_WG) { // same number of rounds for whole work-group
+		for(uint i = lid; i < n_slots * COMPACT_WORDS; i += FAS_COMPACT_WG)
+			mask[i] = 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
 
-	mat[INDEX3D(get_global_id(0), get_global_id(1), get_global_id(2))] &= 0x7F;
+		ulong e = e0 + lid;
+		uchar s = 0xFF;
+		if(e < end && STORAGE_INSIDE(e)) {
+			uchar m = mat_arr[e];
+			s = lut[m];
+			if(m & 0x80)
+				mat_arr[e] = m & 0x7F;
+			if(s != 0xFF)
+				atomic_or(&mask[s * COMPACT_WORDS + word], bit);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		ulong pos = 0;
+		uint rank = 0, count = 0;
+		if(s != 0xFF) {
+			uint m0 = s * COMPACT_WORDS;
+			for(uint w = 0; w < COMPACT_WORDS; w++) {
+				uint c = popcount(mask[m0 + w]);
+				rank += w < word ? c : 0;
+				count += c;
+			}
+			rank += popcount(mask[m0 + word] & (bit - 1));
+			pos = run[s] + rank;
+			elements[base[s] + pos] = (element_t)e;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if(s != 0xFF && rank == count - 1)
+			run[s] += count; // last element of slot in this round moves position
+	}
 }
 
+#endif // FAS_GROUP_INDEXING
+
+#if IN_GROUP(FAS_GROUP_CORE)
+
 // run this kernel in 1D range { elements.number_of_elements }
 // sets pressure in each element of transducer to value of signal
-kernel void drive ( global float* p_t,
+kernel void drive ( global store_t * p_t,
 					float signal,
-					global const uint * elements, // coordinates of transducer's elements, format: { x0, x1 ... xn, y1 .. yn, z1 .. zn }
-					uint x_size, uint y_size // field.size
+					global const element_t * elements, // index of each element of transducer (FIELD_INDEX)
+					uint x_size, uint y_size, // field.size (for brick-sparse field)
+					global const uint * bricks // field.buff_bricks if field is brick-sparse, else NULL
 					) {
 
-	size_t offset = get_global_size(0); // begin of y part of coordinates; 2*offset => begin of z part of coordinates
 	size_t my_idx = get_global_id(0);
-	size_t my_x = elements[my_idx];
-	size_t my_y = elements[my_idx + offset];
-	size_t my_z = elements[my_idx + 2 * offset];
+	size_t el = elements[my_idx];
+
+	if(bricks != NULL) {
+		long s = sparse_element(bricks, el, x_size, y_size);
+		if(s >= 0)
+			STORE_P(p_t, s, signal);
+		return;
+	}
+	STORE_P(p_t, el, signal);
+}
+
+#ifndef FAS_SINC_TAPS
+	#define FAS_SINC_TAPS 4 // must be same as in C++ source, passed to compiler by host
+#endif
+// generators and interpolations of drive signal, must be same as driver::generator::type_t and driver::interp_t
+#define GEN_SAMPLES 0
+#define GEN_CW 1
+#define GEN_TONE_BURST 2
+#define GEN_CHIRP 3
+#define GEN_GAUSSIAN 4
+#define INTERP_HOLD 0
+#define INTERP_LINEAR 1
+#define INTERP_SINC 2
+
+// sin(2 * pi * cycles), number of cycles is reduced to fraction first (precision of long signals)
+inline float sin_cycles ( float cycles ) {
+	return sinpi(2.0f * (cycles - floor(cycles)));
+}
 
-	p_t[INDEX3D(my_x, my_y, my_z)] = signal;
+// value of parametric signal in time t [s], see driver::generator
+// gen: { amplitude, freq, freq_end, duration, centre, width }
+inline float generator_value ( uint type, constant float * gen, float t ) {
+	float a = gen[0], f = gen[1], f_end = gen[2], duration = gen[3], centre = gen[4], width = gen[5];
+	switch(type) {
+	case GEN_CW:
+		return t < 0.0f ? 0.0f : a * sin_cycles(f * t);
+	case GEN_TONE_BURST: // sine with Hann window
+		if(t < 0.0f || t >= duration)
+			return 0.0f;
+		return a * 0.5f * (1.0f - cospi(2.0f * t / duration)) * sin_cycles(f * t);
+	case GEN_CHIRP: // linear frequency sweep f -> f_end
+		if(t < 0.0f || t >= duration)
+			return 0.0f;
+		return a * sin_cycles(f * t + 0.5f * (f_end - f) * t * t / duration);
+	case GEN_GAUSSIAN: { // Gaussian envelope, modulated by f (if non-zero)
+		float u = (t - centre) / width;
+		float env = a * exp(-0.5f * u * u);
+		return f == 0.0f ? env : env * sin_cycles(f * (t - centre));
+	}
+	}
+	return 0.0f;
+}
+
+// sample of signal, 0 outside of it
+inline float signal_at ( global const float * signal, uint sig_len, long i ) {
+	return i >= 0 && i < sig_len ? signal[i] : 0.0f;
+}
+
+// value of sampled signal in time t_int + t_frac [samples]
+inline float signal_value ( global const float * signal, uint sig_len, uint interp, uint t_int, float t_frac ) {
+	long i = t_int;
+	if(interp == INTERP_LINEAR) {
+		float s0 = signal_at(signal, sig_len, i);
+		return mad(t_frac, signal_at(signal, sig_len, i + 1) - s0, s0);
+	}
+	if(interp == INTERP_SINC && t_frac != 0.0f) {
+		// Hann-windowed sinc of 2 * FAS_SINC_TAPS samples
+		float sum = 0.0f;
+		for(int k = 1 - FAS_SINC_TAPS; k <= FAS_SINC_TAPS; k++) {
+			float d = t_frac - (float)k;
+			float w = 0.5f * (1.0f + cospi(d / FAS_SINC_TAPS));
+			sum += signal_at(signal, sig_len, i + k) * w * sinpi(d) / (M_PI_F * d);
+		}
+		return sum;
+	}
+	return signal_at(signal, sig_len, i); // INTERP_HOLD: last sample not later than t
+}
+
+// run this kernel in 1D range { elements.number_of_elements }
+// sets pressure in each element of driver to value of its signal (uploaded once or parametric) in given time
+kernel void drive_signal (	global store_t * p_t,
+							global const element_t * elements, // index of each element of transducer (FIELD_INDEX)
+							global const float * signal, // driver.signal, NULL for parametric signal
+							uint sig_len, // number of samples of signal
+							constant float * gen, // parameters of generator, see generator_value()
+							uint gen_type, uint interp, // see driver::gen and driver::interp
+							float time, // simulation time [s], used by generators
+							uint t_int, float t_frac, // time [samples] = t_int + t_frac, used by sampled signal
+							uint x_size, uint y_size, // field.size
+							global const uint * bricks // field.buff_bricks if field is brick-sparse, else NULL
+							) {
+
+	size_t my_idx = get_global_id(0);
+	size_t el = elements[my_idx];
+	float value = gen_type == GEN_SAMPLES ? signal_value(signal, sig_len, interp, t_int, t_frac) : generator_value(gen_type, gen, time);
+
+	if(bricks != NULL) {
+		long s = sparse_element(bricks, el, x_size, y_size);
+		if(s >= 0)
+			STORE_P(p_t, s, value);
+		return;
+	}
+	STORE_P(p_t, el, value);
+}
+
+// run this kernel in 1D range { driver_array.num_elements }
+// sets pressure in each element of phased array to delayed and weighted signal of its channel, delayed signal is interpolated linearly
+kernel void drive_array (	global store_t * p_t,
+							global const element_t * elements, // index of each element of array (FIELD_INDEX)
+							global const uint * channel, // channel of each element
+							global const float * delay, // delay of each channel [samples]
+							global const float * gain, // gain of each channel
+							global const uint * sig_idx, // signal of each channel
+							global const float * signals, // samples of all signals, one signal after another
+							global const uint * sig_range, // { first sample, number of samples } of each signal
+							uint t_int, float t_frac, // time [samples] = t_int + t_frac
+							uint x_size, uint y_size, // field.size
+							global const uint * bricks // field.buff_bricks if field is brick-sparse, else NULL
+							) {
+
+	size_t my_idx = get_global_id(0);
+	size_t el = elements[my_idx];
+	uint ch = channel[my_idx];
+	uint first = sig_range[2 * sig_idx[ch]];
+	uint len = sig_range[2 * sig_idx[ch] + 1];
+
+	// integer and fractional part of delayed time, delay is applied to fraction of time only
+	float rel = t_frac - delay[ch];
+	float rel_int = floor(rel);
+	float frac = rel - rel_int;
+	long i = (long)t_int + (long)rel_int;
+	float s0 = i >= 0 && i < len ? signals[first + i] : 0.0f;
+	float s1 = i + 1 >= 0 && i + 1 < len ? signals[first + i + 1] : 0.0f;
+	float value = gain[ch] * mad(frac, s1 - s0, s0);
+
+	if(bricks != NULL) {
+		long s = sparse_element(bricks, el, x_size, y_size);
+		if(s >= 0)
+			STORE_P(p_t, s, value);
+		return;
+	}
+	STORE_P(p_t, el, value);
 }
 
 // run this kernel in 1D range { elements.number_of_elements }
 // scans pressure in each element and store it to p_out array
-kernel void scan ( 	global const float * p_t,
-					global const uint * elements, // coordinates of transducer's elements, format: { x0, x1 ... xn, y1 .. yn, z1 .. zn }
+kernel void scan ( 	global const store_t * p_t,
+					global const element_t * elements, // index of each element of transducer (FIELD_INDEX)
 					global float * p_out, // pressure in each element, output of kernel
-					uint x_size, uint y_size // field.size
+					uint x_size, uint y_size, // field.size (for brick-sparse field)
+					global const uint * bricks // field.buff_bricks if field is brick-sparse, else NULL
 					) {
 	
-	size_t offset = get_global_size(0); // begin of y part of coordinates; 2*offset -> begin of z part of coordinates
 	size_t my_idx = get_global_id(0);
-	size_t my_x = elements[my_idx];
-	size_t my_y = elements[my_idx + offset];
-	size_t my_z = elements[my_idx + 2 * offset];
+	size_t el = elements[my_idx];
+
+	if(bricks != NULL) {
+		long s = sparse_element(bricks, el, x_size, y_size);
+		p_out[my_idx] = s >= 0 ? LOAD_P(p_t, s) : 0.0f; // element of not allocated brick is rigid, no pressure
+		return;
+	}
+	p_out[my_idx] = LOAD_P(p_t, el);
+}
+
+// pressure of element x, y, z (element of not allocated brick of brick-sparse field is rigid, no pressure)
+inline float load_element ( global const store_t * p_t, uint x, uint y, uint z, uint x_size, uint y_size, global const uint * bricks ) {
+	if(bricks != NULL) {
+		long s = sparse_index(bricks, x, y, z, x_size, y_size);
+		return s >= 0 ? LOAD_P(p_t, s) : 0.0f;
+	}
+	return LOAD_P(p_t, FIELD_INDEX(x, y, z));
+}
 
-	p_out[my_idx] = p_t[INDEX3D(my_x, my_y, my_z)];
+kernel void scan_plane ( 	global const store_t * p_t,
+						global float * p_out, // pressure in each pixel of plane (row by row), output of kernel
+						constant float * rot_pos, // position and rotation of plane: elements [0..8] rotation matrix, [9..11] position
+						uint trilinear, // 0: pressure of element containing pixel, 1: trilinear interpolation of 8 surrounding elements
+						uint x_size, uint y_size, uint z_size, // field.size
+						global const uint * bricks // field.buff_bricks if field is brick-sparse, else NULL
+						) {
+	// pixel of plane, size of plane is global range
+	float my_xf = get_global_id(0);
+	float my_yf = get_global_id(1);
+	size_t my_idx = get_global_id(1) * get_global_size(0) + get_global_id(0);
+
+	// rotate & translate (note: "z" is alway 0 so not used), clamp to field
+	float px = clamp(rot_pos[0] * my_xf + rot_pos[1] * my_yf + rot_pos[9], 0.0f, (float)(x_size - 1));
+	float py = clamp(rot_pos[3] * my_xf + rot_pos[4] * my_yf + rot_pos[10], 0.0f, (float)(y_size - 1));
+	float pz = clamp(rot_pos[6] * my_xf + rot_pos[7] * my_yf + rot_pos[11], 0.0f, (float)(z_size - 1));
+	uint x0 = px, y0 = py, z0 = pz;
+
+	if(!trilinear) {
+		p_out[my_idx] = load_element(p_t, x0, y0, z0, x_size, y_size, bricks);
+		return;
+	}
+	uint x1 = min(x0 + 1, x_size - 1), y1 = min(y0 + 1, y_size - 1), z1 = min(z0 + 1, z_size - 1);
+	float wx = px - x0, wy = py - y0, wz = pz - z0;
+	float p00 = mix(load_element(p_t, x0, y0, z0, x_size, y_size, bricks), load_element(p_t, x1, y0, z0, x_size, y_size, bricks), wx);
+	float p10 = mix(load_element(p_t, x0, y1, z0, x_size, y_size, bricks), load_element(p_t, x1, y1, z0, x_size, y_size, bricks), wx);
+	float p01 = mix(load_element(p_t, x0, y0, z1, x_size, y_size, bricks), load_element(p_t, x1, y0, z1, x_size, y_size, bricks), wx);
+	float p11 = mix(load_element(p_t, x0, y1, z1, x_size, y_size, bricks), load_element(p_t, x1, y1, z1, x_size, y_size, bricks), wx);
+	p_out[my_idx] = mix(mix(p00, p10, wy), mix(p01, p11, wy), wz);
 }
 
+#endif // FAS_GROUP_CORE
+
+#if IN_GROUP(FAS_GROUP_INDEXING)
+
 /********************/
 /* Helper functions */
 /********************/
@@ -464,3 +1601,9 @@ kernel void vertical_prexix_sum_ulong ( global ulong * arr, // out from 1. part;
 		arr[my_idx] += prev_row_last_col; // add to my element value of last element in previous row (here is sum of whole prev. row)
 	}
 }
+
+#endif // FAS_GROUP_INDEXING
+
+#ifdef __cplusplus
+)FAS_CL"
+#endif
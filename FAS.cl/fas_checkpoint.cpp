@@ -0,0 +1,245 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "fas.hpp"
+
+using namespace fas;
+
+static const char ckpt_magic[8] = { 'F','A','S','C','K','P','T','1' };
+static const uint32_t ckpt_version = 1;
+static const uint64_t ckpt_align = 4096; // sections start at page boundary, file can be memory-mapped
+
+static uint64_t AlignSection(uint64_t off) {
+    return (off + ckpt_align - 1) / ckpt_align * ckpt_align;
+}
+
+void field::Checkpoint(const std::string& path, const std::vector<driver*>& drivers) {
+    if (Remapped())
+        throw std::runtime_error("ERR: Brick-sparse field or field with non-linear layout can't be checkpointed (fas::field::Checkpoint())");
+    if (halo_lo || z_offset)
+        throw std::runtime_error("ERR: Slab of multi_field can't be checkpointed (fas::field::Checkpoint())");
+    Unmap_p_t();
+    Unmap_rms();
+    int slot = ckpt_slot;
+    checkpoint_io& io = ckpt_io[slot];
+    std::shared_future<void> prev_done = ckpt_io[slot ^ 1].done;
+    ckpt_slot ^= 1;
+    // staging memory of this slot is reused, its previous checkpoint must be written
+    if (io.writer.joinable())
+        io.writer.join();
+    if (!io.error.empty()) {
+        std::string e = io.error;
+        io.error.clear();
+        throw std::runtime_error("ERR: Can't write checkpoint (fas::field::Checkpoint()):\n" + e);
+    }
+
+    std::vector<std::vector<uint32_t>> coords;
+    for (auto drv : drivers) {
+        if (drv->mf != nullptr)
+            throw std::runtime_error("ERR: Driver of multi_field can't be checkpointed (fas::field::Checkpoint())");
+        coords.push_back(drv->GetElementsCoords());
+    }
+
+    size_t elements = (size_t)size.x * size.y * size.z;
+    checkpoint_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ckpt_magic, sizeof(h.magic));
+    h.version = ckpt_version;
+    h.p_size = (uint32_t)PSize();
+    h.rms_size = calc_rms ? (uint32_t)RmsSize() : 0;
+    h.real_size = (uint32_t)RealSize();
+    h.size[0] = size.x; h.size[1] = size.y; h.size[2] = size.z;
+    h.active_lo[0] = active_lo.x; h.active_lo[1] = active_lo.y; h.active_lo[2] = active_lo.z;
+    h.active_hi[0] = active_hi.x; h.active_hi[1] = active_hi.y; h.active_hi[2] = active_hi.z;
+    h.num_drivers = (uint32_t)drivers.size();
+    h.steps_calculated = steps_calculated;
+    h.num_pml = num_pml;
+    uint64_t off = AlignSection(sizeof(h));
+    h.off_p_t = off;    off = AlignSection(off + (uint64_t)h.p_size * elements);
+    h.off_p_tm1 = off;  off = AlignSection(off + (uint64_t)h.p_size * elements);
+    h.off_rms = off;    off = AlignSection(off + (uint64_t)h.rms_size * elements);
+    h.off_mat = off;    off = AlignSection(off + sizeof(uint8_t) * elements);
+    h.off_pml = off;    off = AlignSection(off + (uint64_t)h.real_size * 6 * num_pml);
+    h.off_drivers = off;
+    for (auto& c : coords)
+        off += sizeof(uint64_t) + sizeof(uint32_t) * c.size();
+    h.file_size = off;
+
+    io.data.resize(h.file_size);
+    uint8_t* data = io.data.data();
+    memcpy(data, &h, sizeof(h));
+    uint8_t* drv_ptr = data + h.off_drivers;
+    for (auto& c : coords) {
+        uint64_t n = c.size() / 3;
+        memcpy(drv_ptr, &n, sizeof(n));
+        memcpy(drv_ptr + sizeof(n), c.data(), sizeof(uint32_t) * c.size());
+        drv_ptr += sizeof(n) + sizeof(uint32_t) * c.size();
+    }
+
+    if (backend == BACKEND_NATIVE) {
+        io.ready = cl::Event();
+        memcpy(data + h.off_p_t, (p_buff ? host_B : host_A).data(), h.p_size * elements);
+        memcpy(data + h.off_p_tm1, (p_buff ? host_A : host_B).data(), h.p_size * elements);
+        if (calc_rms)
+            memcpy(data + h.off_rms, host_rms.data(), h.rms_size * elements);
+        memcpy(data + h.off_mat, host_mat.data(), elements);
+        if (num_pml)
+            memcpy(data + h.off_pml, host_pml.data(), h.real_size * 6 * num_pml);
+    }
+    else {
+        try {
+            // non-blocking reads behind already enqueued steps, in-order queue keeps buffers intact until they are read
+            cl_queue.enqueueReadBuffer(p_buff ? buff_B : buff_A, CL_FALSE, 0, h.p_size * elements, data + h.off_p_t);
+            cl_queue.enqueueReadBuffer(p_buff ? buff_A : buff_B, CL_FALSE, 0, h.p_size * elements, data + h.off_p_tm1);
+            if (calc_rms)
+                cl_queue.enqueueReadBuffer(buff_rms, CL_FALSE, 0, h.rms_size * elements, data + h.off_rms);
+            if (num_pml)
+                cl_queue.enqueueReadBuffer(buff_pml, CL_FALSE, 0, h.real_size * 6 * num_pml, data + h.off_pml);
+            cl_queue.enqueueReadBuffer(buff_mat, CL_FALSE, 0, elements, data + h.off_mat, NULL, &io.ready);
+            cl_queue.flush();
+        }
+        catch (cl::Error& e) {
+            std::string s;
+            s = "ERR: Can't read buffers of field (fas::field::Checkpoint()):\n";
+            s += e.what();
+            throw std::runtime_error(s);
+        }
+    }
+
+    // file is written under temporary name and renamed when complete, so last good checkpoint is never damaged
+    auto written = std::make_shared<std::promise<void>>();
+    io.done = written->get_future().share();
+    io.writer = std::thread([&io, path, slot, prev_done, written]() {
+        try {
+            if (io.ready() != nullptr)
+                io.ready.wait();
+            std::string tmp = path + ".tmp" + std::to_string(slot);
+            std::ofstream out;
+            out.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+            out.open(tmp, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(io.data.data()), io.data.size());
+            out.close();
+            if (prev_done.valid())
+                prev_done.wait(); // older checkpoint must not replace this one
+            if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+                std::remove(path.c_str()); // rename doesn't replace existing file on some platforms
+                if (std::rename(tmp.c_str(), path.c_str()) != 0)
+                    throw std::runtime_error("Can't rename \"" + tmp + "\" to \"" + path + "\"");
+            }
+        }
+        catch (std::exception& e) {
+            io.error = "Checkpoint \"" + path + "\": " + e.what();
+        }
+        written->set_value();
+    });
+}
+
+void field::CheckpointWait() {
+    std::string err;
+    for (auto& io : ckpt_io) {
+        if (io.writer.joinable())
+            io.writer.join();
+        if (err.empty())
+            err = io.error;
+        io.error.clear();
+    }
+    if (!err.empty())
+        throw std::runtime_error("ERR: Can't write checkpoint (fas::field::CheckpointWait()):\n" + err);
+}
+
+void field::AutoCheckpoint(const std::vector<driver*>& drivers) {
+    if (checkpoint_path.empty() || (checkpoint_every_steps == 0 && checkpoint_every_seconds <= 0.0))
+        return;
+    auto now = std::chrono::steady_clock::now();
+    if (steps_calculated < ckpt_last_step)
+        ckpt_last_step = 0; // field was cleared
+    if (ckpt_last_time == std::chrono::steady_clock::time_point())
+        ckpt_last_time = now; // wall time is measured from first step
+    bool due = checkpoint_every_steps && steps_calculated - ckpt_last_step >= checkpoint_every_steps;
+    due |= checkpoint_every_seconds > 0.0 && std::chrono::duration<double>(now - ckpt_last_time).count() >= checkpoint_every_seconds;
+    if (!due)
+        return;
+    Checkpoint(checkpoint_path, drivers);
+    ckpt_last_step = steps_calculated;
+    ckpt_last_time = now;
+}
+
+void field::Restore(const std::string& path, const std::vector<driver*>& drivers) {
+    if (Remapped())
+        throw std::runtime_error("ERR: Brick-sparse field or field with non-linear layout can't be restored (fas::field::Restore())");
+    if (halo_lo || z_offset)
+        throw std::runtime_error("ERR: Slab of multi_field can't be restored (fas::field::Restore())");
+    CheckpointWait(); // file may be still written by this field
+    checkpoint_header h;
+    std::vector<uint8_t> data;
+    try {
+        std::ifstream in;
+        in.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+        in.open(path, std::ios::binary);
+        in.read(reinterpret_cast<char*>(&h), sizeof(h));
+        if (memcmp(h.magic, ckpt_magic, sizeof(h.magic)) != 0 || h.version != ckpt_version)
+            throw std::runtime_error("Not a checkpoint file (or unsupported version)");
+        data.resize(h.file_size);
+        in.seekg(0);
+        in.read(reinterpret_cast<char*>(data.data()), h.file_size);
+    }
+    catch (std::exception& e) {
+        throw std::runtime_error("ERR: Can't read checkpoint \"" + path + "\" (fas::field::Restore()):\n" + e.what());
+    }
+    if (h.size[0] != size.x || h.size[1] != size.y || h.size[2] != size.z)
+        throw std::runtime_error("ERR: Checkpoint has different size of field (fas::field::Restore())");
+    if (h.p_size != PSize() || h.rms_size != (calc_rms ? RmsSize() : 0) || h.num_pml != num_pml || (num_pml && h.real_size != RealSize()))
+        throw std::runtime_error("ERR: Checkpoint has different storage, RMS or PML settings (fas::field::Restore())");
+    if (!drivers.empty() && drivers.size() != h.num_drivers)
+        throw std::runtime_error("ERR: Checkpoint has " + std::to_string(h.num_drivers) + " drivers (fas::field::Restore())");
+
+    Unmap_p_t();
+    Unmap_rms();
+    size_t elements = (size_t)size.x * size.y * size.z;
+    p_buff = 0; // p(t) in buff_A
+    if (backend == BACKEND_NATIVE) {
+        memcpy(host_A.data(), data.data() + h.off_p_t, h.p_size * elements);
+        memcpy(host_B.data(), data.data() + h.off_p_tm1, h.p_size * elements);
+        if (calc_rms)
+            memcpy(host_rms.data(), data.data() + h.off_rms, h.rms_size * elements);
+        memcpy(host_mat.data(), data.data() + h.off_mat, elements);
+        if (num_pml)
+            memcpy(host_pml.data(), data.data() + h.off_pml, h.real_size * 6 * num_pml);
+    }
+    else {
+        try {
+            cl_queue.enqueueWriteBuffer(buff_A, CL_FALSE, 0, h.p_size * elements, data.data() + h.off_p_t);
+            cl_queue.enqueueWriteBuffer(buff_B, CL_FALSE, 0, h.p_size * elements, data.data() + h.off_p_tm1);
+            if (calc_rms)
+                cl_queue.enqueueWriteBuffer(buff_rms, CL_FALSE, 0, h.rms_size * elements, data.data() + h.off_rms);
+            cl_queue.enqueueWriteBuffer(buff_mat, CL_FALSE, 0, elements, data.data() + h.off_mat);
+            if (num_pml)
+                cl_queue.enqueueWriteBuffer(buff_pml, CL_FALSE, 0, h.real_size * 6 * num_pml, data.data() + h.off_pml);
+            cl_queue.finish(); // data are local
+        }
+        catch (cl::Error& e) {
+            std::string s;
+            s = "ERR: Can't write buffers of field (fas::field::Restore()):\n";
+            s += e.what();
+            throw std::runtime_error(s);
+        }
+    }
+    steps_calculated = h.steps_calculated;
+    ckpt_last_step = steps_calculated;
+    active_lo = { h.active_lo[0], h.active_lo[1], h.active_lo[2] };
+    active_hi = { h.active_hi[0], h.active_hi[1], h.active_hi[2] };
+    if (!track_active)
+        ActivateAll();
+    iface_dirty = true;
+    marked_elements = std::any_of(data.data() + h.off_mat, data.data() + h.off_mat + elements, [](uint8_t m) { return (m & 0x80) != 0; }); // saved before elements were collected
+
+    const uint8_t* drv_ptr = data.data() + h.off_drivers;
+    for (auto drv : drivers) {
+        uint64_t n;
+        memcpy(&n, drv_ptr, sizeof(n));
+        std::vector<uint32_t> coords(3 * n);
+        memcpy(coords.data(), drv_ptr + sizeof(n), sizeof(uint32_t) * coords.size());
+        drv_ptr += sizeof(n) + sizeof(uint32_t) * coords.size();
+        drv->transducer::SetElements(*this, coords);
+    }
+}
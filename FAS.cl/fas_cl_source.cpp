@@ -0,0 +1,15 @@
+#include "fas.hpp"
+
+using namespace fas;
+
+// fas.cl is valid OpenCL source and at the same time (thanks to "#ifdef __cplusplus" lines at its head and tail)
+// C++ raw string literal, so it is embedded into library by compiler and the file isn't needed at runtime
+static const char* fas_cl_raw =
+#include "fas.cl"
+;
+
+const std::string& device::EmbeddedSource() {
+    // raw text begins with "#endif" and ends with "#ifdef __cplusplus" line of the wrapper - balance them
+    static const std::string source = std::string("#if 1") + fas_cl_raw + "#endif\n";
+    return source;
+}
@@ -9,19 +9,47 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
 #include <stdint.h>
 
 #define INDEX3D(x, y, z) ((size_t)(z) * (size_t)x_size * (size_t)y_size + (size_t)(y) * (size_t)x_size + (size_t)(x))
 #define INDEX2D(u, v) ((size_t)(v) * (size_t)u_size + (size_t)(u))
 
+#define FAS_TILE_X 32 ///< width of XY tile (work-group) of tiled sim_step kernel, passed to OpenCL compiler
+#define FAS_TILE_Y 8 ///< height of XY tile (work-group) of tiled sim_step kernel, passed to OpenCL compiler
+#define FAS_TB_X 16 ///< width of XY tile (work-group, including halo) of temporal-blocking kernel, passed to OpenCL compiler
+#define FAS_TB_Y 16 ///< height of XY tile (work-group, including halo) of temporal-blocking kernel, passed to OpenCL compiler
+#define FAS_TB_MAX_STEPS 4 ///< maximal number of steps calculated by one launch of temporal-blocking kernel, passed to OpenCL compiler
+#define FAS_BRICK 8 ///< edge of brick of brick-sparse storage (see fas::field::Sparsify()) [elements], passed to OpenCL compiler
+#define FAS_NO_BRICK 0xFFFFFFFFu ///< entry of brick table (fas::field::buff_bricks) of not allocated brick
+#define FAS_SINC_TAPS 4 ///< half-length of windowed-sinc interpolation of drive signals (see fas::driver::interp) [samples], passed to OpenCL compiler
+#define FAS_COMPACT_WG 256 ///< work-group size of stream compaction kernels (see fas::transducer::CollectElements()), passed to OpenCL compiler
+#define FAS_COMPACT_GROUPS 1024 ///< max. number of work-groups (chunks of field) of stream compaction kernels
+
 #ifndef M_PI
 	#define M_PI 3.14159265358979323846264338327950288
 #endif /* M_PI */
 
 namespace fas {
 
+	static_assert(FAS_TB_X > 2 * FAS_TB_MAX_STEPS && FAS_TB_Y > 2 * FAS_TB_MAX_STEPS, "halo of temporal-blocking tile is bigger than tile");
+
+	struct driver;
+	struct scanner;
+	struct multi_field;
+	struct field_batch;
+	struct stream_field;
+
 	// data types
-	typedef float data_t; ///< type of numerical data, change OpenCL kernels if changed to double
+	typedef float data_t; ///< type of numerical data exchanged with host, precision of simulation is selected by field::double_precision
 
 	/** \brief 2D vector */
 	template<typename T = data_t>
@@ -73,7 +101,7 @@ namespace fas {
 	struct material {
 		data_t c; 			///< speed of sound [m * s^-1]
 		data_t ro; 			///< density [kg * m^-3]
-		data_t r; 			///< characteristic acoustic impedance (ro * c) calculated here for speed-up GPU calculations
+		data_t r; 			///< characteristic acoustic impedance (ro * c) calculated here, used for transmission coefficients table
 		std::string name; 	///< human-readable name of material like "Air" ...
 
 		/** \brief Recalculates materials from \b c and \b ro - must be initialized by user before call
@@ -110,50 +138,139 @@ namespace fas {
 		}
 	};
 
-	/** \brief specialized OpenCL device with compiled program and loaded kernels
-	* 
-	* Call \ref Prepare() first, before using this, or use constructor with \b device parameter
+	/** \brief OpenCL program compiled with one set of build options and its kernels
+	*
+	* Programs are owned and cached by \ref device, see \ref device::GetProgram().
+	* Kernels are split to groups compiled separately, rarely used groups are compiled on first use, see \ref Require()
 	**/
-	struct device {
-		cl::Device* phy_dev; ///< pointer to physical device (GPU for example)
-		cl::Context cl_context;
-		cl::Program cl_program;
+	struct program {
+		/// groups of kernels, must be same as FAS_GROUP_x in OpenCL source
+		enum group_t {
+			GROUP_CORE = 1, ///< simulation, RMS, drivers and scanners - compiled by \ref Build()
+			GROUP_OBJECTS = 2, ///< rasterization of 2D/3D objects
+			GROUP_INDEXING = 3, ///< collecting of transducer's elements, prefix sums
+		};
+
+		struct device* d = nullptr; ///< device which owns this program
+		std::string options; ///< build options (without common options added by \ref device)
+		cl::Program cl_program[3]; ///< one program per group of kernels, index = group_t - 1
 
 		// CL simulation kernels
 		cl::Kernel clear_kernel;
 		cl::Kernel sim_step_kernel;
+		cl::Kernel sim_step_tiled_kernel;
+		cl::Kernel sim_step_lean_kernel;
+		cl::Kernel sim_step_iface_kernel;
+		cl::Kernel iface_count_kernel;
+		cl::Kernel iface_collect_kernel;
+		cl::Kernel sim_steps_blocked_kernel;
+		cl::Kernel drv_mark_kernel;
 		cl::Kernel rms_sum_kernel;
 		cl::Kernel rms_final_kernel;
+		cl::Kernel pml_step_kernel;
+		cl::Kernel sim_step_sparse_kernel;
 		cl::Kernel object_rect_kernel;
 		cl::Kernel object_ellipse_kernel;
 		cl::Kernel object_box_kernel;
 		cl::Kernel object_cylinder_kernel;
 		cl::Kernel object_ellipsoid_kernel;
-		cl::Kernel tdcr_count_elements_kernel;
-		cl::Kernel tdcr_collect_elements_kernel;
-		cl::Kernel tdcr_clear_mat_MSBs_kernel;
+		cl::Kernel tdcr_count_chunks_kernel;
+		cl::Kernel tdcr_scan_counts_kernel;
+		cl::Kernel tdcr_compact_kernel;
 		cl::Kernel drive_kernel;
+		cl::Kernel drive_array_kernel;
+		cl::Kernel drive_signal_kernel;
 		cl::Kernel scan_kernel;
+		cl::Kernel scan_plane_kernel;
+		cl::Kernel sim_step_batch_kernel;
+		cl::Kernel drive_batch_kernel;
+		cl::Kernel scan_batch_kernel;
 		cl::Kernel horizontal_prefix_sum_uint_ulong_kernel;
 		cl::Kernel vertical_prexix_sum_ulong_kernel;
 
+		/** \brief Compiles core group of kernels from OpenCL source of device, other groups are compiled by \ref Require()
+		*
+		*	\param d device with loaded source code
+		*	\param options build options (OpenCL compiler "-D" macros etc.)
+		**/
+		void Build(struct device& d, const std::string& options);
+
+		/** \brief Compiles group of kernels (or loads it from binary cache of device) and creates its kernels, if not done yet
+		*
+		*	\param g group of kernels, which will be used
+		**/
+		void Require(group_t g);
+	};
+
+	/** \brief specialized OpenCL device with compiled programs and loaded kernels
+	* 
+	* Call \ref Prepare() first, before using this, or use constructor with \b device parameter
+	**/
+	struct device {
+		cl::Device* phy_dev; ///< pointer to physical device (GPU for example)
+		cl::Context cl_context;
+		std::string source; ///< OpenCL source code of all kernels
+		std::map<std::string, program> programs; ///< programs compiled for this device, key = build options, see \ref GetProgram()
+		program* prg = nullptr; ///< default program (build options ""), compiled by \ref Prepare()
+		std::string cache_dir = DefaultCacheDir(); ///< directory of cache of compiled program binaries, empty string disables cache; set it before \ref Prepare()
+
 		device() { phy_dev = nullptr; }
 
 		/** \brief Constructs, load program and compile it, init kernels
 		* 
 		*	\param dev one physical OpenCL device returned by \b cl::Platform::getDevices()
-		*	\param ocl_path path (absolute or relative) to CL source code
+		*	\param ocl_path path (absolute or relative) to CL source code, NULL = use source embedded in library
 		**/
-		device(cl::Device& dev, const char* ocl_path = "fas.cl") { Prepare(dev, ocl_path); }
+		device(cl::Device& dev, const char* ocl_path = nullptr) { Prepare(dev, ocl_path); }
 
 		/** \brief Load program and compile it, init kernels
 		* 
 		*	call it ONLY if constructor without parameters used, call it only ONCE
 		*
 		*	\param dev one physical OpenCL device returned by \b cl::Platform::getDevices()
-		*	\param ocl_path path (absolute or relative) to CL source code
+		*	\param ocl_path path (absolute or relative) to CL source code, NULL = use source embedded in library
+		**/
+		void Prepare(cl::Device& dev, const char* ocl_path = nullptr);
+
+		/** \brief Returns program compiled with \b options, compiles it first time
+		*
+		*	Each variant is compiled only once, all fields with same options shares it.
+		*	\param options build options, see \ref field::BuildOptions()
+		**/
+		program& GetProgram(const std::string& options);
+
+		/** \brief Builds program from \ref source with \b options, binary is reused from \ref cache_dir if possible
+		*
+		*	\param options complete build options
+		*	\return built program
 		**/
-		void Prepare(cl::Device& dev, const char* ocl_path);
+		cl::Program BuildCached(const std::string& options);
+
+		static const std::string& EmbeddedSource(); ///< OpenCL source (fas.cl) embedded into library, see fas_cl_source.cpp
+		static std::string DefaultCacheDir(); ///< "fas_cl_cache" in temporary directory of system
+		static std::vector<cl::Device> NumaSubDevices(cl::Device& dev); ///< Sub-devices of \b dev partitioned by NUMA affinity domain, { dev } if it can't be partitioned
+	};
+
+	/** \brief Persistent worker threads of \ref field::BACKEND_NATIVE, owned by \ref field (see \ref field::Workers())
+	*
+	* Threads wait for job between calls, job is called once per thread with index of thread (0 is calling thread),
+	* so each thread gets same part of range on every call (pages first-touched by \ref native::Clear() stay local to thread).
+	**/
+	struct worker_pool {
+		std::vector<std::thread> threads; ///< workers 1 .. Size() - 1
+		std::mutex mtx; ///< guards all fields below
+		std::condition_variable cv_job; ///< signals new job (or stop) to workers
+		std::condition_variable cv_done; ///< signals end of last part of job to caller
+		const std::function<void(unsigned)>* job = nullptr; ///< actual job, valid until all workers finished
+		uint64_t generation = 0; ///< incremented by each job, workers run each generation once
+		unsigned pending = 0; ///< number of workers not finished with actual job
+		bool stop = false; ///< workers exit, set by destructor
+
+		/** \param n total number of threads (including calling thread) **/
+		explicit worker_pool(unsigned n);
+		~worker_pool();
+		unsigned Size() const { return (unsigned)threads.size() + 1; } ///< total number of threads (including calling thread)
+		void Run(const std::function<void(unsigned)>& fn); ///< Calls fn(t) for t in [0, Size()) in parallel (fn(0) by calling thread), blocking
 	};
 
 	/** \brief 3D acoustic field of cubic elements.
@@ -161,8 +278,73 @@ namespace fas {
 	* Call \ref Prepare() first, before using this
 	**/
 	struct field {
+		/** \brief variants of simulation-step kernel, all of them gives same results */
+		enum sim_kernel_t {
+			SIM_NAIVE = 0, ///< each work-item marches along z and reads all neighbours from global memory
+			SIM_TILED, ///< XY tile (+ halo) of actual z-plane is staged in local memory, z-neighbours are kept in registers; use for big fields
+			SIM_SPLIT ///< lean Laplacian for all elements + correction of elements on material interface only; use for mostly homogeneous scenes
+		};
+		/** \brief order of elements in pressure, rms and material buffers, see \ref StorageIndex() and \ref MeasureLayouts() */
+		enum layout_t {
+			LAYOUT_LINEAR = 0, ///< x fastest, then y, then z (z-neighbours are whole plane apart)
+			LAYOUT_BRICKED, ///< bricks of FAS_BRICK^3 elements in linear order, linear inside of brick; size padded to whole bricks
+			LAYOUT_MORTON ///< same bricks, Morton (Z-)order inside of brick
+		};
+		/** \brief box of elements of PML shell, see \ref PmlBoxes() */
+		struct pml_box {
+			vec3<uint32_t> origin; ///< first element of box
+			vec3<uint32_t> extent; ///< size of box [elements]
+			size_t base; ///< index of first element of box in PML state (\ref buff_pml)
+		};
+		/** \brief mode of face of calculated range, see \ref boundary (values are same as FAS_BND_ constants of fas.cl) */
+		enum boundary_t {
+			BOUNDARY_DEFAULT = 0, ///< rigid on x / y faces; z- face reads plane 0 (copy of plane 1) and z+ face reads plane size.z - 2 (original behaviour)
+			BOUNDARY_RIGID, ///< adjacent element behind face is virtual copy of boundary element (total reflection)
+			BOUNDARY_MIRROR, ///< plane of symmetry passes through boundary element, simulate half (quarter ...) of symmetric scene
+			BOUNDARY_PERIODIC ///< face is connected to opposite face (both faces of axis must be periodic), simulate one cell of periodic structure
+		};
+		/** \brief header of checkpoint file, see \ref Checkpoint()
+		 *
+		 * Sections follow at given offsets, aligned to 4 KiB, in storage type of device buffers (raw copy), so the file can be
+		 * memory-mapped and sections used directly. Pressure sections are p(t) and p(t-1) regardless of \ref p_buff.
+		 * Section of drivers holds for each driver: uint64 number of elements n, uint32 coordinates { x0 .. xn, y0 .. yn, z0 .. zn }.
+		 **/
+		struct checkpoint_header {
+			char magic[8]; ///< "FASCKPT1"
+			uint32_t version; ///< version of format (1)
+			uint32_t p_size; ///< size of element of pressure sections [B], see \ref PSize()
+			uint32_t rms_size; ///< size of element of rms section [B], 0: no rms section
+			uint32_t real_size; ///< size of values of PML section [B], see \ref RealSize()
+			uint32_t size[3]; ///< size of field [elements]
+			uint32_t active_lo[3]; ///< see \ref active_lo
+			uint32_t active_hi[3]; ///< see \ref active_hi
+			uint32_t num_drivers; ///< number of drivers in section of drivers
+			uint64_t steps_calculated; ///< see \ref steps_calculated
+			uint64_t num_pml; ///< number of elements of PML shell (6 values per element)
+			uint64_t off_p_t, off_p_tm1, off_rms, off_mat, off_pml, off_drivers; ///< offsets of sections in file [B]
+			uint64_t file_size; ///< size of whole file [B]
+		};
+		/** \brief staging of one asynchronous checkpoint, see \ref Checkpoint() */
+		struct checkpoint_io {
+			std::vector<uint8_t> data; ///< content of whole file
+			cl::Event ready; ///< last read of device buffers into \ref data (empty for \ref BACKEND_NATIVE)
+			std::thread writer; ///< writes \ref data to file when \ref ready
+			std::shared_future<void> done; ///< file is written (or writer failed), next writer waits for it before renaming its file
+			std::string error; ///< error of writer, reported by \ref CheckpointWait()
+		};
+		/** \brief implementation used for all calculations of field */
+		enum backend_t {
+			BACKEND_OPENCL = 0, ///< kernels of fas.cl on OpenCL \ref device
+			BACKEND_NATIVE ///< C++ kernels on host CPU (SIMD, threads), no OpenCL object is used, see \ref native
+		};
+
+		backend_t backend = BACKEND_OPENCL; ///< set it before \ref Prepare(), \ref d isn't needed for \ref BACKEND_NATIVE
+		unsigned num_threads = 0; ///< number of threads of \ref BACKEND_NATIVE, 0: all hardware threads
+		std::unique_ptr<worker_pool> workers; ///< threads of \ref BACKEND_NATIVE, created by first use (\ref Workers())
 		device* d = nullptr; ///< OpenCl device on which field resides (and is calculated)
-		cl::CommandQueue cl_queue; ///< OpenCL command queue on device, exclusive for each field
+		program* prg = nullptr; ///< variant of program used by this field, selected by \ref Prepare() according to \ref BuildOptions()
+		cl::CommandQueue cl_queue; ///< OpenCL command queue on device, exclusive for each field, in-order
+		cl::CommandQueue io_queue; ///< second queue used for reading of scanned frames and halo exchange of \ref multi_field while simulation continues, see \ref Run()
 		vec3<uint32_t> size = { 3,3,3 }; ///< size of field [elements]
 		data_t dx = 1e-6; ///< length of edge of CUBIC element [m]
 		data_t dt = 1e-9; ///< simulation time step [s]
@@ -173,28 +355,79 @@ namespace fas {
 		cl::Buffer buff_B; ///< see \ref p_buff for explanation
 		cl::Buffer buff_rms; ///< buffer used for integration of RMS value
 		cl::Buffer buff_mat; ///< material index used for each element
-		cl::Buffer buff_r; ///< used materials (max 256), characteristic acoustic impedance
-		cl::Buffer buff_c; ///< used materials (max 256), speed of sound
+		cl::Buffer buff_tr; ///< table [materials.size()][materials.size()] of transmission coefficients 2*r_my / (r_my + r_neigh), row = my material
+		cl::Buffer buff_k; ///< used materials (max 256), (c * dt / dx)^2 precomputed for each material
+		cl::Buffer buff_C; ///< p(t + n) output of temporal-blocking kernel, swapped with \ref buff_A / \ref buff_B, allocated by first \ref SimSteps()
+		cl::Buffer buff_D; ///< p(t + n - 1) output of temporal-blocking kernel, see \ref buff_C
+		cl::Buffer buff_drv; ///< driver slot of each element (uint8, 0 = not driven) used by \ref SimSteps()
+		cl::Buffer buff_iface; ///< indices (uint64) of elements on material interface, used only by \ref SIM_SPLIT, see \ref CollectInterface()
+		size_t num_iface = 0; ///< number of elements in \ref buff_iface
+		cl::Buffer buff_pml; ///< state of elements of PML shell (6 values of calculation type per element), see \ref pml_cells
+		size_t num_pml = 0; ///< number of elements of PML shell
+		cl::Buffer buff_bricks; ///< brick table (uint32 for each brick of \ref BrickGrid(), x fastest): index of allocated brick or \ref FAS_NO_BRICK, see \ref Sparsify()
+		cl::Buffer buff_brick_list; ///< index in \ref BrickGrid() of each allocated brick (uint32)
+		std::vector<uint32_t> host_brick_list; ///< same as \ref buff_brick_list, used by dense view of brick-sparse buffers
+		size_t num_bricks = 0; ///< number of allocated bricks
+		bool sparse = false; ///< \ref buff_A, \ref buff_B, \ref buff_rms and \ref buff_mat are brick-sparse (FAS_BRICK^3 elements per allocated brick), see \ref Sparsify()
+		// host buffers of BACKEND_NATIVE, same meaning as CL buffers
+		std::vector<float> host_A; ///< see \ref buff_A
+		std::vector<float> host_B; ///< see \ref buff_B
+		std::vector<float> host_rms; ///< see \ref buff_rms
+		std::vector<uint8_t> host_mat; ///< see \ref buff_mat
+		std::vector<float> host_tr; ///< see \ref buff_tr
+		std::vector<float> host_k; ///< see \ref buff_k
+		std::vector<float> host_pml; ///< see \ref buff_pml
+		uint64_t native_ns = 0; ///< duration of simulation steps of \ref BACKEND_NATIVE not yet returned by \ref ProfiledTime() [ns]
+		bool iface_dirty = true; ///< \ref buff_mat was changed since last \ref CollectInterface(), set by \ref object functions
+		bool marked_elements = false; ///< \ref buff_mat holds materials with MSB set (elements of transducers), set by \ref object functions, cleared by \ref transducer::CollectElements(); such field can't be calculated (no row of \ref buff_tr for them)
 		int p_buff = 0; ///< 0: \b buff_A holds p(t) and \b buff_B holds p(t-1); 1: \b buff_B holds p(t) and \b buff_A holds p(t-1)
 		data_t * p_mapped_ptr = nullptr;
 		cl::Buffer * p_mapped_buff = nullptr;
 		data_t * rms_mapped_ptr = nullptr;
 		bool calc_rms = false; ///< true: there is requirement for calculating RMS value; false: no RMS calculation, \ref buff_rms not allocated
+		sim_kernel_t sim_kernel = SIM_NAIVE; ///< variant of kernel used by \ref SimStep(), set it before \ref Prepare()
+		layout_t layout = LAYOUT_LINEAR; ///< order of elements in buffers, set it before \ref Prepare(); non-linear layouts need \ref SIM_NAIVE kernel, OpenCL backend, no PML, no temporal blocking
+		bool half_storage = false; ///< store pressure buffers (\ref buff_A, \ref buff_B, \ref buff_C, \ref buff_D) as 16-bit half, calculate in float; set it before \ref Prepare()
+		bool half_rms = false; ///< store \ref buff_rms as 16-bit half (beware of overflow of sum of p^2), set it before \ref Prepare()
+		bool double_precision = false; ///< calculate (and store if not \ref half_storage) in double, device must support fp64; set it before \ref Prepare()
+		bool specialize = false; ///< compile own variant of program with \ref size and number of materials as constants (shared by fields of same shape), set it before \ref Prepare()
+		bool fast_math = false; ///< compile program with -cl-mad-enable -cl-fast-relaxed-math, set it before \ref Prepare()
+		std::vector<data_t> p_conv; ///< host copy of pressure converted to data_t, used by Map_p_t_x() if storage type differs from data_t or buffer is brick-sparse
+		bool p_conv_write = false; ///< \ref p_conv is mapped for write, will be converted back by \ref Unmap_p_t()
+		std::vector<data_t> rms_conv; ///< host copy of rms converted to data_t, used by \ref Map_rms_read() if storage type differs from data_t
+		bool profiling = false; ///< measure duration of simulation-step kernels, set it before \ref Prepare(), see \ref ProfiledTime()
+		std::vector<cl::Event> prof_events; ///< events of profiled kernels, not yet summed by \ref ProfiledTime()
+		uint32_t z_offset = 0; ///< global z of plane 0 if field is slab of \ref multi_field, objects are drawn in global coordinates
+		bool halo_lo = false; ///< plane 0 is halo of slab of \ref multi_field, not boundary of field (no boundary copy, no temporal blocking)
+		bool split_edges = false; ///< \ref SimStep() calculates first and last calculated plane by separate launch before interior (slab of \ref multi_field, halos are exchanged while interior is calculated)
+		cl::Event edges_done; ///< end of calculation of edge planes by last \ref SimStep() with \ref split_edges, null if they weren't calculated separately
+		uint32_t pml_cells = 0; ///< thickness of absorbing boundary (split-field PML) on each face [elements], 0: rigid boundaries; set it before \ref Prepare()
+		data_t pml_reflection = 1e-4f; ///< theoretical reflection coefficient of PML for normal incidence, set it before \ref Prepare()
+		bool track_active = false; ///< calculate only box of elements reachable by wave from driven elements (grows by 1 element per step), see \ref active_lo; set it before \ref Clear()
+		vec3<uint32_t> active_lo = { 0,0,0 }; ///< first element of box (inclusive) where pressure may be non-zero, box is empty if active_lo.x > active_hi.x; whole field if !\ref track_active
+		vec3<uint32_t> active_hi = { 0,0,0 }; ///< last element of box (inclusive), see \ref active_lo
+		std::string checkpoint_path; ///< file of automatic checkpoints written by \ref Run() and \ref SimSteps(), empty: disabled
+		size_t checkpoint_every_steps = 0; ///< automatic checkpoint after each n steps, 0: not by steps
+		double checkpoint_every_seconds = 0.0; ///< automatic checkpoint after given wall time [s], 0: not by time
+		checkpoint_io ckpt_io[2]; ///< double-buffered staging of checkpoints, one can be written while other is read from device
+		int ckpt_slot = 0; ///< slot of \ref ckpt_io used by next checkpoint
+		size_t ckpt_last_step = 0; ///< step of last checkpoint
+		std::chrono::steady_clock::time_point ckpt_last_time; ///< time of last checkpoint (or of first \ref AutoCheckpoint())
+		uint32_t steps_per_pass = 2; ///< number of steps calculated by one pass over memory in \ref SimSteps(), max. \ref FAS_TB_MAX_STEPS; efficiency of tile is (FAS_TB_X - 2*n)*(FAS_TB_Y - 2*n)/(FAS_TB_X*FAS_TB_Y)
 
-		std::vector<material> materials; ///< used materials, need to be initialised before simulation, see \ref material::Recalc()
+		std::vector<material> materials; ///< used materials, need to be initialised before simulation, see \ref material::Recalc(); material index of each element must be lower than materials.size() (checked by \ref object functions)
 		std::vector<data_t> rms_window; ///< window used for "integrating": rect, Hann, Hamming ... One element of vector coresponding to one step of simulation
-		//uint8_t symmetry = 0; ///< 0 by default (asymmetric field) else: see \ref FasFieldSetSymmetry() & \ref FAS_DIRECTION_ (please use only directions with "p" suffix)
+		boundary_t boundary[6] = {}; ///< mode of faces x-, x+, y-, y+, z-, z+ of calculated range, set it before \ref Prepare(); other than default disables temporal blocking and can't be used with PML / \ref Sparsify()
 
 		field() {}
 		field(device& d) : d(&d) {} ///< \param d valid and initialized \ref device
 
-		/**
-		*	\param d valid and initialized \ref device
+		/** \brief Field calculated by \ref BACKEND_NATIVE (without OpenCL device)
 		*	\param size size of field in X, Y and Z coordinates (cartesian) [elements]
 		*	\param dx length of cubic-element-edge [m]
 		*	\param dt time step of simulation [s]
 		**/
-		field(device& d, vec3<uint32_t> size, data_t dx = 1e-3, data_t dt = 1e-6) : d(&d) {
+		field(vec3<uint32_t> size, data_t dx = 1e-3, data_t dt = 1e-6) : backend(BACKEND_NATIVE) {
 			this->size.x = size.x < 3 ? 3 : size.x;
 			this->size.y = size.y < 3 ? 3 : size.y;
 			this->size.z = size.z < 3 ? 3 : size.z;
@@ -202,23 +435,329 @@ namespace fas {
 			this->dt = dt < 1e-9 ? 1e-9 : dt; // minimal time step is 1 ns
 		}
 
+		/**
+		*	\param d valid and initialized \ref device
+		*	\param size size of field in X, Y and Z coordinates (cartesian) [elements]
+		*	\param dx length of cubic-element-edge [m]
+		*	\param dt time step of simulation [s]
+		**/
+		field(device& d, vec3<uint32_t> size, data_t dx = 1e-3, data_t dt = 1e-6) : field(size, dx, dt) {
+			this->d = &d;
+			backend = BACKEND_OPENCL;
+		}
+
+		std::string BuildOptions(); ///< Returns build options of program variant needed by this field (storage type ...)
+		/** \brief Precomputes material-pair coefficients (in double): transmission table tr[my][neigh] and (c * dt / dx)^2 of each material */
+		static void MaterialTables(const std::vector<material>& materials, double dt, double dx, std::vector<double>& tr_tab, std::vector<double>& k_tab);
+		size_t RealSize() { return double_precision ? sizeof(double) : sizeof(float); } ///< size of type used for calculation on device (real_t in OpenCL source) [B]
+		size_t PSize() { return half_storage ? 2 : RealSize(); } ///< size of one element of pressure buffer [B]
+		size_t RmsSize() { return half_rms ? 2 : RealSize(); } ///< size of one element of rms buffer [B]
 		void Prepare(bool want_rms = false); ///< Call only once, before use! \ref d must point to valid and initialized \ref device; \ref materials must be initialized, see \ref material::Recalc() \param want_rms set true if you want to calculate rms value in each element of field (need to define \ref rms_window before simulation)
 		void Clear(); ///< Reset of simulation; for each element: sets pressure to 0.0, rms integration buffer to 0.0 and material to #0
 		void SimStep(); ///< Run one step of simulation and swap pressure buffers (hiden to user)
+
+		/** \brief Runs \b n steps of simulation including driving and scanning, several steps per one pass over memory if possible (temporal blocking)
+		 *
+		 * Same results as \b n times repeated: Drive() of all \b drivers (time = steps_calculated * dt), \ref SimStep(),
+		 * scanning of all \b scanners (pipelined, see \ref Run()). Up to \ref steps_per_pass steps are calculated by one kernel launch,
+		 * driven elements are set inside of kernel. Falls back to single steps if RMS is calculated, or on steps where any of scanners stores frame.
+		 * Needs two more pressure buffers (\ref buff_C, \ref buff_D) and one byte per element for driver slots (\ref buff_drv).
+		 * \param n number of steps
+		 * \param drivers drivers with already collected elements (max. 255 for temporal blocking)
+		 * \param scanners prepared scanners
+		 **/
+		void SimSteps(size_t n, const std::vector<driver*>& drivers = {}, const std::vector<scanner*>& scanners = {});
+		/** \brief Runs \b n_steps steps of simulation including driving and scanning, without waiting for device
+		 *
+		 * Same results as \b n_steps times repeated: Drive() of all \b drivers (time = steps_calculated * dt), \ref SimStep(),
+		 * Scan2devmem() and Scan2file() of all \b scanners. All work is only enqueued, frames of scanners are read by \ref io_queue
+		 * while simulation continues and host waits only when frame must be written to file (see \ref scanner::ScanPipelined()).
+		 * \param n_steps number of steps
+		 * \param drivers drivers with already collected elements
+		 * \param scanners prepared scanners
+		 **/
+		void Run(size_t n_steps, const std::vector<driver*>& drivers = {}, const std::vector<scanner*>& scanners = {});
+		uint64_t ProfiledTime(); ///< Waits for all profiled kernels (see \ref profiling) and returns sum of their durations [ns] since last call
+		/** \brief Returns boxes covering PML shell (each element once): calculated elements closer than \ref pml_cells to any face
+		 *
+		 * Box order: z-, z+ (whole XY), y-, y+ (without z- and z+ boxes), x-, x+ (rest). Empty if \ref pml_cells == 0.
+		 **/
+		std::vector<pml_box> PmlBoxes();
+		/** \brief Extends active box (see \ref track_active) to cover elements [lo, hi] (inclusive, clamped to field)
+		 *
+		 * Called by \ref driver::DriveValue() with bounding box of driver's elements. Call it if pressure is changed by other way
+		 * than by \ref Map_p_t_write() (which activates whole field).
+		 **/
+		void Activate(vec3<uint32_t> lo, vec3<uint32_t> hi);
+		void ActivateAll() { Activate({ 0,0,0 }, { size.x - 1, size.y - 1, size.z - 1 }); } ///< Active box covers whole field
+		static uint32_t BoundaryBits(const boundary_t* modes); ///< modes of 6 faces packed for kernels (2 bits per face, x- in LSBs), \ref BOUNDARY_DEFAULT resolved
+		uint32_t BoundaryBits() { return BoundaryBits(boundary); } ///< \ref boundary packed for kernels
+		bool CustomBoundary() { const boundary_t def[6] = {}; return BoundaryBits() != BoundaryBits(def); } ///< any face behaves other than by default (explicit \ref BOUNDARY_RIGID on x / y faces is same as default)
+		bool ActiveEmpty() { return active_lo.x > active_hi.x; } ///< pressure is zero in all elements (nothing was driven since \ref Clear())
+		void ClearActive(); ///< Empties active box after \ref Clear() (whole field if !\ref track_active or slab of \ref multi_field)
+		/** \brief Converts storage of field to brick-sparse: only bricks (FAS_BRICK^3 elements) with any element of non-rigid material are kept
+		 *
+		 * Call it after all objects are drawn and drivers collected (materials can't be changed later). Neighbours in removed bricks
+		 * are handled as rigid wall (virtual copy of element, same as boundaries of field), drivers and scanners in them are ignored / read 0.
+		 * Pressure, rms and materials are moved into new buffers, dense buffers are released. Map_x functions still return dense view.
+		 * Simulation uses sim_step_sparse kernel regardless of \ref sim_kernel; no temporal blocking, no PML, no \ref multi_field, OpenCL backend only.
+		 * \param rigid_materials materials of regions treated as rigid walls / void padding
+		 **/
+		void Sparsify(const std::vector<uint8_t>& rigid_materials);
+		vec3<uint32_t> BrickGrid() { return { (size.x + FAS_BRICK - 1) / FAS_BRICK, (size.y + FAS_BRICK - 1) / FAS_BRICK, (size.z + FAS_BRICK - 1) / FAS_BRICK }; } ///< number of bricks in each axis
+		/** \brief number of elements of pressure, rms and material buffers */
+		size_t StorageElements() {
+			if (sparse)
+				return num_bricks * FAS_BRICK * FAS_BRICK * FAS_BRICK;
+			if (layout != LAYOUT_LINEAR)
+				return (size_t)BrickGrid().x * BrickGrid().y * BrickGrid().z * FAS_BRICK * FAS_BRICK * FAS_BRICK;
+			return (size_t)size.x * size.y * size.z;
+		}
+		bool Remapped() { return sparse || layout != LAYOUT_LINEAR; } ///< order of elements in buffers differs from linear arrays of Map_x() functions
+		size_t StorageIndex(uint32_t x, uint32_t y, uint32_t z); ///< index of element in dense buffers by \ref layout (same as FIELD_INDEX in OpenCL source)
+		vec3<uint32_t> StorageCoords(size_t idx); ///< coordinates of element of index \b idx, inverse of \ref StorageIndex()
+		/** \brief index of element of drivers and scanners doesn't fit to uint32 (dense buffers have more than 2^32 elements) */
+		bool WideElements() {
+			vec3<uint32_t> g = BrickGrid();
+			uint64_t n = layout == LAYOUT_LINEAR ? (uint64_t)size.x * size.y * size.z : (uint64_t)g.x * g.y * g.z * FAS_BRICK * FAS_BRICK * FAS_BRICK;
+			return n > 0xFFFFFFFFull;
+		}
+		size_t ElementIndexSize() { return WideElements() ? sizeof(uint64_t) : sizeof(uint32_t); } ///< size of index of element of drivers and scanners on device
+		/** \brief Measures throughput of simulation step with each \ref layout_t on device, index of result = layout
+		 * \return elements * steps / s of each layout (SIM_NAIVE kernel, homogeneous field)
+		 **/
+		static std::vector<double> MeasureLayouts(device& d, vec3<uint32_t> size, size_t n_steps = 20);
+		void BricksArg(cl::Kernel& k, cl_uint index); ///< Sets argument \b index of drive / scan kernel to \ref buff_bricks if \ref sparse, else to NULL
+		void PmlStep(); ///< Replaces p(t+1) of PML shell elements calculated by sim_step with damped values, called by \ref SimStep() (buffers are already swapped)
+		void CollectInterface(); ///< Collects indices of elements on material interface into \ref buff_iface, called by \ref SimStep() automatically if \ref iface_dirty is set (\ref SIM_SPLIT only)
+		uint64_t RowsPrefixSum(cl::Buffer& buff_count, cl::Buffer& buff_psum); ///< Inclusive prefix sum of 2D array { size.y, size.z } of uint32 counts into \ref buff_psum (uint64), returns total sum; blocking
 		void FinishRms(); ///< Finishes calculation of RMS value in each element of field
-		data_t * Map_p_t_read(); ///< Maps actual buffer (whole 3D array) with p(t) to host memory as read-only memory and return pointer to this new region. Region is valid untill new simulation step or field destruction.
+		data_t * Map_p_t_read(); ///< Maps actual buffer (whole 3D array) with p(t) to host memory as read-only memory and return pointer to this new region. Region is valid untill new simulation step or field destruction. Converted copy is returned if storage type differs from data_t (\ref half_storage, \ref double_precision) or dense copy if \ref sparse.
 		data_t * Map_p_t_write(); ///< Maps actual buffer (whole 3D array) with p(t) to host memory as write-only memory and return pointer to this new region. Region is valid untill new simulation step or field destruction. After finish of write call \ref Unmap_p_t() to update device's memory.
 		void Unmap_p_t(); ///< Unmaps device memory from host mem space. Call it for update of devices memory after write. It is called implicitly from new Map_p_t_x() or destructor
 		data_t * Map_rms_read(); ///< Maps rms buffer (whole 3D array) to host memory as read-only memory and return pointer to this new region. Region is valid untill new simulation step or field destruction.
 		void Unmap_rms(); ///< Unmaps device memory from host mem space. It is called implicitly from new Map_rms_read() or destructor
-		void Finish() { cl_queue.finish(); } ///< global finish for all works in command queue (unique for this field), blocking
+		/** \brief Writes snapshot of simulation (both pressure buffers, rms, materials, PML state, steps and elements of drivers) to file
+		 *
+		 * Asynchronous: buffers are read by non-blocking reads enqueued after already enqueued steps, file is written by thread
+		 * (into temporary file renamed when complete), so simulation continues meanwhile. Two snapshots can be in flight, third
+		 * one waits for the oldest. Frames of scanners aren't part of snapshot, scanners are prepared again after \ref Restore().
+		 * Format is described by \ref checkpoint_header. Not supported for brick-sparse field and slab of \ref multi_field.
+		 * \param path output file
+		 * \param drivers drivers whose elements are stored (their elements can't be collected again, materials MSBs are cleared)
+		 **/
+		void Checkpoint(const std::string& path, const std::vector<driver*>& drivers = {});
+		/** \brief Restores simulation from file written by \ref Checkpoint(), blocking
+		 *
+		 * Field must be prepared with same size, storage type, RMS and PML settings. Drivers get elements stored in file
+		 * (number of drivers must match or be zero), their signals are kept.
+		 * \param path checkpoint file
+		 * \param drivers drivers of this field, in same order as given to \ref Checkpoint()
+		 **/
+		void Restore(const std::string& path, const std::vector<driver*>& drivers = {});
+		void CheckpointWait(); ///< Waits until all checkpoints are written, throws error of writer if any
+		void AutoCheckpoint(const std::vector<driver*>& drivers); ///< Writes checkpoint to \ref checkpoint_path if \ref checkpoint_every_steps or \ref checkpoint_every_seconds elapsed
+		void Finish() { if (backend == BACKEND_OPENCL) cl_queue.finish(); } ///< global finish for all works in command queue (unique for this field), blocking
+		bool Native() { return backend == BACKEND_NATIVE; } ///< field is calculated by \ref BACKEND_NATIVE
+		worker_pool& Workers(); ///< \ref workers, (re)created if \ref num_threads doesn't match
 
 		~field() {
 			Unmap_p_t(); // not realy needed ( ? )
 			Unmap_rms(); // not realy needed ( ? )
+			for (auto& io : ckpt_io) {
+				if (io.writer.joinable())
+					io.writer.join(); // data of writer are owned by field
+			}
 		}
 	};
 
+	/** \brief Acoustic field decomposed along Z axis into slabs, each slab is \ref field on its own \ref device
+	 *
+	 * Slab i owns planes [z_begin[i], z_begin[i + 1]) of the field. Slabs keep copy (halo) of the nearest plane of each neighbour
+	 * (plus one spare plane on top, last two planes of field aren't calculated by sim_step), halos are exchanged through host
+	 * memory after each step; owned planes next to halos are calculated first (\ref field::split_edges) and exchanged by
+	 * \ref field::io_queue while interior of slab is calculated. Thickness of slabs is proportional to \ref weights (measured throughput of devices by default).
+	 * \ref object, \ref driver and \ref scanner accept multi_field same as \ref field, coordinates are global.
+	 **/
+	struct multi_field {
+		std::vector<device*> devices; ///< one slab is calculated by each device
+		std::vector<double> weights; ///< relative throughput of \ref devices, empty: measured by \ref Prepare(), see \ref MeasureThroughput()
+		vec3<uint32_t> size = { 3,3,3 }; ///< size of whole field [elements]
+		data_t dx = 1e-6; ///< length of edge of CUBIC element [m]
+		data_t dt = 1e-9; ///< simulation time step [s]
+		std::vector<material> materials; ///< used materials, see \ref field::materials
+		std::vector<data_t> rms_window; ///< see \ref field::rms_window
+		field::sim_kernel_t sim_kernel = field::SIM_NAIVE; ///< see \ref field::sim_kernel, set it before \ref Prepare()
+		bool half_storage = false; ///< see \ref field::half_storage, set it before \ref Prepare()
+		bool double_precision = false; ///< see \ref field::double_precision, set it before \ref Prepare()
+		bool fast_math = false; ///< see \ref field::fast_math, set it before \ref Prepare()
+		bool profiling = false; ///< measure duration of kernels of each slab, set it before \ref Prepare(), see \ref SlabThroughput()
+		field::boundary_t boundary[6] = {}; ///< see \ref field::boundary, set it before \ref Prepare(); periodic z needs single slab
+
+		std::vector<cl::Device> numa_devs; ///< sub-devices (one per NUMA node) created by \ref UseNumaNodes()
+		std::vector<std::unique_ptr<device>> numa_nodes; ///< devices owned by this multi_field, created by \ref UseNumaNodes()
+		std::vector<std::unique_ptr<field>> slabs; ///< slab of each device, created by \ref Prepare()
+		std::vector<uint32_t> z_begin; ///< first plane owned by each slab, z_begin[slabs.size()] == size.z
+		std::vector<data_t> p_host; ///< whole p(t) gathered from slabs by \ref Map_p_t_read() / written by \ref Unmap_p_t()
+		bool p_host_write = false; ///< \ref p_host is mapped for write
+		std::vector<data_t> rms_host; ///< whole rms gathered from slabs by \ref Map_rms_read()
+
+		/** \brief staging of halo planes of one slab, double buffered by parity of step */
+		struct halo_io {
+			std::vector<uint8_t> lo[2]; ///< first owned plane, goes to upper halo of previous slab
+			std::vector<uint8_t> hi[2]; ///< last owned plane, goes to lower halo of next slab
+			cl::Event lo_read, hi_read; ///< reading of planes from this slab
+			cl::Event lo_written[2], hi_written[2]; ///< writing of staged planes into neighbours, staging buffer can be reused after it
+		};
+		std::vector<halo_io> halos; ///< one for each slab
+		int parity = 0; ///< staging buffers used by next \ref ExchangeHalos()
+		size_t report_step = 0; ///< step of last call of \ref SlabThroughput()
+
+		multi_field() {}
+		/**
+		*	\param devices valid and initialized devices, one slab for each
+		*	\param size size of whole field in X, Y and Z coordinates (cartesian) [elements]
+		*	\param dx length of cubic-element-edge [m]
+		*	\param dt time step of simulation [s]
+		**/
+		multi_field(const std::vector<device*>& devices, vec3<uint32_t> size, data_t dx = 1e-3, data_t dt = 1e-6) : devices(devices) {
+			this->size.x = size.x < 3 ? 3 : size.x;
+			this->size.y = size.y < 3 ? 3 : size.y;
+			this->size.z = size.z < 3 ? 3 : size.z;
+			this->dx = dx < 1e-6 ? 1e-6 : dx; // minimal element-edge is 1 um
+			this->dt = dt < 1e-9 ? 1e-9 : dt; // minimal time step is 1 ns
+		}
+
+		/** \brief Measures throughput of each device on small field of same XY size [elements * steps / s], blocking
+		 * \param devices valid and initialized devices
+		 * \param size XY size of field, Z size of test field is limited to 32 planes
+		 * \param n_steps number of measured steps
+		 **/
+		static std::vector<double> MeasureThroughput(const std::vector<device*>& devices, vec3<uint32_t> size, size_t n_steps = 20);
+		/** \brief Splits (CPU) device by NUMA affinity domain, each node calculates its own slab with memory first touched by its threads
+		 *
+		 * Replaces \ref devices by one \ref device for each sub-device (one device is used if partitioning isn't supported),
+		 * \ref weights are set equal. Call it before \ref Prepare().
+		 * \param dev physical device, typically CPU with several sockets
+		 * \param ocl_path see \ref device::Prepare()
+		 **/
+		void UseNumaNodes(cl::Device& dev, const char* ocl_path = nullptr);
+		void Prepare(bool want_rms = false); ///< Call only once, before use! Splits field into slabs and prepares them, see \ref field::Prepare()
+		void Clear(); ///< Reset of simulation, see \ref field::Clear()
+		void SimStep(); ///< Runs one step of simulation on all slabs and exchanges halos
+		/** \brief Runs \b n_steps steps of simulation including driving and scanning, see \ref field::Run()
+		 * \param n_steps number of steps
+		 * \param drivers drivers of this multi_field with already collected elements
+		 * \param scanners scanners prepared on this multi_field
+		 **/
+		void Run(size_t n_steps, const std::vector<driver*>& drivers = {}, const std::vector<scanner*>& scanners = {});
+		void ExchangeHalos(); ///< Copies boundary planes of slabs into halos of neighbours (along with calculation of interior), called by \ref SimStep()
+		void FinishRms(); ///< Finishes calculation of RMS value in each element of field
+		size_t StepsCalculated() { return slabs.empty() ? 0 : slabs[0]->steps_calculated; } ///< number of calculated steps
+		size_t SlabOf(uint32_t z); ///< index of slab owning plane \b z
+		std::vector<double> SlabThroughput(); ///< Waits for profiled kernels and returns throughput of each slab [elements * steps / s] since last call, needs \ref profiling
+		std::string ThroughputReport(); ///< Human-readable table of \ref SlabThroughput() (device, planes, Melements * steps / s) for each slab / NUMA node
+		data_t * Map_p_t_read(); ///< Gathers whole 3D array with p(t) to host memory, blocking, see \ref field::Map_p_t_read()
+		data_t * Map_p_t_write(); ///< Returns host memory (whole 3D array) for new p(t), call \ref Unmap_p_t() to write it to slabs
+		void Unmap_p_t(); ///< Writes host memory returned by \ref Map_p_t_write() to slabs (including halos)
+		data_t * Map_rms_read(); ///< Gathers whole 3D array with rms to host memory, blocking
+		void Finish() { for (auto& s : slabs) s->Finish(); } ///< global finish for all slabs, blocking
+	};
+
+	/** \brief Batch of small fields of same shape (members) calculated together, e.g. for parameter sweeps
+	 *
+	 * Buffers of all members are shared (member is slowest index), each step is one launch of sim_step_batch kernel for all members,
+	 * drivers and scanners of all members are driven / scanned by one launch too. Geometry and materials of each member are copied
+	 * from template \ref field (same device and size) by \ref SetMember(), so \ref object functions and transducers work as usual.
+	 * Calculation is in float, without RMS, PML, active box and temporal blocking.
+	 **/
+	struct field_batch {
+		device* d = nullptr; ///< OpenCL device on which batch resides
+		program* prg = nullptr; ///< default variant of program of \ref d
+		cl::CommandQueue cl_queue; ///< OpenCL command queue, in-order
+		vec3<uint32_t> size = { 3,3,3 }; ///< size of each member [elements]
+		uint32_t count = 0; ///< number of members
+		data_t dx = 1e-6; ///< length of edge of CUBIC element [m]
+		data_t dt = 1e-9; ///< simulation time step [s]
+		field::boundary_t boundary[6] = {}; ///< see \ref field::boundary, same for all members, set it before \ref SimStep()
+		size_t steps_calculated = 0; ///< number of calculated steps
+		uint32_t store_every_nth_frame = 1; ///< scanners store each n-th frame, see \ref Run()
+		uint32_t chunk_steps = 256; ///< steps whose samples of drivers are uploaded (and frames of scanners read) at once by \ref Run()
+
+		cl::Buffer buff_A; ///< see \ref field::buff_A, all members
+		cl::Buffer buff_B; ///< see \ref field::buff_B, all members
+		cl::Buffer buff_mat; ///< see \ref field::buff_mat, all members
+		cl::Buffer buff_tr; ///< table [count][n_mat][n_mat] of transmission coefficients, see \ref field::buff_tr
+		cl::Buffer buff_k; ///< array [count][n_mat] of (c * dt / dx)^2, see \ref field::buff_k
+		uint32_t n_mat = 0; ///< size of material table of each member in \ref buff_tr (longest table of members, others are padded)
+		bool tables_dirty = true; ///< \ref materials changed since last upload of \ref buff_tr and \ref buff_k
+		int p_buff = 0; ///< see \ref field::p_buff
+		std::vector<std::vector<material>> materials; ///< materials of each member, set by \ref SetMember()
+
+		std::vector<driver*> drivers; ///< driver (source of signal) of each slot, see \ref AddDriver()
+		std::vector<uint64_t> host_drv_elements; ///< index of each driven element in buffers of batch
+		std::vector<uint32_t> host_drv_slot; ///< driver slot of each driven element
+		cl::Buffer buff_drv_elements; ///< same as \ref host_drv_elements, uploaded by \ref Run()
+		cl::Buffer buff_drv_slot; ///< same as \ref host_drv_slot, uploaded by \ref Run()
+		/** \brief scanner of one member, frames are written to its own file */
+		struct member_scanner {
+			size_t first = 0; ///< first element in \ref host_scan_elements
+			size_t num_elements = 0; ///< number of elements
+			std::ofstream out_file;
+		};
+		std::vector<member_scanner> scanners; ///< see \ref AddScanner()
+		std::vector<uint64_t> host_scan_elements; ///< index of each scanned element in buffers of batch
+		cl::Buffer buff_scan_elements; ///< same as \ref host_scan_elements, uploaded by \ref Run()
+		cl::Buffer buff_frames; ///< frames of all scanners of one chunk of \ref Run()
+		bool transducers_dirty = false; ///< drivers or scanners were added since last upload
+		std::vector<data_t> p_host; ///< p(t) of one member read by \ref Map_p_t_read()
+
+		field_batch() {}
+		/**
+		*	\param d valid and initialized \ref device
+		*	\param size size of each member in X, Y and Z coordinates (cartesian) [elements]
+		*	\param count number of members
+		*	\param dx length of cubic-element-edge [m]
+		*	\param dt time step of simulation [s]
+		**/
+		field_batch(device& d, vec3<uint32_t> size, uint32_t count, data_t dx = 1e-3, data_t dt = 1e-6) : d(&d), count(count) {
+			this->size.x = size.x < 3 ? 3 : size.x;
+			this->size.y = size.y < 3 ? 3 : size.y;
+			this->size.z = size.z < 3 ? 3 : size.z;
+			this->dx = dx < 1e-6 ? 1e-6 : dx; // minimal element-edge is 1 um
+			this->dt = dt < 1e-9 ? 1e-9 : dt; // minimal time step is 1 ns
+		}
+
+		size_t Elements() { return (size_t)size.x * size.y * size.z; } ///< number of elements of one member
+		void Prepare(); ///< Call only once, before use! Allocates buffers of all members (pressure and materials #0)
+		void Clear(); ///< Reset of simulation, sets pressure of all members to 0.0 (materials are kept)
+		/** \brief Copies materials (buff_mat) and table of materials of template field into member \b member
+		 * \param member index of member
+		 * \param f prepared field on same device with same size, with drawn objects (OpenCL backend, dense, float)
+		 **/
+		void SetMember(uint32_t member, field& f);
+		/** \brief Adds driver of member, elements are taken from \b drv, signal is sampled by \ref driver::Sample() in each step
+		 * \param member index of member
+		 * \param drv driver with collected elements (in field of same size as member), must exist while batch is used
+		 **/
+		void AddDriver(uint32_t member, driver& drv);
+		/** \brief Adds scanner of member, returns its index in \ref scanners
+		 * \param member index of member
+		 * \param coords coordinates of elements, format: uint32 { x0, x1 ... xn, y1 .. yn, z1 .. zn }, see \ref scanner::PlaneCoords()
+		 * \param out_file_name output file of frames (raw float32, same format as \ref scanner)
+		 **/
+		size_t AddScanner(uint32_t member, const std::vector<uint32_t>& coords, std::string out_file_name);
+		void SimStep(); ///< Runs one step of simulation of all members (one kernel launch) and swaps pressure buffers
+		/** \brief Runs \b n_steps steps of all members including driving and scanning, see \ref field::Run()
+		 *
+		 * Samples of all drivers for \ref chunk_steps steps are uploaded at once, frames of all scanners are kept on device
+		 * and read at the end of chunk. Each step is one launch of drive, sim_step and scan kernel.
+		 **/
+		void Run(size_t n_steps);
+		data_t * Map_p_t_read(uint32_t member); ///< Reads p(t) of member to host memory (whole 3D array), blocking; valid until next call
+		void Finish() { cl_queue.finish(); } ///< global finish for all works in command queue, blocking
+	};
+
 	/** \brief Static functions for "drawing" (set of material property of elements) objects in acoustic field */
 	struct object {
 		static void CreateRect(field& f, vec3<uint32_t> pos, vec3<double> rot, vec2<uint32_t> size, uint8_t material);
@@ -227,13 +766,55 @@ namespace fas {
 		static void CreateCylinder(field& f, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material); // size.y = base.radius_a, size.y = base.radius_b, size.z = height
 		static void CreateEllipsoid(field& f, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material);
 		static void LoadVoxelMap(field& f, const char *path);
+		// same for each slab of multi_field, coordinates are global
+		static void CreateRect(multi_field& mf, vec3<uint32_t> pos, vec3<double> rot, vec2<uint32_t> size, uint8_t material);
+		static void CreateEllipse(multi_field& mf, vec3<uint32_t> pos, vec3<double> rot, vec2<uint32_t> size, uint8_t material);
+		static void CreateBox(multi_field& mf, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material);
+		static void CreateCylinder(multi_field& mf, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material);
+		static void CreateEllipsoid(multi_field& mf, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material);
+		static void LoadVoxelMap(multi_field& mf, const char *path);
+		// same for each slab of stream_field (drawn in device window, stored to host memory), coordinates are global
+		static void CreateRect(stream_field& sf, vec3<uint32_t> pos, vec3<double> rot, vec2<uint32_t> size, uint8_t material);
+		static void CreateEllipse(stream_field& sf, vec3<uint32_t> pos, vec3<double> rot, vec2<uint32_t> size, uint8_t material);
+		static void CreateBox(stream_field& sf, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material);
+		static void CreateCylinder(stream_field& sf, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material);
+		static void CreateEllipsoid(stream_field& sf, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material);
+		static void LoadVoxelMap(stream_field& sf, const char *path);
+	};
+
+	/** \brief C++ implementation of kernels for fields calculated on host CPU (\ref field::BACKEND_NATIVE), see fas_native.cpp
+	 *
+	 * Stencil uses AVX-512 or AVX2 (selected by CPU at runtime, x86 with GCC/Clang) or scalar code, field is divided into z-slabs
+	 * calculated by persistent threads (\ref field::num_threads, \ref field::workers), each thread walks its slab in blocks of rows reused by adjacent planes.
+	 * Calculation is in float (no \ref field::half_storage, no \ref field::double_precision).
+	 **/
+	struct native {
+		/** \brief shapes of \ref object, parameters are same as for corresponding kernels of fas.cl */
+		enum shape_t { SHAPE_RECT, SHAPE_ELLIPSE, SHAPE_BOX, SHAPE_CYLINDER, SHAPE_ELLIPSOID };
+
+		static const char* SimdName(); ///< instruction set used by stencil on this CPU ("AVX-512", "AVX2" or "scalar")
+		static void Clear(field& f); ///< same as clear kernel
+		static void SimStep(field& f); ///< same as sim_step kernel over active box (p(t) and p(t-1) selected by \ref field::p_buff, buffers aren't swapped)
+		static void RmsSum(field& f, data_t window, uint32_t z0, uint32_t z1); ///< same as rms_sum kernel for planes [z0, z1)
+		static void RmsFinal(field& f, data_t inv_steps, data_t inv_sqrt_nnpg); ///< same as rms_final kernel
+		static void PmlStep(field& f); ///< same as pml_step kernel for all \ref field::PmlBoxes() (called after swap of buffers)
+		static void Drive(field& f, const std::vector<uint64_t>& elements, data_t signal); ///< same as drive kernel
+		static void DriveValues(field& f, const std::vector<uint64_t>& elements, const data_t* values); ///< same as drive_array kernel, value of each element is given
+		static void Scan(field& f, const std::vector<uint64_t>& elements, data_t* out); ///< same as scan kernel
+		static void ScanPlane(field& f, const data_t* rot_pos, vec2<uint32_t> size, bool trilinear, data_t* out); ///< same as scan_plane kernel, \b size is size of plane
+		/** \brief Same as object_x kernels \param range global range of kernel \param two_height 2 * height of cylinder **/
+		static void Object(field& f, shape_t shape, const data_t* rot_pos, vec3<uint32_t> range, uint32_t two_height, uint8_t material);
+		static std::vector<std::vector<uint64_t>> CollectElements(field& f, const std::vector<uint8_t>& wanted_mat); ///< same as tdcr_x kernels: index of elements of each material of \b wanted_mat, clears MSBs of materials
 	};
 
 	/** \brief Parent struct of driver and scanner (pressure "microphone" array) - colection of elements */
 	struct transducer {
 		field* f = nullptr; ///< pointer to acoustic field, where transducer exists
 		size_t num_elements = 0; ///< number of elements of transducer
-		cl::Buffer buff_elements; ///< coordinate of each element of transducer format: uint32 { x0, x1 ... xn, y1 .. yn, z1 .. zn }
+		cl::Buffer buff_elements; ///< index (\ref field::StorageIndex()) of each element of transducer, sorted by address; uint32 or uint64 (see \ref field::WideElements())
+		std::vector<uint64_t> host_elements; ///< same as \ref buff_elements, used by \ref field::BACKEND_NATIVE
+		vec3<uint32_t> bbox_lo = { 0,0,0 }; ///< bounding box (inclusive) of elements, set by \ref CollectElements(), see \ref field::Activate()
+		vec3<uint32_t> bbox_hi = { 0,0,0 }; ///< see \ref bbox_lo
 
 		transducer() {}
 		/** \param f acoustic field, where transducer will exists **/
@@ -241,16 +822,65 @@ namespace fas {
 			this->f = &f;
 		}
 
-		void CollectElements(uint8_t my_idx); ///< Store coordinates of transducer's elements - elements with material number == my_idx
-		std::vector<uint32_t> GetElementsCoords(); ///< Return vector of coordinates of transducer's elements, format: uint32 { x0, x1 ... xn, y1 .. yn, z1 .. zn }
+		void CollectElements(uint8_t my_idx, bool allow_empty = false); ///< Store coordinates of transducer's elements - elements with material number == my_idx \param allow_empty don't throw if there is no such element (slab of \ref multi_field)
+		/** \brief Collects elements of several transducers by one scan of field (stream compaction on device), clears MSBs of all materials
+		 *
+		 * Elements of each transducer are sorted by address. Blocking, only number of elements of each transducer is read by host.
+		 * \param f field of all transducers
+		 * \param tdcrs \b tdcrs[i] gets elements with material number == \b my_idx[i]
+		 * \param my_idx material numbers (unique, max. 255 of them)
+		 * \param allow_empty don't throw if some transducer has no element (slab of \ref multi_field)
+		 **/
+		static void CollectElements(field& f, const std::vector<transducer*>& tdcrs, const std::vector<uint8_t>& my_idx, bool allow_empty = false);
+		std::vector<uint32_t> GetElementsCoords(); ///< Return vector of coordinates of transducer's elements (reconstructed from indices), format: uint32 { x0, x1 ... xn, y1 .. yn, z1 .. zn }
+		void SetElements(field& _f, const std::vector<uint32_t>& coords); ///< Stores given coordinates of elements (same format as \ref GetElementsCoords()) as sorted indices, e.g. restored by \ref field::Restore()
+		std::vector<uint64_t> GetIndices(); ///< Returns index of each element (see \ref buff_elements), blocking
+		void SetIndices(field& _f, const std::vector<uint64_t>& idx); ///< Stores index of each element (in given order) into \ref buff_elements, sets bounding box
 	};
 
 	/** \brief Driver - sets/drive acoustic pressure in each element */
 	struct driver : transducer {
 		driver() {}
 		driver(field& f) : transducer(f) {}
+		driver(multi_field& mf) : mf(&mf) {} ///< \param mf acoustic field, where driver will exists
+		/** \brief Parametric drive signal, evaluated in each step without stored samples */
+		struct generator {
+			enum type_t {
+				SAMPLES = 0, ///< no generator, \ref signal is used
+				CW, ///< continuous sine wave of \ref freq starting at time 0
+				TONE_BURST, ///< sine of \ref freq with Hann window of length \ref duration
+				CHIRP, ///< linear sweep from \ref freq to \ref freq_end of length \ref duration
+				GAUSSIAN, ///< Gaussian pulse (\ref centre, \ref width) modulated by \ref freq (if non-zero)
+			};
+			type_t type = SAMPLES;
+			data_t amplitude = 1.0f;
+			data_t freq = 0.0f; ///< frequency (start frequency of CHIRP) [Hz]
+			data_t freq_end = 0.0f; ///< end frequency of CHIRP [Hz]
+			data_t duration = 0.0f; ///< length of TONE_BURST and CHIRP [s]
+			data_t centre = 0.0f; ///< time of maximum of GAUSSIAN [s]
+			data_t width = 0.0f; ///< standard deviation of GAUSSIAN [s]
+		};
+		/// interpolation of \ref signal between samples
+		enum interp_t {
+			INTERP_HOLD = 0, ///< sample is held until next one (last sample not later than time, same as signal[time * sig_samp_freq])
+			INTERP_LINEAR,
+			INTERP_SINC, ///< Hann-windowed sinc of 2 * FAS_SINC_TAPS samples, for signals not sampled by 1 / dt
+		};
 		data_t sig_samp_freq; ///< sampling frequency of \ref signal
 		std::vector<data_t> signal; ///< drive signal, sampled by \ref sig_samp_freq
+		generator gen; ///< parametric signal used instead of \ref signal (if type isn't \ref generator::SAMPLES)
+		interp_t interp = INTERP_HOLD; ///< interpolation of \ref signal
+		cl::Buffer buff_signal; ///< \ref signal on device, see \ref UploadSignal()
+		cl::Buffer buff_gen; ///< parameters of \ref gen on device (float { amplitude, freq, freq_end, duration, centre, width })
+		multi_field* mf = nullptr; ///< field of driver if it exists in \ref multi_field (\ref f is not used)
+		std::vector<driver> parts; ///< driver of each slab of \ref mf, created by \ref CollectElements()
+
+		void CollectElements(uint8_t my_idx); ///< see \ref transducer::CollectElements(), collects elements in each slab of \ref mf
+		static void CollectElements(const std::vector<driver*>& drvs, const std::vector<uint8_t>& my_idx); ///< Collects elements of several drivers of same field (or \ref multi_field) by one scan, see \ref transducer::CollectElements()
+		std::vector<uint32_t> GetElementsCoords(); ///< see \ref transducer::GetElementsCoords(), global coordinates
+		data_t Sample(data_t time); ///< Returns value of \ref gen or interpolated \ref signal in \b time (0 outside of signal), same as drive_signal kernel
+		void UploadSignal(); ///< Uploads \ref signal and parameters of \ref gen to device, done by first \ref Drive(); call it after they are changed (blocking)
+		void DriveValue(data_t sample); ///< Sets pressure in each element of transducer to \b sample, non blocking
 
 		/** \brief Sets pressure in each element of transducer to value of \b signal
 		 *
@@ -261,26 +891,99 @@ namespace fas {
 		void Drive(data_t time);
 	};
 
+	/** \brief Phased array driver - channels (groups of elements) driven by delayed and weighted signals
+	 *
+	 * Channel \b i consists of elements of material \b my_idx[i] given to \ref CollectElements(). Each channel has its own delay,
+	 * gain and index of signal, all elements of array are driven by one launch of drive_array kernel, delayed signals are
+	 * interpolated linearly on device. Single \ref field only (not \ref multi_field).
+	 **/
+	struct driver_array : transducer {
+		driver_array() {}
+		driver_array(field& f) : transducer(f) {} ///< \param f acoustic field, where array will exists
+		data_t sig_samp_freq; ///< sampling frequency of all \ref signals
+		std::vector<std::vector<data_t>> signals; ///< drive signals, sampled by \ref sig_samp_freq
+		std::vector<data_t> delay; ///< delay of signal of each channel [s], see \ref Focus()
+		std::vector<data_t> gain; ///< gain (apodization) of each channel
+		std::vector<uint32_t> signal_idx; ///< index of signal (in \ref signals) of each channel
+		std::vector<vec3<data_t>> centre; ///< centre of elements of each channel [elements], set by \ref CollectElements()
+		std::vector<uint32_t> host_channel; ///< channel of each element
+		cl::Buffer buff_channel; ///< channel of each element (uint32)
+		cl::Buffer buff_delay; ///< \ref delay in samples (float)
+		cl::Buffer buff_gain; ///< see \ref gain
+		cl::Buffer buff_sig_idx; ///< see \ref signal_idx
+		cl::Buffer buff_signals; ///< all \ref signals one after another
+		cl::Buffer buff_sig_range; ///< { first sample, number of samples } of each signal (uint32)
+
+		size_t Channels() { return centre.size(); } ///< number of channels
+		/** \brief Collects elements of all channels by one scan of field, see \ref transducer::CollectElements()
+		 *
+		 * Sets \ref delay to 0, \ref gain to 1 and \ref signal_idx to 0 for each channel, if their sizes don't match.
+		 * \param my_idx material number (with MSB set) of each channel
+		 **/
+		void CollectElements(const std::vector<uint8_t>& my_idx);
+		/** \brief Sets \ref delay of channels, so waves of all channels reach \b point at the same time
+		 * \param point focus [elements], far point (e.g. 1e6 * direction) steers plane wave
+		 * \param c speed of sound [m/s]
+		 **/
+		void Focus(vec3<data_t> point, data_t c);
+		void Update(); ///< Uploads \ref signals, \ref delay, \ref gain and \ref signal_idx to device, call it after any of them is changed (blocking)
+		/** \brief Sets pressure in each element to value of signal of its channel in \b time - delay, multiplied by gain; non blocking
+		 * \param time simulation time ( = dt * step#)
+		 **/
+		void Drive(data_t time);
+	};
+
 	/**
 	 * \brief 	Scanner - scans acoustic pressure in each element and store it to out_file.
 	 * 			Scanner is always rectangular plane with edges of size.x * size.y. Can be rotaded around bottom-left corner (x=0; y=0).
+	 * 			Plane of \ref field is scanned by scan_plane kernel, which calculates position of each pixel from \ref rot_pos
+	 * 			(no list of elements), pressure is taken from element containing pixel or trilinearly interpolated (\ref interp).
 	 * \note 	For best performance use only rotation around X coordinate (if possible).
 	 * 
 	 */
 	struct scanner {
+		/** \brief sampling of pressure in pixels of plane */
+		enum interp_t {
+			INTERP_NEAREST = 0, ///< pressure of element containing pixel
+			INTERP_TRILINEAR = 1 ///< trilinear interpolation of 8 surrounding elements (not supported by \ref multi_field)
+		};
+
 		field* f = nullptr; ///< pointer to acoustic field, where transducer exists
 		size_t num_elements = 0; ///< number of elements of transducer
-		cl::Buffer buff_elements; ///< coordinate of each element of transducer format: uint32 { x0, x1 ... xn, y1 .. yn, z1 .. zn }
+		vec2<uint32_t> plane_size = vec2<uint32_t>(0u, 0u); ///< size of plane scanned by scan_plane kernel, 0 if elements are given by \ref SetElements()
+		data_t rot_pos[12] = {}; ///< position and rotation of plane: elements [0..8] rotation matrix, [9..11] position (same as object kernels)
+		interp_t interp = INTERP_NEAREST; ///< sampling of plane
+		cl::Buffer buff_rot_pos; ///< \ref rot_pos on device
+		cl::Buffer buff_elements; ///< index (\ref field::StorageIndex()) of each element in order of frame, uint32 or uint64 (see \ref field::WideElements()), not used by plane
 		cl::Buffer buff_data; ///< pressure in each element of transducer (device-side), ordes is same as element-coordinations order
+		std::vector<uint64_t> host_elements; ///< same as \ref buff_elements, used by \ref field::BACKEND_NATIVE
+		std::vector<data_t> host_data; ///< same as \ref buff_data, used by \ref field::BACKEND_NATIVE
 		std::ofstream out_file;
 		uint32_t store_every_nth_frame;
+		cl::Buffer buff_data_pipe; ///< second device buffer for pipelined scanning (frames alternate with \ref buff_data), allocated on first use
+		std::vector<data_t> pipe_host[2]; ///< host copies of frames read by \ref field::io_queue, [0] from \ref buff_data, [1] from \ref buff_data_pipe
+		cl::Event pipe_read[2]; ///< events of reading of frames into \ref pipe_host
+		bool pipe_pending[2] = { false, false }; ///< frame in \ref pipe_host is being read and wasn't written to file yet
+		int pipe_slot = 0; ///< slot used by next frame of pipelined scanning
+		multi_field* mf = nullptr; ///< field of scanner if it exists in \ref multi_field (\ref f is not used)
+		std::vector<scanner> parts; ///< scanner of each slab of \ref mf (without output file)
+		std::vector<std::vector<size_t>> part_index; ///< index in frame of each element of each part
+		std::vector<data_t> frame; ///< frame assembled from \ref parts
 
 		scanner() {};
-		scanner(field &f, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size, std::string out_file_name, uint32_t store_every_nth_frame = 1)
-			{ Prepare(f, position, rotation, size, out_file_name, store_every_nth_frame); }
+		scanner(field &f, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size, std::string out_file_name, uint32_t store_every_nth_frame = 1, interp_t interp = INTERP_NEAREST)
+			{ Prepare(f, position, rotation, size, out_file_name, store_every_nth_frame, interp); }
+		scanner(multi_field &mf, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size, std::string out_file_name, uint32_t store_every_nth_frame = 1, interp_t interp = INTERP_NEAREST)
+			{ Prepare(mf, position, rotation, size, out_file_name, store_every_nth_frame, interp); }
 		// ~scanner() { if(out_file.is_open()) out_file.close(); } file is closed by it's destructor
 
-		void Prepare(field &_f, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size, std::string out_file_name, uint32_t _store_every_nth_frame = 1);
+		void Prepare(field &_f, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size, std::string out_file_name, uint32_t _store_every_nth_frame = 1, interp_t _interp = INTERP_NEAREST);
+		void Prepare(multi_field &_mf, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size, std::string out_file_name, uint32_t _store_every_nth_frame = 1, interp_t _interp = INTERP_NEAREST); ///< see \ref Prepare(), elements are distributed to slabs (\ref INTERP_NEAREST only)
+		/** \brief Returns coordinates of elements of scanner, format: uint32 { x0, x1 ... xn, y1 .. yn, z1 .. zn }, clamped to \b limits **/
+		static std::vector<uint32_t> PlaneCoords(vec3<uint32_t> limits, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size);
+		void SetElements(field &_f, const std::vector<uint32_t>& coords); ///< Allocates device buffers and stores index of each element given by coordinates (no output file)
+		void SetPlane(field &_f, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size, interp_t _interp = INTERP_NEAREST); ///< Allocates device buffers of plane scanned by scan_plane kernel (no output file)
+		void OpenFile(std::string out_file_name); ///< Opens (truncates) output file
 
 		/** \brief Scans pressure of elements into buffer on device
 		 *
@@ -295,6 +998,97 @@ namespace fas {
 		 * \brief copy data from device memory to output file - call it after \ref Scan2devmem()
 		 */
 		void Scan2file();
+
+		/** \brief Scans pressure of elements and stores it to output file without stopping of simulation
+		 *
+		 * Frames alternate in two device buffers, each frame is read to host by \ref field::io_queue after scan kernel finishes.
+		 * Host waits only for frame scanned two frames ago (if not read yet) and writes it to file.
+		 * Call \ref Drain() after last step.
+		 **/
+		void ScanPipelined();
+		void Drain(); ///< Waits for all frames of pipelined scanning and writes them to output file
+		void EnqueueScan(cl::Buffer& out, cl::Event* evt = NULL); ///< enqueues scan or scan_plane kernel writing frame to \b out
+	};
+
+	/** \brief Acoustic field kept in host memory and streamed through device in z-slabs (out-of-core), for fields bigger than device memory
+	 *
+	 * Field is divided along Z into slabs of about \ref slab_planes planes. In each pass, every slab is uploaded with halo of
+	 * \ref halo planes on each side into one of two device-resident windows (fields sharing the device), advanced by up to
+	 * \ref halo steps (valid part of window shrinks by one plane per step) and its own planes are read back to host memory.
+	 * Uploads, calculation and downloads run in separate command queues, so transfers of one window overlap calculation of other one.
+	 * Device holds two windows only. OpenCL backend, float storage, no RMS, PML or scanners; pressure is read by \ref Map_p_t_read().
+	 **/
+	struct stream_field {
+		device* d = nullptr; ///< OpenCL device which calculates windows
+		vec3<uint32_t> size = { 3,3,3 }; ///< size of whole field [elements]
+		data_t dx = 1e-6; ///< length of edge of CUBIC element [m]
+		data_t dt = 1e-9; ///< simulation time step [s]
+		std::vector<material> materials; ///< see \ref field::materials, set it before \ref Prepare()
+		field::boundary_t boundary[6] = {}; ///< see \ref field::boundary, set it before \ref Prepare(); periodic z isn't supported
+		field::sim_kernel_t sim_kernel = field::SIM_NAIVE; ///< \ref field::SIM_NAIVE or \ref field::SIM_TILED, set it before \ref Prepare()
+		bool fast_math = false; ///< see \ref field::fast_math, set it before \ref Prepare()
+		uint32_t slab_planes = 64; ///< planes owned by one slab (last slabs may have more), set it before \ref Prepare()
+		uint32_t steps_per_pass = 4; ///< steps calculated by each slab per pass (more steps: less transfers, thicker halos), set it before \ref Prepare()
+		size_t steps_calculated = 0; ///< number of calculated steps
+
+		std::vector<data_t> host_p[2]; ///< p(t) [0] and p(t-1) [1] of whole field, updated in place by downloads of slabs
+		std::vector<uint8_t> host_mat; ///< materials of whole field
+		std::vector<uint32_t> z_begin; ///< first plane owned by each slab, z_begin[number of slabs] == size.z
+		uint32_t halo = 0; ///< planes of halo below slab (one more above) = maximal steps per pass, steps_per_pass clamped by thinnest slab
+		std::unique_ptr<field> win[2]; ///< device-resident windows, slab k is calculated in win[k % 2] (only win[0] if there is single slab)
+		int win_slab[2] = { -1,-1 }; ///< slab whose materials are loaded in window, -1: none
+		cl::CommandQueue up_queue; ///< host -> device transfers of windows
+		cl::CommandQueue down_queue; ///< device -> host transfers of own planes of slabs
+		std::vector<cl::Event> down_done; ///< last download of each slab, host planes of slab are final after it
+		cl::Event win_free[2]; ///< last download from each window, window may be overwritten after it
+		/** \brief driver and its elements in each slab's window */
+		struct stream_driver {
+			driver* drv = nullptr; ///< source of signal, see \ref driver::Sample()
+			std::vector<driver> parts; ///< elements inside of window of each slab (window coordinates), bound to its window
+		};
+		std::vector<stream_driver> drivers; ///< see \ref AddDriver()
+
+		stream_field() {}
+		/**
+		*	\param d valid and initialized \ref device
+		*	\param size size of whole field in X, Y and Z coordinates (cartesian) [elements]
+		*	\param dx length of cubic-element-edge [m]
+		*	\param dt time step of simulation [s]
+		**/
+		stream_field(device& d, vec3<uint32_t> size, data_t dx = 1e-3, data_t dt = 1e-6) : d(&d) {
+			this->size.x = size.x < 3 ? 3 : size.x;
+			this->size.y = size.y < 3 ? 3 : size.y;
+			this->size.z = size.z < 3 ? 3 : size.z;
+			this->dx = dx < 1e-6 ? 1e-6 : dx; // minimal element-edge is 1 um
+			this->dt = dt < 1e-9 ? 1e-9 : dt; // minimal time step is 1 ns
+		}
+
+		size_t Elements() { return (size_t)size.x * size.y * size.z; } ///< number of elements of whole field
+		size_t Slabs() { return z_begin.empty() ? 0 : z_begin.size() - 1; } ///< number of slabs
+		void Prepare(); ///< Call only once, before use! Allocates host memory of field, splits it into slabs and prepares windows on device
+		void Clear(); ///< Reset of simulation, sets pressure and materials of whole field to 0 (collected elements of drivers are kept)
+		/** \brief Loads materials of each slab (own planes only) into window, calls \b fn and stores materials back to host memory
+		 *
+		 * Used by \ref object functions, window has \ref field::z_offset of slab, so objects are drawn in global coordinates. Blocking.
+		 **/
+		void ForEachSlab(const std::function<void(field&)>& fn);
+		/** \brief Collects elements of material \b my_idx (see \ref transducer::CollectElements()) and drives them by signal of \b drv
+		 * \param drv source of signal, must exist while field is used; its own elements aren't used
+		 * \param my_idx material index (with MSB set) of elements
+		 **/
+		void AddDriver(driver& drv, uint8_t my_idx);
+		void Window(size_t k, uint32_t& w0, uint32_t& w1); ///< planes [w0, w1) of field held by window of slab \b k
+		void SetWindow(field& w, uint32_t w0, uint32_t w1); ///< sets window field \b w to hold planes [w0, w1) of field
+		/** \brief Advances whole field by \b steps (<= \ref halo) steps, one slab after another, non blocking
+		 *
+		 * Upload of slab waits for downloads of planes it reads (previous pass), download of slab waits for upload of next slab
+		 * (its lower halo are old planes of this slab), so host arrays are updated in place.
+		 **/
+		void Pass(uint32_t steps);
+		void Download(size_t k, const std::vector<cl::Event>& wait); ///< enqueues download of own planes of slab \b k after events \b wait
+		void Run(size_t n_steps); ///< Runs \b n_steps steps of simulation (passes of \ref halo steps) including driving, non blocking
+		data_t * Map_p_t_read(); ///< Waits for all transfers and returns p(t) of whole field in host memory, valid until next \ref Run()
+		void Finish(); ///< Waits for all windows and transfers, blocking
 	};
 
 };
@@ -2,6 +2,8 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <filesystem>
+#include <random>
 #include "fas.hpp"
 
 using namespace fas; // because I'm lazy ...
@@ -20,60 +22,211 @@ void device::Prepare(cl::Device& dev, const char* ocl_path) {
         throw std::runtime_error(s);
     }
 
-    // load & build program
-    std::cout << "Load and build OpenCL program for " << dev.getInfo<CL_DEVICE_NAME>() << "\n";
-    std::ifstream cl_src_file(ocl_path, std::ios::in);
-    if (cl_src_file.is_open() == false) {
-        std::string s = "ERR: Can't open OpenCL source file: \"";
-        s += ocl_path;
-        s += "\" (fas::device::Prepare())";
-        throw std::runtime_error(s);
+    // load program
+    if (ocl_path == nullptr) {
+        source = EmbeddedSource();
+    }
+    else {
+        std::ifstream cl_src_file(ocl_path, std::ios::in);
+        if (cl_src_file.is_open() == false) {
+            std::string s = "ERR: Can't open OpenCL source file: \"";
+            s += ocl_path;
+            s += "\" (fas::device::Prepare())";
+            throw std::runtime_error(s);
+        }
+        std::stringstream strStream;
+        strStream << cl_src_file.rdbuf();
+        source = strStream.str();
     }
-    std::stringstream strStream;
-    strStream << cl_src_file.rdbuf();
+
+    // build default variant of program
+    prg = &GetProgram("");
+}
+
+std::vector<cl::Device> device::NumaSubDevices(cl::Device& dev) {
+    std::vector<cl::Device> rv;
     try {
-        cl_program = std::move(cl::Program(cl_context, strStream.str(), false));
-        cl_program.build("");// -cl - no - signed - zeros - cl - fast - relaxed - math");
+        const cl_device_partition_property props[] = { CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0 };
+        dev.createSubDevices(props, &rv);
     }
-    catch (cl::Error& e)
-    {
-        if (e.err() == CL_BUILD_PROGRAM_FAILURE)
-        {
-            std::string s;
-            s = "ERR: OpenCL program build failed (fas::device::Prepare()):\n" + cl_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev);
-            throw std::runtime_error(s);
+    catch (cl::Error&) {
+        rv.clear(); // device can't be partitioned (GPU, single node ...)
+    }
+    if (rv.empty())
+        rv.push_back(dev);
+    return rv;
+}
+
+program& device::GetProgram(const std::string& options) {
+    auto it = programs.find(options);
+    if (it != programs.end())
+        return it->second; // already compiled
+
+    program& p = programs[options];
+    try {
+        p.Build(*this, options);
+    }
+    catch (...) {
+        programs.erase(options);
+        throw;
+    }
+    return p;
+}
+
+std::string device::DefaultCacheDir() {
+    std::error_code ec;
+    std::filesystem::path tmp = std::filesystem::temp_directory_path(ec);
+    if (ec)
+        return ""; // no temporary directory - no cache
+    return (tmp / "fas_cl_cache").string();
+}
+
+// FNV-1a, stable across runs and compilers (unlike std::hash)
+static uint64_t Fnv1a(const std::string& s, uint64_t h = 0xcbf29ce484222325ULL) {
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+cl::Program device::BuildCached(const std::string& options) {
+    // binary is valid only for same device, driver, options and source
+    std::string file;
+    if (!cache_dir.empty()) {
+        uint64_t h = Fnv1a(phy_dev->getInfo<CL_DEVICE_NAME>());
+        h = Fnv1a("\n" + phy_dev->getInfo<CL_DRIVER_VERSION>(), h);
+        h = Fnv1a("\n" + phy_dev->getInfo<CL_DEVICE_VERSION>(), h);
+        h = Fnv1a("\n" + options + "\n", h);
+        h = Fnv1a(source, h);
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)h);
+        file = (std::filesystem::path(cache_dir) / name).string();
+
+        std::ifstream in(file, std::ios::binary);
+        if (in.is_open()) {
+            std::vector<unsigned char> bin((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            try {
+                cl::Program p(cl_context, { *phy_dev }, cl::Program::Binaries{ bin });
+                p.build(options.c_str());
+                return p;
+            }
+            catch (cl::Error&) {
+                // damaged or incompatible binary - build from source and overwrite it
+            }
         }
-        else {
-            std::string s;
-            s = "ERR: OpenCL program error (fas::device::Prepare()):\n";
-            s += e.what();
-            throw std::runtime_error(s);
+    }
+
+    cl::Program p(cl_context, source, false);
+    p.build(options.c_str()); // throws on failure, see program::Require()
+
+    // store binary, cache is best-effort - errors are ignored
+    if (!file.empty()) {
+        try {
+            std::vector<std::vector<unsigned char>> bins = p.getInfo<CL_PROGRAM_BINARIES>();
+            std::error_code ec;
+            std::filesystem::create_directories(cache_dir, ec);
+            // write to unique temporary file first, other processes may read the cache at the same time
+            std::string tmp = file + "." + std::to_string(std::random_device()()) + ".tmp";
+            std::ofstream out(tmp, std::ios::binary);
+            if (!bins.empty() && !bins[0].empty() && out.is_open()) {
+                out.write(reinterpret_cast<const char*>(bins[0].data()), bins[0].size());
+                out.close();
+                if (out.good())
+                    std::filesystem::rename(tmp, file, ec);
+            }
+            std::filesystem::remove(tmp, ec);
         }
+        catch (cl::Error&) {}
+    }
+    return p;
+}
+
+void program::Build(device& _d, const std::string& _options) {
+    d = &_d;
+    options = _options;
+    Require(GROUP_CORE);
+}
+
+void program::Require(group_t g) {
+    cl::Program& prog = cl_program[g - 1];
+    if (prog() != nullptr)
+        return; // already built
+
+    // build program
+    std::cout << "Load and build OpenCL program (group " << g << ") for " << d->phy_dev->getInfo<CL_DEVICE_NAME>() << " (options: \"" << options << "\")\n";
+    try {
+        std::string all_options = "-D FAS_TILE_X=" + std::to_string(FAS_TILE_X) + " -D FAS_TILE_Y=" + std::to_string(FAS_TILE_Y);
+        all_options += " -D FAS_TB_X=" + std::to_string(FAS_TB_X) + " -D FAS_TB_Y=" + std::to_string(FAS_TB_Y);
+        all_options += " -D FAS_TB_MAX_STEPS=" + std::to_string(FAS_TB_MAX_STEPS) + " -D FAS_BRICK=" + std::to_string(FAS_BRICK);
+        all_options += " -D FAS_COMPACT_WG=" + std::to_string(FAS_COMPACT_WG) + " -D FAS_SINC_TAPS=" + std::to_string(FAS_SINC_TAPS);
+        all_options += " -D FAS_GROUP=" + std::to_string(g);
+        all_options += " " + options;
+        prog = d->BuildCached(all_options);
+    }
+    catch (cl::BuildError& e)
+    {
+        std::string s;
+        s = "ERR: OpenCL program build failed (fas::program::Require()):\n";
+        for (auto& log : e.getBuildLog())
+            s += log.second;
+        throw std::runtime_error(s);
+    }
+    catch (cl::Error& e)
+    {
+        std::string s;
+        s = "ERR: OpenCL program error (fas::program::Require()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
     }
 
     // create kernels
     std::cout << "Creating kernels\n";
     try {
-        clear_kernel = std::move(cl::Kernel( cl_program, "clear" ));
-        sim_step_kernel = std::move(cl::Kernel( cl_program, "sim_step" ));
-        rms_sum_kernel = std::move(cl::Kernel( cl_program, "rms_sum" ));
-        rms_final_kernel = std::move(cl::Kernel( cl_program, "rms_final" ));
-        object_rect_kernel = std::move(cl::Kernel(cl_program, "object_rect"));
-        object_ellipse_kernel = std::move(cl::Kernel(cl_program, "object_ellipse"));
-        object_box_kernel = std::move(cl::Kernel(cl_program, "object_box"));
-        object_cylinder_kernel = std::move(cl::Kernel(cl_program, "object_cylinder"));
-        object_ellipsoid_kernel = std::move(cl::Kernel( cl_program, "object_ellipsoid" ));
-        tdcr_count_elements_kernel = std::move(cl::Kernel( cl_program, "tdcr_count_elements" ));
-        tdcr_collect_elements_kernel = std::move(cl::Kernel( cl_program, "tdcr_collect_elements" ));
-        tdcr_clear_mat_MSBs_kernel = std::move(cl::Kernel( cl_program, "tdcr_clear_mat_MSBs" ));
-        drive_kernel = std::move(cl::Kernel(cl_program, "drive"));
-        scan_kernel = std::move(cl::Kernel( cl_program, "scan" ));
-        horizontal_prefix_sum_uint_ulong_kernel = std::move(cl::Kernel( cl_program, "horizontal_prefix_sum_uint_ulong" ));
-        vertical_prexix_sum_ulong_kernel = std::move(cl::Kernel( cl_program, "vertical_prexix_sum_ulong" ));
+        switch (g) {
+        case GROUP_CORE:
+            clear_kernel = std::move(cl::Kernel( prog, "clear" ));
+            sim_step_kernel = std::move(cl::Kernel( prog, "sim_step" ));
+            sim_step_tiled_kernel = std::move(cl::Kernel( prog, "sim_step_tiled" ));
+            sim_step_lean_kernel = std::move(cl::Kernel( prog, "sim_step_lean" ));
+            sim_step_iface_kernel = std::move(cl::Kernel( prog, "sim_step_iface" ));
+            iface_count_kernel = std::move(cl::Kernel( prog, "iface_count" ));
+            iface_collect_kernel = std::move(cl::Kernel( prog, "iface_collect" ));
+            sim_steps_blocked_kernel = std::move(cl::Kernel( prog, "sim_steps_blocked" ));
+            drv_mark_kernel = std::move(cl::Kernel( prog, "drv_mark" ));
+            rms_sum_kernel = std::move(cl::Kernel( prog, "rms_sum" ));
+            rms_final_kernel = std::move(cl::Kernel( prog, "rms_final" ));
+            pml_step_kernel = std::move(cl::Kernel( prog, "pml_step" ));
+            sim_step_sparse_kernel = std::move(cl::Kernel( prog, "sim_step_sparse" ));
+            drive_kernel = std::move(cl::Kernel(prog, "drive"));
+            drive_array_kernel = std::move(cl::Kernel( prog, "drive_array" ));
+            drive_signal_kernel = std::move(cl::Kernel( prog, "drive_signal" ));
+            scan_kernel = std::move(cl::Kernel( prog, "scan" ));
+            scan_plane_kernel = std::move(cl::Kernel( prog, "scan_plane" ));
+            sim_step_batch_kernel = std::move(cl::Kernel( prog, "sim_step_batch" ));
+            drive_batch_kernel = std::move(cl::Kernel( prog, "drive_batch" ));
+            scan_batch_kernel = std::move(cl::Kernel( prog, "scan_batch" ));
+            break;
+        case GROUP_OBJECTS:
+            object_rect_kernel = std::move(cl::Kernel(prog, "object_rect"));
+            object_ellipse_kernel = std::move(cl::Kernel(prog, "object_ellipse"));
+            object_box_kernel = std::move(cl::Kernel(prog, "object_box"));
+            object_cylinder_kernel = std::move(cl::Kernel(prog, "object_cylinder"));
+            object_ellipsoid_kernel = std::move(cl::Kernel( prog, "object_ellipsoid" ));
+            break;
+        case GROUP_INDEXING:
+            tdcr_count_chunks_kernel = std::move(cl::Kernel( prog, "tdcr_count_chunks" ));
+            tdcr_scan_counts_kernel = std::move(cl::Kernel( prog, "tdcr_scan_counts" ));
+            tdcr_compact_kernel = std::move(cl::Kernel( prog, "tdcr_compact" ));
+            horizontal_prefix_sum_uint_ulong_kernel = std::move(cl::Kernel( prog, "horizontal_prefix_sum_uint_ulong" ));
+            vertical_prexix_sum_ulong_kernel = std::move(cl::Kernel( prog, "vertical_prexix_sum_ulong" ));
+            break;
+        }
     }
     catch (cl::Error& e) {
+        prog = cl::Program(); // try it again next time
         std::string s;
-        s = "ERR: Can't create kernels (fas::device::Prepare()):\n";
+        s = "ERR: Can't create kernels (fas::program::Require()):\n";
         s += e.what();
         throw std::runtime_error(s);
     }
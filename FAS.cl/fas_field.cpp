@@ -3,27 +3,297 @@
 #include <sstream>
 #include <vector>
 #include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include "fas.hpp"
+#include "CL/cl_half.h"
 
 using namespace fas;
 
+static const size_t brick_elements = FAS_BRICK * FAS_BRICK * FAS_BRICK;
+
+// converts array from storage type of device buffer (half / float / double, given by size of element) to data_t
+static void StorageToHost(const void* src, size_t elem_size, data_t* dst, size_t n) {
+    if (elem_size == 2) {
+        const cl_half* h = static_cast<const cl_half*>(src);
+        for (size_t i = 0; i < n; i++)
+            dst[i] = (data_t)cl_half_to_float(h[i]);
+    }
+    else if (elem_size == sizeof(double)) {
+        const double* d = static_cast<const double*>(src);
+        for (size_t i = 0; i < n; i++)
+            dst[i] = (data_t)d[i];
+    }
+    else {
+        const float* f = static_cast<const float*>(src);
+        for (size_t i = 0; i < n; i++)
+            dst[i] = (data_t)f[i];
+    }
+}
+
+// converts array of data_t or double to storage type of device buffer, see StorageToHost()
+template<typename T>
+static void HostToStorage(const T* src, void* dst, size_t elem_size, size_t n) {
+    if (elem_size == 2) {
+        cl_half* h = static_cast<cl_half*>(dst);
+        for (size_t i = 0; i < n; i++)
+            h[i] = cl_half_from_float((float)src[i], CL_HALF_RTE);
+    }
+    else if (elem_size == sizeof(double)) {
+        double* d = static_cast<double*>(dst);
+        for (size_t i = 0; i < n; i++)
+            d[i] = (double)src[i];
+    }
+    else {
+        float* f = static_cast<float*>(dst);
+        for (size_t i = 0; i < n; i++)
+            f[i] = (float)src[i];
+    }
+}
+
+// material with MSB set (element of transducer) has no row in tables of coefficients, see object::CreateRect()
+static void RequireCollected(field& f, const char* fn) {
+    if (f.marked_elements)
+        throw std::runtime_error(std::string("ERR: Field contains uncollected elements of transducers (material MSB set), call transducer::CollectElements() first (fas::field::") + fn + ")");
+}
+
+void field::MaterialTables(const std::vector<material>& materials, double dt, double dx, std::vector<double>& tr_tab, std::vector<double>& k_tab) {
+    size_t n_mat = materials.size();
+    tr_tab.resize(n_mat * n_mat);
+    k_tab.resize(n_mat);
+    for (size_t my = 0; my < n_mat; my++) {
+        double my_r = materials[my].r;
+        double cdt_dx = (double)materials[my].c * dt / dx;
+        k_tab[my] = cdt_dx * cdt_dx;
+        for (size_t n = 0; n < n_mat; n++) {
+            tr_tab[my * n_mat + n] = 2.0 * my_r / (my_r + materials[n].r);
+        }
+    }
+}
+
+// copies elements (of elem_size B) of allocated bricks between dense array (whole field) and brick-sparse array, see field::Sparsify()
+// to_sparse: dense -> sparse, otherwise sparse -> dense (elements of not allocated bricks aren't touched)
+static void BrickCopy(field& f, const void* src, void* dst, size_t elem_size, bool to_sparse) {
+    vec3<uint32_t> grid = f.BrickGrid();
+    size_t plane = (size_t)f.size.x * f.size.y;
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+    uint8_t* d = static_cast<uint8_t*>(dst);
+    for (size_t i = 0; i < f.num_bricks; i++) {
+        uint32_t b = f.host_brick_list[i];
+        uint32_t x0 = b % grid.x * FAS_BRICK;
+        uint32_t y0 = b / grid.x % grid.y * FAS_BRICK;
+        uint32_t z0 = b / (grid.x * grid.y) * FAS_BRICK;
+        size_t row = (size_t)std::min<uint32_t>(FAS_BRICK, f.size.x - x0) * elem_size; // bricks on edge of field are cut
+        for (uint32_t z = z0; z < std::min<uint32_t>(z0 + FAS_BRICK, f.size.z); z++) {
+            for (uint32_t y = y0; y < std::min<uint32_t>(y0 + FAS_BRICK, f.size.y); y++) {
+                size_t dense = (z * plane + (size_t)y * f.size.x + x0) * elem_size;
+                size_t sp = ((i * FAS_BRICK + z - z0) * FAS_BRICK + y - y0) * FAS_BRICK * elem_size;
+                if (to_sparse)
+                    memcpy(d + sp, s + dense, row);
+                else
+                    memcpy(d + dense, s + sp, row);
+            }
+        }
+    }
+}
+
+// copies elements (of elem_size B) between linear array (whole field) and dense buffer in non-linear field::layout
+// to_storage: linear -> layout, otherwise layout -> linear (padding of bricks isn't touched)
+static void LayoutCopy(field& f, const void* src, void* dst, size_t elem_size, bool to_storage) {
+    const uint8_t* s = static_cast<const uint8_t*>(src);
+    uint8_t* d = static_cast<uint8_t*>(dst);
+    size_t linear = 0;
+    for (uint32_t z = 0; z < f.size.z; z++) {
+        for (uint32_t y = 0; y < f.size.y; y++) {
+            for (uint32_t x = 0; x < f.size.x; x++, linear++) {
+                size_t st = f.StorageIndex(x, y, z);
+                if (to_storage)
+                    memcpy(d + st * elem_size, s + linear * elem_size, elem_size);
+                else
+                    memcpy(d + linear * elem_size, s + st * elem_size, elem_size);
+            }
+        }
+    }
+}
+
+// copies elements between linear array of Map_x() functions and buffer of remapped field (brick-sparse or non-linear layout)
+static void StorageCopy(field& f, const void* src, void* dst, size_t elem_size, bool to_storage) {
+    if (f.sparse)
+        BrickCopy(f, src, dst, elem_size, to_storage);
+    else
+        LayoutCopy(f, src, dst, elem_size, to_storage);
+}
+
+size_t field::StorageIndex(uint32_t x, uint32_t y, uint32_t z) {
+    if (layout == LAYOUT_LINEAR)
+        return (size_t)z * size.x * size.y + (size_t)y * size.x + x;
+    vec3<uint32_t> grid = BrickGrid();
+    size_t brick = ((size_t)(z / FAS_BRICK) * grid.y + y / FAS_BRICK) * grid.x + x / FAS_BRICK;
+    uint32_t bx = x % FAS_BRICK, by = y % FAS_BRICK, bz = z % FAS_BRICK;
+    size_t in_brick = 0;
+    if (layout == LAYOUT_MORTON) {
+        for (uint32_t b = 0; (1u << b) < FAS_BRICK; b++) // same as morton3() in OpenCL source
+            in_brick |= (size_t)(((bx >> b) & 1u) | (((by >> b) & 1u) << 1) | (((bz >> b) & 1u) << 2)) << (3 * b);
+    }
+    else
+        in_brick = ((size_t)bz * FAS_BRICK + by) * FAS_BRICK + bx;
+    return brick * brick_elements + in_brick;
+}
+
+vec3<uint32_t> field::StorageCoords(size_t idx) {
+    if (layout == LAYOUT_LINEAR)
+        return vec3<uint32_t>((uint32_t)(idx % size.x), (uint32_t)(idx / size.x % size.y), (uint32_t)(idx / size.x / size.y));
+    vec3<uint32_t> grid = BrickGrid();
+    size_t brick = idx / brick_elements;
+    uint32_t in_brick = (uint32_t)(idx % brick_elements);
+    uint32_t bx = 0, by = 0, bz = 0;
+    if (layout == LAYOUT_MORTON) {
+        for (uint32_t b = 0; (1u << b) < FAS_BRICK; b++) {
+            bx |= ((in_brick >> (3 * b)) & 1u) << b;
+            by |= ((in_brick >> (3 * b + 1)) & 1u) << b;
+            bz |= ((in_brick >> (3 * b + 2)) & 1u) << b;
+        }
+    }
+    else {
+        bx = in_brick % FAS_BRICK;
+        by = in_brick / FAS_BRICK % FAS_BRICK;
+        bz = in_brick / (FAS_BRICK * FAS_BRICK);
+    }
+    return vec3<uint32_t>((uint32_t)(brick % grid.x) * FAS_BRICK + bx, (uint32_t)(brick / grid.x % grid.y) * FAS_BRICK + by,
+                          (uint32_t)(brick / grid.x / grid.y) * FAS_BRICK + bz);
+}
+
+std::string field::BuildOptions() {
+    std::string options;
+    auto add = [&options](const std::string& o) {
+        if (!options.empty())
+            options += " ";
+        options += o;
+    };
+    if (half_storage)
+        add("-D FAS_HALF=1");
+    if (half_rms)
+        add("-D FAS_HALF_RMS=1");
+    if (double_precision)
+        add("-D FAS_DOUBLE=1");
+    if (layout != LAYOUT_LINEAR)
+        add("-D FAS_LAYOUT=" + std::to_string((int)layout));
+    if (WideElements())
+        add("-D FAS_ELEMENT_T=ulong");
+    if (specialize) {
+        add("-D FAS_X_SIZE=" + std::to_string(size.x) + " -D FAS_Y_SIZE=" + std::to_string(size.y) + " -D FAS_Z_SIZE=" + std::to_string(size.z));
+        add("-D FAS_N_MAT=" + std::to_string(materials.size()));
+    }
+    if (fast_math)
+        add("-cl-mad-enable -cl-fast-relaxed-math");
+    return options;
+}
+
 void field::Prepare(bool want_rms) {
     calc_rms = want_rms;
+    if (materials.size() > 256)
+        materials.resize(256); // cut out-of-range (max 256 materials can be used)
+    if (materials.empty())
+        throw std::runtime_error("ERR: No materials defined (fas::field::Prepare())");
+    size_t n_mat = materials.size();
+    if (pml_cells) {
+        if (halo_lo || z_offset)
+            throw std::runtime_error("ERR: PML can't be used by slab of multi_field (fas::field::Prepare())");
+        if (size.x - 2 <= 2 * pml_cells || size.y - 2 <= 2 * pml_cells || size.z - 3 <= 2 * pml_cells)
+            throw std::runtime_error("ERR: Field is too small for PML of field.pml_cells elements (fas::field::Prepare())");
+        if (pml_reflection <= 0.0f || pml_reflection >= 1.0f)
+            throw std::runtime_error("ERR: field.pml_reflection must be in range (0, 1) (fas::field::Prepare())");
+    }
+    for (int a = 0; a < 3; a++) {
+        if ((boundary[2 * a] == BOUNDARY_PERIODIC) != (boundary[2 * a + 1] == BOUNDARY_PERIODIC))
+            throw std::runtime_error("ERR: Periodic boundary must be set on both faces of axis (fas::field::Prepare())");
+    }
+    if (((boundary[0] == BOUNDARY_MIRROR || boundary[1] == BOUNDARY_MIRROR) && size.x < 4) ||
+        ((boundary[2] == BOUNDARY_MIRROR || boundary[3] == BOUNDARY_MIRROR) && size.y < 4) ||
+        ((boundary[4] == BOUNDARY_MIRROR || boundary[5] == BOUNDARY_MIRROR) && size.z < 5))
+        throw std::runtime_error("ERR: Mirror boundary needs at least 2 calculated elements along axis (fas::field::Prepare())");
+    if (pml_cells && CustomBoundary())
+        throw std::runtime_error("ERR: PML can't be combined with field.boundary modes, use BOUNDARY_DEFAULT (fas::field::Prepare())");
+    if ((halo_lo || z_offset) && (boundary[4] == BOUNDARY_PERIODIC))
+        throw std::runtime_error("ERR: Slab of multi_field can't be periodic along z (fas::field::Prepare())");
+    if (layout != LAYOUT_LINEAR) {
+        // other kernels address neighbours by linear index arithmetic
+        if (backend == BACKEND_NATIVE || sim_kernel != SIM_NAIVE || pml_cells || halo_lo || z_offset)
+            throw std::runtime_error("ERR: Non-linear field.layout needs OpenCL backend, SIM_NAIVE kernel, no PML and no multi_field (fas::field::Prepare())");
+    }
+    ActivateAll(); // content of buffers is unknown until Clear()
+    sparse = false; // dense buffers are allocated below
+    num_bricks = 0;
+    host_brick_list.clear();
+    num_pml = 0;
+    for (auto& b : PmlBoxes())
+        num_pml += (size_t)b.extent.x * b.extent.y * b.extent.z;
+    if (backend == BACKEND_NATIVE) {
+        if (half_storage || half_rms || double_precision)
+            throw std::runtime_error("ERR: Native backend calculates in float, clear field.half_storage, half_rms and double_precision (fas::field::Prepare())");
+        size_t elements = (size_t)size.x * size.y * size.z;
+        try {
+            host_A.assign(elements, 0.0f);
+            host_B.assign(elements, 0.0f);
+            host_mat.assign(elements, 0);
+            if (calc_rms)
+                host_rms.assign(elements, 0.0f);
+            host_pml.assign(6 * num_pml, 0.0f);
+        }
+        catch (std::bad_alloc& e) {
+            throw std::runtime_error("ERR: Can't allocate memory of field (fas::field::Prepare()):\n" + std::string(e.what()));
+        }
+        std::vector<double> tr_tab, k_tab;
+        MaterialTables(materials, dt, dx, tr_tab, k_tab);
+        host_tr.assign(tr_tab.begin(), tr_tab.end());
+        host_k.assign(k_tab.begin(), k_tab.end());
+        return;
+    }
+    if (double_precision && d->phy_dev->getInfo<CL_DEVICE_DOUBLE_FP_CONFIG>() == 0)
+        throw std::runtime_error("ERR: Device doesn't support double precision, clear field.double_precision (fas::field::Prepare())");
+    // transmission coefficients table resides in constant memory
+    size_t max_const = d->phy_dev->getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
+    if (RealSize() * n_mat * n_mat > max_const) {
+        std::string s;
+        s = "ERR: Table of transmission coefficients for ";
+        s += std::to_string(n_mat);
+        s += " materials doesn't fit into constant memory of device (";
+        s += std::to_string(max_const);
+        s += " B), use less materials (fas::field::Prepare())";
+        throw std::runtime_error(s);
+    }
+    // select (and compile if needed) variant of program
+    prg = &d->GetProgram(BuildOptions());
+    // check if selected variant of sim_step kernel can run on device
+    if (sim_kernel == SIM_TILED) {
+        size_t max_wg = prg->sim_step_tiled_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(*(d->phy_dev));
+        if (max_wg < (size_t)FAS_TILE_X * FAS_TILE_Y) {
+            std::string s;
+            s = "ERR: Device can't run tiled sim_step kernel, maximal work-group size is ";
+            s += std::to_string(max_wg);
+            s += " (fas::field::Prepare())";
+            throw std::runtime_error(s);
+        }
+    }
     // create & allocate buffers, create command queue
     //std::cout << "Allocate memory on the device.\n";
     try {
-        size_t elements = (size_t)size.x * size.y * size.z;
-        buff_A = std::move(cl::Buffer( d->cl_context, CL_MEM_READ_WRITE, sizeof(data_t) * elements ));
-        buff_B = std::move(cl::Buffer( d->cl_context, CL_MEM_READ_WRITE, sizeof(data_t) * elements ));
+        size_t elements = StorageElements(); // bricks of non-linear layout are padded
+        buff_A = std::move(cl::Buffer( d->cl_context, CL_MEM_READ_WRITE, PSize() * elements ));
+        buff_B = std::move(cl::Buffer( d->cl_context, CL_MEM_READ_WRITE, PSize() * elements ));
         if (calc_rms)
         {
-            buff_rms = std::move(cl::Buffer( d->cl_context, CL_MEM_READ_WRITE, sizeof(data_t) * elements ));
+            buff_rms = std::move(cl::Buffer( d->cl_context, CL_MEM_READ_WRITE, RmsSize() * elements ));
         }
         buff_mat = std::move(cl::Buffer(d->cl_context, CL_MEM_READ_WRITE, sizeof(uint8_t) * elements ));
-        buff_c = std::move(cl::Buffer(d->cl_context, CL_MEM_READ_ONLY, sizeof(data_t) * 256 )); // maximum 256 materials in one simulation
-        buff_r = std::move(cl::Buffer( d->cl_context, CL_MEM_READ_ONLY, sizeof(data_t) * 256 ));
-        // create command queue
-        cl_queue = std::move(cl::CommandQueue(d->cl_context, *(d->phy_dev), CL_QUEUE_PROFILING_ENABLE));
+        buff_tr = std::move(cl::Buffer(d->cl_context, CL_MEM_READ_ONLY, RealSize() * n_mat * n_mat ));
+        buff_k = std::move(cl::Buffer( d->cl_context, CL_MEM_READ_ONLY, RealSize() * n_mat ));
+        if (num_pml)
+            buff_pml = std::move(cl::Buffer( d->cl_context, CL_MEM_READ_WRITE, RealSize() * 6 * num_pml ));
+        // create command queues
+        cl_queue = std::move(cl::CommandQueue(d->cl_context, *(d->phy_dev), profiling ? CL_QUEUE_PROFILING_ENABLE : 0));
+        io_queue = std::move(cl::CommandQueue(d->cl_context, *(d->phy_dev), 0));
     }
     catch (cl::Error& e) {
         std::string s;
@@ -31,18 +301,16 @@ void field::Prepare(bool want_rms) {
         s += e.what();
         throw std::runtime_error(s);
     }
-    // copy materials to device
+    // precompute material-pair coefficients (in double) and copy them to device in type of calculation
     try {
-        data_t * c_arr = static_cast<data_t*>(cl_queue.enqueueMapBuffer(buff_c, CL_TRUE, CL_MAP_WRITE, 0, sizeof(data_t) * 256));
-        data_t * r_arr = static_cast<data_t*>(cl_queue.enqueueMapBuffer(buff_r, CL_TRUE, CL_MAP_WRITE, 0, sizeof(data_t) * 256));
-        if (materials.size() > 256)
-            materials.resize(256); // cut out-of-range (max 256 materials can be used)
-        for (int i = 0; i < (int)materials.size(); i++) {
-            c_arr[i] = materials[i].c;
-            r_arr[i] = materials[i].r;
-        }
-        cl_queue.enqueueUnmapMemObject(buff_r, r_arr);
-        cl_queue.enqueueUnmapMemObject(buff_c, c_arr);
+        std::vector<double> tr_tab, k_tab;
+        MaterialTables(materials, dt, dx, tr_tab, k_tab);
+        void * tr_arr = cl_queue.enqueueMapBuffer(buff_tr, CL_TRUE, CL_MAP_WRITE, 0, RealSize() * n_mat * n_mat);
+        void * k_arr = cl_queue.enqueueMapBuffer(buff_k, CL_TRUE, CL_MAP_WRITE, 0, RealSize() * n_mat);
+        HostToStorage(tr_tab.data(), tr_arr, RealSize(), n_mat * n_mat);
+        HostToStorage(k_tab.data(), k_arr, RealSize(), n_mat);
+        cl_queue.enqueueUnmapMemObject(buff_k, k_arr);
+        cl_queue.enqueueUnmapMemObject(buff_tr, tr_arr);
         cl_queue.enqueueBarrierWithWaitList();
     }
     catch (cl::Error& e) {
@@ -54,15 +322,37 @@ void field::Prepare(bool want_rms) {
 }
 
 void field::Clear() {
+    if (backend == BACKEND_NATIVE) {
+        native::Clear(*this);
+        std::fill(host_pml.begin(), host_pml.end(), 0.0f);
+        steps_calculated = 0;
+        marked_elements = false; // all materials set to #0
+        ClearActive();
+        return;
+    }
     try {
-        d->clear_kernel.setArg(0, buff_A);
-        d->clear_kernel.setArg(1, buff_B);
-        d->clear_kernel.setArg(2, buff_mat);
+        if (sparse) {
+            // materials can't be drawn again into brick-sparse buffer, they are kept
+            size_t elements = StorageElements();
+            cl_queue.enqueueFillBuffer(buff_A, (cl_uchar)0, 0, PSize() * elements);
+            cl_queue.enqueueFillBuffer(buff_B, (cl_uchar)0, 0, PSize() * elements);
+            if (calc_rms)
+                cl_queue.enqueueFillBuffer(buff_rms, (cl_uchar)0, 0, RmsSize() * elements);
+            cl_queue.enqueueBarrierWithWaitList();
+            steps_calculated = 0;
+            ClearActive();
+            return;
+        }
+        prg->clear_kernel.setArg(0, buff_A);
+        prg->clear_kernel.setArg(1, buff_B);
+        prg->clear_kernel.setArg(2, buff_mat);
         if (calc_rms)
-            d->clear_kernel.setArg(3, buff_rms);
+            prg->clear_kernel.setArg(3, buff_rms);
         else
-            d->clear_kernel.setArg(3, sizeof(cl_mem*), cl_mem(NULL));
-        cl_queue.enqueueNDRangeKernel(d->clear_kernel, { 0,0,0 }, { size.x, size.y, size.z });
+            prg->clear_kernel.setArg(3, sizeof(cl_mem*), cl_mem(NULL));
+        cl_queue.enqueueNDRangeKernel(prg->clear_kernel, { 0,0,0 }, { size.x, size.y, size.z });
+        if (num_pml)
+            cl_queue.enqueueFillBuffer(buff_pml, (cl_uchar)0, 0, RealSize() * 6 * num_pml);
         //cl_queue.finish(); // wait for device
         cl_queue.enqueueBarrierWithWaitList();
     }
@@ -73,9 +363,50 @@ void field::Clear() {
         throw std::runtime_error(s);
     }
     steps_calculated = 0; // reset counter
+    iface_dirty = true; // all materials set to #0
+    marked_elements = false;
+    ClearActive();
 }
 
 void field::SimStep() {
+    RequireCollected(*this, "SimStep()");
+    edges_done = cl::Event(); // set only if edge planes are calculated by separate launch
+    if (track_active && ActiveEmpty()) {
+        // nothing was driven yet, both buffers hold zeros - step wouldn't change anything
+        steps_calculated++;
+        p_buff = p_buff ? 0 : 1;
+        return;
+    }
+    // RMS of elements out of active box isn't changed (p == 0)
+    uint32_t rms_z = active_lo.z, rms_nz = active_hi.z - active_lo.z + 1;
+    // wave spreads by one element per step (stencil), elements out of grown box stay zero
+    active_lo = { active_lo.x ? active_lo.x - 1 : 0, active_lo.y ? active_lo.y - 1 : 0, active_lo.z ? active_lo.z - 1 : 0 };
+    Activate(active_lo, { active_hi.x + 1, active_hi.y + 1, active_hi.z + 1 });
+    // wave leaving through periodic face enters through opposite one
+    if (boundary[0] == BOUNDARY_PERIODIC && (active_lo.x <= 1 || active_hi.x >= size.x - 2)) {
+        active_lo.x = 0;
+        active_hi.x = size.x - 1;
+    }
+    if (boundary[2] == BOUNDARY_PERIODIC && (active_lo.y <= 1 || active_hi.y >= size.y - 2)) {
+        active_lo.y = 0;
+        active_hi.y = size.y - 1;
+    }
+    if (boundary[4] == BOUNDARY_PERIODIC && (active_lo.z <= 1 || active_hi.z >= size.z - 3)) {
+        active_lo.z = 0;
+        active_hi.z = size.z - 1;
+    }
+    if (backend == BACKEND_NATIVE) {
+        auto t0 = std::chrono::steady_clock::now();
+        if (calc_rms)
+            native::RmsSum(*this, steps_calculated >= rms_window.size() ? 0.0f : rms_window[steps_calculated], rms_z, rms_z + rms_nz);
+        steps_calculated++;
+        native::SimStep(*this);
+        p_buff = p_buff ? 0 : 1;
+        PmlStep();
+        if (profiling)
+            native_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+        return;
+    }
     try {
         // integrate actual state of field
         if (calc_rms) {
@@ -84,38 +415,132 @@ void field::SimStep() {
                 w = 0.0;
             else
                 w = rms_window[steps_calculated];
-            d->rms_sum_kernel.setArg(0, p_buff ? buff_B : buff_A);
-            d->rms_sum_kernel.setArg(1, buff_rms);
-            d->rms_sum_kernel.setArg(2, w);
-            cl_queue.enqueueNDRangeKernel(d->rms_sum_kernel, { 0,0,0 }, { size.x, size.y, size.z });
+            prg->rms_sum_kernel.setArg(0, p_buff ? buff_B : buff_A);
+            prg->rms_sum_kernel.setArg(1, buff_rms);
+            prg->rms_sum_kernel.setArg(2, w);
+            if (sparse)
+                cl_queue.enqueueNDRangeKernel(prg->rms_sum_kernel, { 0,0,0 }, { brick_elements, num_bricks, 1 });
+            else
+                cl_queue.enqueueNDRangeKernel(prg->rms_sum_kernel, { 0,0,rms_z }, { size.x, size.y, rms_nz });
         }
         steps_calculated++; // update step counter - now, holds number of calculated steps
+        if (sparse) {
+            cl::Kernel& k = prg->sim_step_sparse_kernel;
+            k.setArg(0, p_buff ? buff_B : buff_A);
+            k.setArg(1, p_buff ? buff_A : buff_B);
+            k.setArg(2, buff_mat);
+            k.setArg(3, buff_tr);
+            k.setArg(4, buff_k);
+            k.setArg(5, (cl_uint)materials.size());
+            k.setArg(6, buff_bricks);
+            k.setArg(7, buff_brick_list);
+            k.setArg(8, size.x);
+            k.setArg(9, size.y);
+            k.setArg(10, size.z);
+            p_buff = p_buff ? 0 : 1;
+            cl::Event e;
+            cl_queue.enqueueNDRangeKernel(k, 0, StorageElements(), cl::NullRange, NULL, profiling ? &e : NULL);
+            if (profiling)
+                prof_events.push_back(e);
+            return;
+        }
         // calculate next state ( p(t+1) )
-        if (p_buff == 0) {
-            d->sim_step_kernel.setArg(0, buff_A);
-            d->sim_step_kernel.setArg(1, buff_B);
-            p_buff = 1;
+        if (sim_kernel == SIM_SPLIT && iface_dirty)
+            CollectInterface();
+        cl::Kernel& sim_step_kernel = sim_kernel == SIM_TILED ? prg->sim_step_tiled_kernel :
+                                      sim_kernel == SIM_SPLIT ? prg->sim_step_lean_kernel : prg->sim_step_kernel;
+        cl::Buffer& buff_p_t = p_buff ? buff_B : buff_A;
+        cl::Buffer& buff_p_tm1 = p_buff ? buff_A : buff_B;
+        p_buff = p_buff ? 0 : 1;
+        sim_step_kernel.setArg(0, buff_p_t);
+        sim_step_kernel.setArg(1, buff_p_tm1);
+        sim_step_kernel.setArg(2, buff_mat);
+        // XY of active box by offset and range of kernel, calculated planes [z_lo, z_hi) by arguments
+        cl_uint z_lo = std::max<uint32_t>(active_lo.z, 1);
+        cl_uint z_hi = std::max<uint32_t>(std::min<uint32_t>(active_hi.z + 1, size.z - 2), z_lo);
+        size_t range_x = active_hi.x - active_lo.x + 1;
+        size_t range_y = active_hi.y - active_lo.y + 1;
+        // queue is in-order - kernel starts after all previously enqueued work (drivers, RMS) is finished
+        cl::Event e;
+        cl::Event* pe = profiling ? &e : NULL;
+        // planes [lo, hi) by one launch, arguments 10 and 11 of sim_step and sim_step_tiled
+        auto launch = [&](cl_uint lo, cl_uint hi, const cl::NDRange& range, const cl::NDRange& local, cl::Event* ev) {
+            sim_step_kernel.setArg(10, lo);
+            sim_step_kernel.setArg(11, hi);
+            cl_queue.enqueueNDRangeKernel(sim_step_kernel, { active_lo.x, active_lo.y }, range, local, NULL, ev);
+        };
+        // edge planes first, halo exchange of multi_field reads them while interior is calculated (kernel writes p(t+1) only in its planes)
+        auto launch_split = [&](const cl::NDRange& range, const cl::NDRange& local) {
+            if (split_edges && z_hi - z_lo >= 3) {
+                cl::Event e_lo, e_hi;
+                launch(z_lo, z_lo + 1, range, local, profiling ? &e_lo : NULL);
+                launch(z_hi - 1, z_hi, range, local, &edges_done);
+                if (profiling) {
+                    prof_events.push_back(e_lo);
+                    prof_events.push_back(edges_done);
+                }
+                launch(z_lo + 1, z_hi - 1, range, local, pe);
+            }
+            else
+                launch(z_lo, z_hi, range, local, pe);
+        };
+        if (sim_kernel == SIM_TILED) {
+            sim_step_kernel.setArg(3, buff_tr);
+            sim_step_kernel.setArg(4, buff_k);
+            sim_step_kernel.setArg(5, (cl_uint)materials.size());
+            sim_step_kernel.setArg(6, size.x);
+            sim_step_kernel.setArg(7, size.y);
+            sim_step_kernel.setArg(8, size.z);
+            sim_step_kernel.setArg(9, (cl_uint)halo_lo);
+            sim_step_kernel.setArg(12, BoundaryBits());
+            // global range must be multiple of tile size
+            range_x = (range_x + FAS_TILE_X - 1) / FAS_TILE_X * FAS_TILE_X;
+            range_y = (range_y + FAS_TILE_Y - 1) / FAS_TILE_Y * FAS_TILE_Y;
+            launch_split({ range_x, range_y }, { FAS_TILE_X, FAS_TILE_Y });
+        }
+        else if (sim_kernel == SIM_SPLIT) {
+            sim_step_kernel.setArg(3, buff_k);
+            sim_step_kernel.setArg(4, size.x);
+            sim_step_kernel.setArg(5, size.y);
+            sim_step_kernel.setArg(6, size.z);
+            sim_step_kernel.setArg(7, (cl_uint)halo_lo);
+            sim_step_kernel.setArg(8, z_lo);
+            sim_step_kernel.setArg(9, z_hi);
+            sim_step_kernel.setArg(10, BoundaryBits());
+            cl_queue.enqueueNDRangeKernel(sim_step_kernel, { active_lo.x, active_lo.y }, { range_x, range_y }, cl::NullRange, NULL, pe);
+            // correct elements on material interface (in-order queue, lean kernel is already finished)
+            if (num_iface) {
+                prg->sim_step_iface_kernel.setArg(0, buff_p_t);
+                prg->sim_step_iface_kernel.setArg(1, buff_p_tm1);
+                prg->sim_step_iface_kernel.setArg(2, buff_mat);
+                prg->sim_step_iface_kernel.setArg(3, buff_tr);
+                prg->sim_step_iface_kernel.setArg(4, buff_k);
+                prg->sim_step_iface_kernel.setArg(5, (cl_uint)materials.size());
+                prg->sim_step_iface_kernel.setArg(6, buff_iface);
+                prg->sim_step_iface_kernel.setArg(7, size.x);
+                prg->sim_step_iface_kernel.setArg(8, size.y);
+                prg->sim_step_iface_kernel.setArg(9, size.z);
+                prg->sim_step_iface_kernel.setArg(10, BoundaryBits());
+                cl::Event ei;
+                cl_queue.enqueueNDRangeKernel(prg->sim_step_iface_kernel, 0, num_iface, cl::NullRange, NULL, profiling ? &ei : NULL);
+                if (profiling)
+                    prof_events.push_back(ei);
+            }
         }
         else {
-            d->sim_step_kernel.setArg(0, buff_B);
-            d->sim_step_kernel.setArg(1, buff_A);
-            p_buff = 0;
-        }
-        d->sim_step_kernel.setArg(2, buff_mat);
-        d->sim_step_kernel.setArg(3, buff_r);
-        d->sim_step_kernel.setArg(4, buff_c);
-        d->sim_step_kernel.setArg(5, size.z);
-        d->sim_step_kernel.setArg(6, dx);
-        d->sim_step_kernel.setArg(7, dt);
-        cl::Event e;
-        cl_queue.enqueueBarrierWithWaitList(); // wait for all previous work
-        cl_queue.enqueueNDRangeKernel(d->sim_step_kernel, { 0,0 }, { size.x, size.y }, cl::NullRange, NULL, &e);
-        // diagnostic only, comment if not used:
-        Finish(); // global finish for all works
-        uint64_t start, end;
-        e.getProfilingInfo(CL_PROFILING_COMMAND_START, &start);
-        e.getProfilingInfo(CL_PROFILING_COMMAND_END, &end);
-        printf("   elapsed time [ns]: %lli", (end - start));
+            sim_step_kernel.setArg(3, buff_tr);
+            sim_step_kernel.setArg(4, buff_k);
+            sim_step_kernel.setArg(5, (cl_uint)materials.size());
+            sim_step_kernel.setArg(6, size.x);
+            sim_step_kernel.setArg(7, size.y);
+            sim_step_kernel.setArg(8, size.z);
+            sim_step_kernel.setArg(9, (cl_uint)halo_lo);
+            sim_step_kernel.setArg(12, BoundaryBits());
+            launch_split({ range_x, range_y }, cl::NullRange);
+        }
+        if (profiling)
+            prof_events.push_back(e);
+        PmlStep(); // in-order queue, after sim_step
     }
     catch (cl::Error& e) {
         std::string s;
@@ -125,6 +550,441 @@ void field::SimStep() {
     }
 }
 
+void field::SimSteps(size_t n, const std::vector<driver*>& drivers, const std::vector<scanner*>& scanners) {
+    RequireCollected(*this, "SimSteps()");
+    Unmap_p_t(); // pressure buffers will be swapped
+    size_t elements = (size_t)size.x * size.y * size.z;
+    uint32_t max_steps = std::min<uint32_t>(steps_per_pass, FAS_TB_MAX_STEPS);
+    cl_uint n_drv = (cl_uint)drivers.size();
+    // RMS must be integrated in each step, more than 255 drivers can't be marked by uint8 slot, slab of multi_field exchanges halo each step,
+    // PML shell is recalculated after each step, blocked kernel needs dense buffers
+    bool blocking = !calc_rms && max_steps > 1 && n_drv < 256 && !halo_lo && backend == BACKEND_OPENCL && num_pml == 0 && !Remapped() && !CustomBoundary();
+    try {
+        if (blocking) {
+            size_t max_wg = prg->sim_steps_blocked_kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(*(d->phy_dev));
+            blocking = max_wg >= (size_t)FAS_TB_X * FAS_TB_Y;
+        }
+        if (blocking) {
+            if (buff_C() == nullptr) {
+                buff_C = std::move(cl::Buffer(d->cl_context, CL_MEM_READ_WRITE, PSize() * elements));
+                buff_D = std::move(cl::Buffer(d->cl_context, CL_MEM_READ_WRITE, PSize() * elements));
+            }
+            if (n_drv) {
+                // mark driven elements by slot of their driver, later driver wins (same as sequence of Drive())
+                if (buff_drv() == nullptr)
+                    buff_drv = std::move(cl::Buffer(d->cl_context, CL_MEM_READ_WRITE, sizeof(uint8_t) * elements));
+                cl_queue.enqueueFillBuffer(buff_drv, (uint8_t)0, 0, sizeof(uint8_t) * elements);
+                for (cl_uint i = 0; i < n_drv; i++) {
+                    prg->drv_mark_kernel.setArg(0, buff_drv);
+                    prg->drv_mark_kernel.setArg(1, drivers[i]->buff_elements);
+                    prg->drv_mark_kernel.setArg(2, (uint8_t)(i + 1));
+                    cl_queue.enqueueNDRangeKernel(prg->drv_mark_kernel, 0, drivers[i]->num_elements);
+                }
+            }
+        }
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't allocate buffers for temporal blocking (fas::field::SimSteps()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+
+    if (blocking)
+        ActivateAll(); // temporal-blocking kernel calculates whole field, drivers are set inside of it
+    while (n) {
+        // don't jump over frame stored by any of scanners
+        size_t steps = blocking ? std::min<size_t>(max_steps, n) : 1;
+        for (auto sc : scanners) {
+            steps = std::min<size_t>(steps, sc->store_every_nth_frame - steps_calculated % sc->store_every_nth_frame);
+        }
+
+        if (steps == 1) {
+            for (auto drv : drivers)
+                drv->Drive((data_t)(steps_calculated * dt));
+            SimStep();
+        }
+        else {
+            try {
+                cl::Buffer buff_sig; // will be deallocated after kernel finishes
+                if (n_drv) {
+                    std::vector<data_t> sig(steps * n_drv);
+                    for (size_t s = 0; s < steps; s++)
+                        for (cl_uint i = 0; i < n_drv; i++)
+                            sig[s * n_drv + i] = drivers[i]->Sample((data_t)((steps_calculated + s) * dt));
+                    buff_sig = cl::Buffer(d->cl_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, sizeof(data_t) * sig.size(), sig.data());
+                }
+                cl::Buffer& buff_p_t = p_buff ? buff_B : buff_A;
+                cl::Buffer& buff_p_tm1 = p_buff ? buff_A : buff_B;
+                cl::Kernel& k = prg->sim_steps_blocked_kernel;
+                k.setArg(0, buff_p_t);
+                k.setArg(1, buff_p_tm1);
+                k.setArg(2, buff_C);
+                k.setArg(3, buff_D);
+                k.setArg(4, buff_mat);
+                k.setArg(5, buff_tr);
+                k.setArg(6, buff_k);
+                k.setArg(7, (cl_uint)materials.size());
+                if (n_drv) {
+                    k.setArg(8, buff_drv);
+                    k.setArg(9, buff_sig);
+                }
+                else {
+                    k.setArg(8, sizeof(cl_mem*), cl_mem(NULL));
+                    k.setArg(9, sizeof(cl_mem*), cl_mem(NULL));
+                }
+                k.setArg(10, n_drv);
+                k.setArg(11, size.x);
+                k.setArg(12, size.y);
+                k.setArg(13, size.z);
+                k.setArg(14, (cl_uint)steps);
+                // tiles overlap by halo of "steps" elements
+                size_t tile_x = FAS_TB_X - 2 * steps;
+                size_t tile_y = FAS_TB_Y - 2 * steps;
+                size_t range_x = ((size_t)size.x + tile_x - 1) / tile_x * FAS_TB_X;
+                size_t range_y = ((size_t)size.y + tile_y - 1) / tile_y * FAS_TB_Y;
+                cl::Event e;
+                cl_queue.enqueueNDRangeKernel(k, { 0,0 }, { range_x, range_y }, { FAS_TB_X, FAS_TB_Y }, NULL, profiling ? &e : NULL);
+                if (profiling)
+                    prof_events.push_back(e);
+                // output buffers holds p(t + steps) and p(t + steps - 1) now
+                std::swap(buff_p_t, buff_C);
+                std::swap(buff_p_tm1, buff_D);
+                steps_calculated += steps;
+            }
+            catch (cl::Error& e) {
+                std::string s;
+                s = "ERR: Can't run simulation steps (fas::field::SimSteps()):\n";
+                s += e.what();
+                throw std::runtime_error(s);
+            }
+        }
+        n -= steps;
+
+        for (auto sc : scanners)
+            sc->ScanPipelined();
+        AutoCheckpoint(drivers);
+    }
+    for (auto sc : scanners)
+        sc->Drain();
+}
+
+void field::Run(size_t n_steps, const std::vector<driver*>& drivers, const std::vector<scanner*>& scanners) {
+    Unmap_p_t();
+    Unmap_rms();
+    // everything is enqueued without waiting, host waits only if frame of scanner must be written to file
+    for (size_t i = 0; i < n_steps; i++) {
+        for (auto drv : drivers)
+            drv->Drive((data_t)(steps_calculated * dt));
+        SimStep();
+        for (auto sc : scanners)
+            sc->ScanPipelined();
+        AutoCheckpoint(drivers);
+    }
+    for (auto sc : scanners)
+        sc->Drain();
+    if (backend == BACKEND_OPENCL)
+        cl_queue.flush();
+}
+
+std::vector<double> field::MeasureLayouts(device& d, vec3<uint32_t> size, size_t n_steps) {
+    std::vector<double> rv;
+    for (int l = LAYOUT_LINEAR; l <= LAYOUT_MORTON; l++) {
+        field test(d, size);
+        test.materials = { { 343.0f, 1.2f, 0.0f, "Air" } };
+        material::Recalc(test.materials);
+        test.layout = (layout_t)l;
+        test.Prepare();
+        test.Clear();
+        test.SimStep(); // warm-up, first launch may be slower
+        test.Finish();
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n_steps; i++)
+            test.SimStep();
+        test.Finish();
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        double elements = (double)test.size.x * test.size.y * test.size.z;
+        rv.push_back(elements * n_steps / (s > 0.0 ? s : 1e-9));
+    }
+    return rv;
+}
+
+uint64_t field::ProfiledTime() {
+    uint64_t total = native_ns; // wall time of steps of native backend
+    native_ns = 0;
+    try {
+        for (auto& e : prof_events) {
+            e.wait();
+            total += e.getProfilingInfo<CL_PROFILING_COMMAND_END>() - e.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        }
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't get profiling info, set field.profiling before Prepare() (fas::field::ProfiledTime()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+    prof_events.clear();
+    return total;
+}
+
+void field::Sparsify(const std::vector<uint8_t>& rigid_materials) {
+    if (backend == BACKEND_NATIVE)
+        throw std::runtime_error("ERR: Brick-sparse storage needs OpenCL backend (fas::field::Sparsify())");
+    if (sparse)
+        throw std::runtime_error("ERR: Field is already brick-sparse (fas::field::Sparsify())");
+    RequireCollected(*this, "Sparsify()"); // elements can't be collected from brick-sparse field
+    if (halo_lo || z_offset)
+        throw std::runtime_error("ERR: Slab of multi_field can't be brick-sparse (fas::field::Sparsify())");
+    if (num_pml)
+        throw std::runtime_error("ERR: Brick-sparse field can't have PML, clear field.pml_cells (fas::field::Sparsify())");
+    if (CustomBoundary())
+        throw std::runtime_error("ERR: Brick-sparse field supports only BOUNDARY_DEFAULT of field.boundary (fas::field::Sparsify())");
+    if (layout != LAYOUT_LINEAR)
+        throw std::runtime_error("ERR: Brick-sparse field needs LAYOUT_LINEAR of dense field (fas::field::Sparsify())");
+    Unmap_p_t();
+    Unmap_rms();
+    bool rigid[256] = {};
+    for (auto m : rigid_materials)
+        rigid[m] = true;
+    vec3<uint32_t> grid = BrickGrid();
+    size_t dense = (size_t)size.x * size.y * size.z;
+    size_t plane = (size_t)size.x * size.y;
+    try {
+        std::vector<uint8_t> mat(dense);
+        cl_queue.enqueueReadBuffer(buff_mat, CL_TRUE, 0, dense, mat.data());
+        // brick is kept if any of its elements isn't rigid
+        std::vector<uint32_t> table((size_t)grid.x * grid.y * grid.z, FAS_NO_BRICK);
+        host_brick_list.clear();
+        for (uint32_t bz = 0; bz < grid.z; bz++) {
+            for (uint32_t by = 0; by < grid.y; by++) {
+                for (uint32_t bx = 0; bx < grid.x; bx++) {
+                    bool keep = false;
+                    for (uint32_t z = bz * FAS_BRICK; z < std::min<uint32_t>((bz + 1) * FAS_BRICK, size.z) && !keep; z++)
+                        for (uint32_t y = by * FAS_BRICK; y < std::min<uint32_t>((by + 1) * FAS_BRICK, size.y) && !keep; y++)
+                            for (uint32_t x = bx * FAS_BRICK; x < std::min<uint32_t>((bx + 1) * FAS_BRICK, size.x) && !keep; x++)
+                                keep = !rigid[mat[z * plane + (size_t)y * size.x + x]];
+                    if (keep) {
+                        size_t b = ((size_t)bz * grid.y + by) * grid.x + bx;
+                        table[b] = (uint32_t)host_brick_list.size();
+                        host_brick_list.push_back((uint32_t)b);
+                    }
+                }
+            }
+        }
+        if (host_brick_list.empty())
+            throw std::runtime_error("ERR: All elements of field are of rigid materials (fas::field::Sparsify())");
+        num_bricks = host_brick_list.size();
+        size_t elements = num_bricks * brick_elements;
+
+        // move content of dense buffers into bricks (elements out of field are 0)
+        auto move = [&](cl::Buffer& buff, size_t elem_size) {
+            std::vector<uint8_t> dn(dense * elem_size), sp(elements * elem_size, 0);
+            cl_queue.enqueueReadBuffer(buff, CL_TRUE, 0, dn.size(), dn.data());
+            BrickCopy(*this, dn.data(), sp.data(), elem_size, true);
+            buff = cl::Buffer(); // release dense buffer first
+            buff = cl::Buffer(d->cl_context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sp.size(), sp.data());
+        };
+        sparse = true; // BrickCopy() uses host_brick_list
+        buff_mat = cl::Buffer();
+        std::vector<uint8_t> sp_mat(elements, 0);
+        BrickCopy(*this, mat.data(), sp_mat.data(), 1, true);
+        buff_mat = cl::Buffer(d->cl_context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, elements, sp_mat.data());
+        move(buff_A, PSize());
+        move(buff_B, PSize());
+        if (calc_rms)
+            move(buff_rms, RmsSize());
+        buff_bricks = cl::Buffer(d->cl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(uint32_t) * table.size(), table.data());
+        buff_brick_list = cl::Buffer(d->cl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(uint32_t) * num_bricks, host_brick_list.data());
+        // buffers of dense kernels aren't needed any more
+        buff_C = cl::Buffer();
+        buff_D = cl::Buffer();
+        buff_drv = cl::Buffer();
+        buff_iface = cl::Buffer();
+        num_iface = 0;
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't allocate brick-sparse buffers on the device (fas::field::Sparsify()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+    catch (std::bad_alloc& e) {
+        throw std::runtime_error("ERR: Can't allocate host memory for conversion of field (fas::field::Sparsify()):\n" + std::string(e.what()));
+    }
+}
+
+uint32_t field::BoundaryBits(const boundary_t* modes) {
+    uint32_t bits = 0;
+    for (int i = 0; i < 6; i++) {
+        uint32_t m = modes[i];
+        if (m == BOUNDARY_DEFAULT && i < 4)
+            m = BOUNDARY_RIGID; // z faces by default read planes 0 and size.z - 2 as is (FAS_BND_NONE)
+        bits |= m << (2 * i);
+    }
+    return bits;
+}
+
+void field::BricksArg(cl::Kernel& k, cl_uint index) {
+    if (sparse)
+        k.setArg(index, buff_bricks);
+    else
+        k.setArg(index, sizeof(cl_mem*), cl_mem(NULL));
+}
+
+void field::Activate(vec3<uint32_t> lo, vec3<uint32_t> hi) {
+    hi = { std::min(hi.x, size.x - 1), std::min(hi.y, size.y - 1), std::min(hi.z, size.z - 1) };
+    if (lo.x > hi.x || lo.y > hi.y || lo.z > hi.z)
+        return;
+    if (ActiveEmpty()) {
+        active_lo = lo;
+        active_hi = hi;
+        return;
+    }
+    active_lo = { std::min(active_lo.x, lo.x), std::min(active_lo.y, lo.y), std::min(active_lo.z, lo.z) };
+    active_hi = { std::max(active_hi.x, hi.x), std::max(active_hi.y, hi.y), std::max(active_hi.z, hi.z) };
+}
+
+void field::ClearActive() {
+    if (!track_active || halo_lo || z_offset) {
+        ActivateAll(); // halos of slabs of multi_field are written by neighbours
+        return;
+    }
+    active_lo = { 1,0,0 }; // empty
+    active_hi = { 0,0,0 };
+}
+
+std::vector<field::pml_box> field::PmlBoxes() {
+    std::vector<pml_box> rv;
+    uint32_t n = pml_cells;
+    if (n == 0)
+        return rv;
+    // calculated elements: x in [1, size.x - 2], y in [1, size.y - 2], z in [1, size.z - 3]
+    uint32_t ix = size.x - 2, iy = size.y - 2, iz = size.z - 3;
+    size_t base = 0;
+    auto add = [&](uint32_t x0, uint32_t y0, uint32_t z0, uint32_t ex, uint32_t ey, uint32_t ez) {
+        rv.push_back({ vec3<uint32_t>(x0, y0, z0), vec3<uint32_t>(ex, ey, ez), base });
+        base += (size_t)ex * ey * ez;
+    };
+    add(1, 1, 1, ix, iy, n); // z-
+    add(1, 1, iz - n + 1, ix, iy, n); // z+
+    add(1, 1, n + 1, ix, n, iz - 2 * n); // y-
+    add(1, iy - n + 1, n + 1, ix, n, iz - 2 * n); // y+
+    add(1, n + 1, n + 1, n, iy - 2 * n, iz - 2 * n); // x-
+    add(ix - n + 1, n + 1, n + 1, n, iy - 2 * n, iz - 2 * n); // x+
+    return rv;
+}
+
+void field::PmlStep() {
+    if (num_pml == 0)
+        return;
+    if (backend == BACKEND_NATIVE) {
+        native::PmlStep(*this);
+        return;
+    }
+    try {
+        float coef = 1.5f * std::log(1.0f / pml_reflection) / pml_cells; // sigma_max * dt / sqrt(k), quadratic profile
+        cl::Kernel& k = prg->pml_step_kernel;
+        k.setArg(0, p_buff ? buff_A : buff_B); // p(t), buffers are already swapped
+        k.setArg(1, p_buff ? buff_B : buff_A); // p(t+1)
+        k.setArg(2, buff_mat);
+        k.setArg(3, buff_tr);
+        k.setArg(4, buff_k);
+        k.setArg(5, (cl_uint)materials.size());
+        k.setArg(6, buff_pml);
+        k.setArg(11, size.x);
+        k.setArg(12, size.y);
+        k.setArg(13, size.z);
+        k.setArg(14, pml_cells);
+        k.setArg(15, coef);
+        for (auto& b : PmlBoxes()) {
+            k.setArg(7, (cl_ulong)b.base);
+            k.setArg(8, b.origin.x);
+            k.setArg(9, b.origin.y);
+            k.setArg(10, b.origin.z);
+            cl::Event e;
+            cl_queue.enqueueNDRangeKernel(k, { 0,0,0 }, { b.extent.x, b.extent.y, b.extent.z }, cl::NullRange, NULL, profiling ? &e : NULL);
+            if (profiling)
+                prof_events.push_back(e);
+        }
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't calculate PML shell (fas::field::PmlStep()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+}
+
+void field::CollectInterface() {
+    try {
+        cl::Buffer buff_count(d->cl_context, CL_MEM_READ_WRITE, sizeof(uint32_t) * size.y * size.z);
+        cl::Buffer buff_psum(d->cl_context, CL_MEM_READ_WRITE, sizeof(uint64_t) * size.y * size.z);
+
+        // count interface elements in each line along the x-axis
+        prg->iface_count_kernel.setArg(0, buff_mat);
+        prg->iface_count_kernel.setArg(1, buff_count);
+        prg->iface_count_kernel.setArg(2, size.x);
+        prg->iface_count_kernel.setArg(3, BoundaryBits());
+        cl_queue.enqueueNDRangeKernel(prg->iface_count_kernel, { 0,0 }, { size.y, size.z });
+        cl_queue.enqueueBarrierWithWaitList();
+
+        num_iface = RowsPrefixSum(buff_count, buff_psum);
+        iface_dirty = false;
+        if (num_iface == 0) {
+            buff_iface = cl::Buffer(); // homogeneous field, nothing to correct
+            return;
+        }
+
+        // collect indices of interface elements
+        buff_iface = std::move(cl::Buffer(d->cl_context, CL_MEM_READ_WRITE, sizeof(uint64_t) * num_iface));
+        prg->iface_collect_kernel.setArg(0, buff_mat);
+        prg->iface_collect_kernel.setArg(1, buff_psum);
+        prg->iface_collect_kernel.setArg(2, buff_iface);
+        prg->iface_collect_kernel.setArg(3, size.x);
+        prg->iface_collect_kernel.setArg(4, BoundaryBits());
+        cl_queue.enqueueNDRangeKernel(prg->iface_collect_kernel, { 0,0 }, { size.y, size.z });
+        cl_queue.enqueueBarrierWithWaitList();
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't collect elements on material interface (fas::field::CollectInterface()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+}
+
+uint64_t field::RowsPrefixSum(cl::Buffer& buff_count, cl::Buffer& buff_psum) {
+    prg->Require(program::GROUP_INDEXING); // compiled on first use
+    cl::Buffer buff_tmp_last_col(d->cl_context, CL_MEM_READ_WRITE, sizeof(uint64_t) * size.z);
+
+    // calc prefix sum of each row (along y axis)
+    prg->horizontal_prefix_sum_uint_ulong_kernel.setArg(0, buff_count);
+    prg->horizontal_prefix_sum_uint_ulong_kernel.setArg(1, buff_psum);
+    prg->horizontal_prefix_sum_uint_ulong_kernel.setArg(2, buff_tmp_last_col);
+    prg->horizontal_prefix_sum_uint_ulong_kernel.setArg(3, size.y);
+    cl_queue.enqueueNDRangeKernel(prg->horizontal_prefix_sum_uint_ulong_kernel, 0, size.z);
+    cl_queue.enqueueBarrierWithWaitList();
+
+    // wait here to finish previous kernel and then map memory (enqueueBarrier & blocking = true)
+    uint64_t* tmp_last_col_arr = static_cast<uint64_t*>(cl_queue.enqueueMapBuffer(buff_tmp_last_col, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, sizeof(uint64_t) * size.z));
+    for (uint32_t i = 1; i < size.z; i++) {
+        tmp_last_col_arr[i] += tmp_last_col_arr[i - 1];
+    }
+    uint64_t total = tmp_last_col_arr[size.z - 1];
+    cl_queue.enqueueUnmapMemObject(buff_tmp_last_col, tmp_last_col_arr);
+    cl_queue.enqueueBarrierWithWaitList();
+
+    // add sums of all previous rows
+    prg->vertical_prexix_sum_ulong_kernel.setArg(0, buff_psum);
+    prg->vertical_prexix_sum_ulong_kernel.setArg(1, buff_tmp_last_col);
+    prg->vertical_prexix_sum_ulong_kernel.setArg(2, size.z);
+    cl_queue.enqueueNDRangeKernel(prg->vertical_prexix_sum_ulong_kernel, 0, size.y);
+    cl_queue.enqueueBarrierWithWaitList();
+
+    return total;
+}
+
 void field::FinishRms() {
     try {
         if (!calc_rms)
@@ -134,11 +994,18 @@ void field::FinishRms() {
         for (auto w : rms_window)
             nnpg += w * w;
         nnpg /= (data_t)steps_calculated;
+        if (backend == BACKEND_NATIVE) {
+            native::RmsFinal(*this, (data_t)1.0 / (data_t)steps_calculated, (data_t)1.0 / sqrt(nnpg));
+            return;
+        }
         // 1/sqrt(nnpg) * sqrt(1/N * sum)
-        d->rms_final_kernel.setArg(0, buff_rms);
-        d->rms_final_kernel.setArg(1, (data_t)1.0 / (data_t)steps_calculated);
-        d->rms_final_kernel.setArg(2, (data_t)1.0 / sqrt(nnpg));
-        cl_queue.enqueueNDRangeKernel(d->rms_final_kernel, { 0,0,0 }, { size.x, size.y, size.z });
+        prg->rms_final_kernel.setArg(0, buff_rms);
+        prg->rms_final_kernel.setArg(1, (data_t)1.0 / (data_t)steps_calculated);
+        prg->rms_final_kernel.setArg(2, (data_t)1.0 / sqrt(nnpg));
+        if (sparse)
+            cl_queue.enqueueNDRangeKernel(prg->rms_final_kernel, { 0,0,0 }, { brick_elements, num_bricks, 1 });
+        else
+            cl_queue.enqueueNDRangeKernel(prg->rms_final_kernel, { 0,0,0 }, { size.x, size.y, size.z });
         cl_queue.enqueueBarrierWithWaitList();
     }
     catch (cl::Error& e) {
@@ -150,21 +1017,40 @@ void field::FinishRms() {
 }
 
 data_t * field::Map_p_t_read() {
+    if (backend == BACKEND_NATIVE)
+        return p_mapped_ptr = p_buff ? host_B.data() : host_A.data(); // host memory is always accessible
     try {
         // first, unmap old mem region (if mapped)
         Unmap_p_t();
         // then map new
-        if (p_buff == 0) {
-            p_mapped_ptr = static_cast<fas::data_t*>(cl_queue.enqueueMapBuffer(buff_A, CL_TRUE, CL_MAP_READ, 0, sizeof(data_t) * size.x * size.y * size.z));
-            if (p_mapped_ptr) {
-                p_mapped_buff = &buff_A; // success
-            }
+        cl::Buffer& buff = p_buff ? buff_B : buff_A;
+        size_t elements = (size_t)size.x * size.y * size.z;
+        if (Remapped()) {
+            // linear view: converted copy of bricks / layout scattered into zeroed array
+            std::vector<data_t> bricks(StorageElements());
+            void* h = cl_queue.enqueueMapBuffer(buff, CL_TRUE, CL_MAP_READ, 0, PSize() * bricks.size());
+            StorageToHost(h, PSize(), bricks.data(), bricks.size());
+            cl_queue.enqueueUnmapMemObject(buff, h);
+            p_conv.assign(elements, 0.0f);
+            StorageCopy(*this, bricks.data(), p_conv.data(), sizeof(data_t), false);
+            p_mapped_ptr = p_conv.data();
+            p_mapped_buff = &buff;
+            p_conv_write = false;
         }
-        else
-        {
-            p_mapped_ptr = static_cast<fas::data_t*>(cl_queue.enqueueMapBuffer(buff_B, CL_TRUE, CL_MAP_READ, 0, sizeof(data_t) * size.x * size.y * size.z));
+        else if (PSize() != sizeof(data_t)) {
+            // convert to host copy, device memory is mapped only for the time of conversion
+            void* h = cl_queue.enqueueMapBuffer(buff, CL_TRUE, CL_MAP_READ, 0, PSize() * elements);
+            p_conv.resize(elements);
+            StorageToHost(h, PSize(), p_conv.data(), elements);
+            cl_queue.enqueueUnmapMemObject(buff, h);
+            p_mapped_ptr = p_conv.data();
+            p_mapped_buff = &buff;
+            p_conv_write = false;
+        }
+        else {
+            p_mapped_ptr = static_cast<fas::data_t*>(cl_queue.enqueueMapBuffer(buff, CL_TRUE, CL_MAP_READ, 0, sizeof(data_t) * elements));
             if (p_mapped_ptr) {
-                p_mapped_buff = &buff_B;
+                p_mapped_buff = &buff; // success
             }
         }
     }
@@ -179,21 +1065,26 @@ data_t * field::Map_p_t_read() {
 }
 
 data_t * field::Map_p_t_write() {
+    ActivateAll(); // any element may be written
+    if (backend == BACKEND_NATIVE)
+        return p_mapped_ptr = p_buff ? host_B.data() : host_A.data();
     try {
         // first, unmap old mem region (if mapped)
         Unmap_p_t();
         // then map new
-        if (p_buff == 0) {
-            p_mapped_ptr = static_cast<fas::data_t*>(cl_queue.enqueueMapBuffer(buff_A, CL_TRUE, CL_MAP_WRITE, 0, sizeof(data_t) * size.x * size.y * size.z));
-            if (p_mapped_ptr) {
-                p_mapped_buff = &buff_A; // success
-            }
+        cl::Buffer& buff = p_buff ? buff_B : buff_A;
+        size_t elements = (size_t)size.x * size.y * size.z;
+        if (PSize() != sizeof(data_t) || Remapped()) {
+            // user writes to host copy, it is converted and written to device by Unmap_p_t()
+            p_conv.assign(elements, 0.0f);
+            p_mapped_ptr = p_conv.data();
+            p_mapped_buff = &buff;
+            p_conv_write = true;
         }
-        else
-        {
-            p_mapped_ptr = static_cast<fas::data_t*>(cl_queue.enqueueMapBuffer(buff_B, CL_TRUE, CL_MAP_WRITE, 0, sizeof(data_t) * size.x * size.y * size.z));
+        else {
+            p_mapped_ptr = static_cast<fas::data_t*>(cl_queue.enqueueMapBuffer(buff, CL_TRUE, CL_MAP_WRITE, 0, sizeof(data_t) * elements));
             if (p_mapped_ptr) {
-                p_mapped_buff = &buff_B;
+                p_mapped_buff = &buff; // success
             }
         }
     }
@@ -208,20 +1099,61 @@ data_t * field::Map_p_t_write() {
 }
 
 void field::Unmap_p_t() {
-    if (p_mapped_ptr) {
-        cl_queue.enqueueUnmapMemObject(*p_mapped_buff, p_mapped_ptr);
-        cl_queue.enqueueBarrierWithWaitList(); // for write operation
+    if (p_mapped_ptr && backend == BACKEND_OPENCL) {
+        if (PSize() != sizeof(data_t) || Remapped()) {
+            if (p_conv_write) {
+                size_t elements = StorageElements();
+                const data_t* src = p_conv.data();
+                std::vector<data_t> bricks;
+                if (Remapped()) {
+                    // elements of not allocated bricks are dropped
+                    bricks.assign(elements, 0.0f);
+                    StorageCopy(*this, p_conv.data(), bricks.data(), sizeof(data_t), true);
+                    src = bricks.data();
+                }
+                void* h = cl_queue.enqueueMapBuffer(*p_mapped_buff, CL_TRUE, CL_MAP_WRITE, 0, PSize() * elements);
+                HostToStorage(src, h, PSize(), elements);
+                cl_queue.enqueueUnmapMemObject(*p_mapped_buff, h);
+                cl_queue.enqueueBarrierWithWaitList(); // for write operation
+            }
+            p_conv_write = false;
+        }
+        else {
+            cl_queue.enqueueUnmapMemObject(*p_mapped_buff, p_mapped_ptr);
+            cl_queue.enqueueBarrierWithWaitList(); // for write operation
+        }
     }
     p_mapped_ptr = nullptr;
     p_mapped_buff = nullptr;
 }
 
 data_t * field::Map_rms_read() {
+    if (backend == BACKEND_NATIVE)
+        return rms_mapped_ptr = host_rms.data();
     try {
         // first, unmap old mem region (if mapped)
         Unmap_rms();
         // then map new
-        rms_mapped_ptr = (fas::data_t*)(cl_queue.enqueueMapBuffer(buff_rms, CL_TRUE, CL_MAP_READ, 0, sizeof(data_t) * size.x * size.y * size.z));
+        size_t elements = (size_t)size.x * size.y * size.z;
+        if (Remapped()) {
+            std::vector<data_t> bricks(StorageElements());
+            void* h = cl_queue.enqueueMapBuffer(buff_rms, CL_TRUE, CL_MAP_READ, 0, RmsSize() * bricks.size());
+            StorageToHost(h, RmsSize(), bricks.data(), bricks.size());
+            cl_queue.enqueueUnmapMemObject(buff_rms, h);
+            rms_conv.assign(elements, 0.0f);
+            StorageCopy(*this, bricks.data(), rms_conv.data(), sizeof(data_t), false);
+            rms_mapped_ptr = rms_conv.data();
+        }
+        else if (RmsSize() != sizeof(data_t)) {
+            void* h = cl_queue.enqueueMapBuffer(buff_rms, CL_TRUE, CL_MAP_READ, 0, RmsSize() * elements);
+            rms_conv.resize(elements);
+            StorageToHost(h, RmsSize(), rms_conv.data(), elements);
+            cl_queue.enqueueUnmapMemObject(buff_rms, h);
+            rms_mapped_ptr = rms_conv.data();
+        }
+        else {
+            rms_mapped_ptr = (fas::data_t*)(cl_queue.enqueueMapBuffer(buff_rms, CL_TRUE, CL_MAP_READ, 0, sizeof(data_t) * elements));
+        }
     }
     catch (cl::Error& e) {
         std::string s;
@@ -234,7 +1166,7 @@ data_t * field::Map_rms_read() {
 }
 
 void field::Unmap_rms() {
-    if (rms_mapped_ptr)
+    if (rms_mapped_ptr && RmsSize() == sizeof(data_t) && !Remapped() && backend == BACKEND_OPENCL)
         cl_queue.enqueueUnmapMemObject(buff_rms, rms_mapped_ptr);
     rms_mapped_ptr = nullptr;
 }
@@ -0,0 +1,257 @@
+#include <algorithm>
+#include "fas.hpp"
+
+using namespace fas;
+
+void field_batch::Prepare() {
+    if (d == nullptr)
+        throw std::runtime_error("ERR: No device defined (fas::field_batch::Prepare())");
+    if (count == 0)
+        throw std::runtime_error("ERR: Batch has no members (fas::field_batch::Prepare())");
+    prg = &d->GetProgram(""); // float storage, not specialized - shared with default fields
+    try {
+        size_t elements = Elements() * count;
+        buff_A = std::move(cl::Buffer(d->cl_context, CL_MEM_READ_WRITE, sizeof(float) * elements));
+        buff_B = std::move(cl::Buffer(d->cl_context, CL_MEM_READ_WRITE, sizeof(float) * elements));
+        buff_mat = std::move(cl::Buffer(d->cl_context, CL_MEM_READ_WRITE, sizeof(uint8_t) * elements));
+        cl_queue = std::move(cl::CommandQueue(d->cl_context, *(d->phy_dev), 0));
+        cl_queue.enqueueFillBuffer(buff_mat, (cl_uchar)0, 0, sizeof(uint8_t) * elements);
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't allocate memory on the device or create command queue (fas::field_batch::Prepare()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+    materials.assign(count, std::vector<material>());
+    tables_dirty = true;
+    Clear();
+}
+
+void field_batch::Clear() {
+    try {
+        size_t elements = Elements() * count;
+        cl_queue.enqueueFillBuffer(buff_A, 0.0f, 0, sizeof(float) * elements);
+        cl_queue.enqueueFillBuffer(buff_B, 0.0f, 0, sizeof(float) * elements);
+        cl_queue.enqueueBarrierWithWaitList();
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't clear batch of fields (fas::field_batch::Clear()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+    steps_calculated = 0;
+    p_buff = 0;
+}
+
+void field_batch::SetMember(uint32_t member, field& f) {
+    if (member >= count)
+        throw std::runtime_error("ERR: Index of member is out of range (fas::field_batch::SetMember())");
+    if (f.d != d || f.backend != field::BACKEND_OPENCL || f.Remapped() || f.half_storage || f.double_precision)
+        throw std::runtime_error("ERR: Template field must be dense linear float field on device of batch (fas::field_batch::SetMember())");
+    if (f.size.x != size.x || f.size.y != size.y || f.size.z != size.z)
+        throw std::runtime_error("ERR: Template field must have same size as members of batch (fas::field_batch::SetMember())");
+    if (f.marked_elements) // MSB material would index out of tables of member
+        throw std::runtime_error("ERR: Template field contains uncollected elements of transducers (material MSB set), call transducer::CollectElements() first (fas::field_batch::SetMember())");
+    try {
+        f.Finish(); // objects drawn into template field
+        cl_queue.enqueueCopyBuffer(f.buff_mat, buff_mat, 0, Elements() * member, Elements());
+        cl_queue.enqueueBarrierWithWaitList();
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't copy materials of member (fas::field_batch::SetMember()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+    materials[member] = f.materials;
+    tables_dirty = true;
+}
+
+void field_batch::AddDriver(uint32_t member, driver& drv) {
+    if (member >= count)
+        throw std::runtime_error("ERR: Index of member is out of range (fas::field_batch::AddDriver())");
+    std::vector<uint32_t> coords = drv.GetElementsCoords();
+    size_t n = coords.size() / 3;
+    uint32_t slot = (uint32_t)drivers.size();
+    drivers.push_back(&drv);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t x = coords[i], y = coords[i + n], z = coords[i + 2 * n];
+        if (x >= size.x || y >= size.y || z >= size.z)
+            throw std::runtime_error("ERR: Element of driver is out of member (fas::field_batch::AddDriver())");
+        host_drv_elements.push_back(Elements() * member + ((size_t)z * size.y + y) * size.x + x);
+        host_drv_slot.push_back(slot);
+    }
+    transducers_dirty = true;
+}
+
+size_t field_batch::AddScanner(uint32_t member, const std::vector<uint32_t>& coords, std::string out_file_name) {
+    if (member >= count)
+        throw std::runtime_error("ERR: Index of member is out of range (fas::field_batch::AddScanner())");
+    size_t n = coords.size() / 3;
+    member_scanner sc;
+    sc.first = host_scan_elements.size();
+    sc.num_elements = n;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t x = coords[i], y = coords[i + n], z = coords[i + 2 * n];
+        if (x >= size.x || y >= size.y || z >= size.z)
+            throw std::runtime_error("ERR: Element of scanner is out of member (fas::field_batch::AddScanner())");
+        host_scan_elements.push_back(Elements() * member + ((size_t)z * size.y + y) * size.x + x);
+    }
+    sc.out_file.open(out_file_name, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!sc.out_file.is_open())
+        throw std::runtime_error("ERR: Can't open output file of scanner (fas::field_batch::AddScanner())");
+    scanners.push_back(std::move(sc));
+    transducers_dirty = true;
+    return scanners.size() - 1;
+}
+
+void field_batch::SimStep() {
+    try {
+        if (tables_dirty) {
+            // tables of all members padded to longest one, missing materials are never referenced
+            n_mat = 1;
+            for (auto& m : materials)
+                n_mat = std::max<uint32_t>(n_mat, (uint32_t)std::min<size_t>(m.size(), 256));
+            std::vector<float> tr((size_t)count * n_mat * n_mat, 1.0f), k((size_t)count * n_mat, 0.0f);
+            for (uint32_t i = 0; i < count; i++) {
+                std::vector<double> tr_tab, k_tab;
+                size_t m = std::min<size_t>(materials[i].size(), 256);
+                field::MaterialTables(std::vector<material>(materials[i].begin(), materials[i].begin() + m), dt, dx, tr_tab, k_tab);
+                for (size_t my = 0; my < m; my++) {
+                    k[(size_t)i * n_mat + my] = (float)k_tab[my];
+                    for (size_t n = 0; n < m; n++)
+                        tr[((size_t)i * n_mat + my) * n_mat + n] = (float)tr_tab[my * m + n];
+                }
+            }
+            buff_tr = std::move(cl::Buffer(d->cl_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, sizeof(float) * tr.size(), tr.data()));
+            buff_k = std::move(cl::Buffer(d->cl_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, sizeof(float) * k.size(), k.data()));
+            tables_dirty = false;
+        }
+        cl::Kernel& k = prg->sim_step_batch_kernel;
+        k.setArg(0, p_buff ? buff_B : buff_A);
+        k.setArg(1, p_buff ? buff_A : buff_B);
+        k.setArg(2, buff_mat);
+        k.setArg(3, buff_tr);
+        k.setArg(4, buff_k);
+        k.setArg(5, n_mat);
+        k.setArg(6, size.x);
+        k.setArg(7, size.y);
+        k.setArg(8, size.z);
+        k.setArg(9, field::BoundaryBits(boundary));
+        cl_queue.enqueueNDRangeKernel(k, { 0,0,0 }, { size.x, size.y, count });
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't do simulation step of batch (fas::field_batch::SimStep()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+    steps_calculated++;
+    p_buff = p_buff ? 0 : 1; // swap buffers
+}
+
+void field_batch::Run(size_t n_steps) {
+    for (int a = 0; a < 3; a++) {
+        if ((boundary[2 * a] == field::BOUNDARY_PERIODIC) != (boundary[2 * a + 1] == field::BOUNDARY_PERIODIC))
+            throw std::runtime_error("ERR: Periodic boundary must be set on both faces of axis (fas::field_batch::Run())");
+    }
+    uint32_t n_drv = (uint32_t)drivers.size();
+    size_t n_scan = host_scan_elements.size();
+    uint32_t chunk = std::max<uint32_t>(chunk_steps, 1);
+    uint32_t nth = std::max<uint32_t>(store_every_nth_frame, 1);
+    try {
+        if (transducers_dirty) {
+            buff_drv_elements = cl::Buffer();
+            buff_drv_slot = cl::Buffer();
+            buff_scan_elements = cl::Buffer();
+            if (!host_drv_elements.empty()) {
+                buff_drv_elements = std::move(cl::Buffer(d->cl_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, sizeof(uint64_t) * host_drv_elements.size(), host_drv_elements.data()));
+                buff_drv_slot = std::move(cl::Buffer(d->cl_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, sizeof(uint32_t) * host_drv_slot.size(), host_drv_slot.data()));
+            }
+            if (n_scan)
+                buff_scan_elements = std::move(cl::Buffer(d->cl_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, sizeof(uint64_t) * n_scan, host_scan_elements.data()));
+            transducers_dirty = false;
+        }
+        if (n_scan) // all frames stored during one chunk
+            buff_frames = std::move(cl::Buffer(d->cl_context, CL_MEM_READ_WRITE, sizeof(float) * n_scan * (chunk / nth + 1)));
+        std::vector<float> sig;
+        std::vector<float> frames;
+        while (n_steps) {
+            uint32_t steps = (uint32_t)std::min<size_t>(chunk, n_steps);
+            // samples of all drivers for whole chunk, one upload
+            cl::Buffer buff_sig;
+            if (n_drv) {
+                sig.resize((size_t)steps * n_drv);
+                for (uint32_t s = 0; s < steps; s++)
+                    for (uint32_t i = 0; i < n_drv; i++)
+                        sig[(size_t)s * n_drv + i] = (float)drivers[i]->Sample((data_t)((steps_calculated + s) * dt));
+                buff_sig = cl::Buffer(d->cl_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, sizeof(float) * sig.size(), sig.data());
+            }
+            uint32_t n_frames = 0;
+            for (uint32_t s = 0; s < steps; s++) {
+                if (n_drv) {
+                    cl::Kernel& k = prg->drive_batch_kernel;
+                    k.setArg(0, p_buff ? buff_B : buff_A);
+                    k.setArg(1, buff_drv_elements);
+                    k.setArg(2, buff_drv_slot);
+                    k.setArg(3, buff_sig);
+                    k.setArg(4, s);
+                    k.setArg(5, n_drv);
+                    cl_queue.enqueueNDRangeKernel(k, 0, host_drv_elements.size());
+                }
+                SimStep();
+                if (n_scan && steps_calculated % nth == 0) {
+                    cl::Kernel& k = prg->scan_batch_kernel;
+                    k.setArg(0, p_buff ? buff_B : buff_A);
+                    k.setArg(1, buff_scan_elements);
+                    k.setArg(2, buff_frames);
+                    k.setArg(3, n_frames++);
+                    cl_queue.enqueueNDRangeKernel(k, 0, n_scan);
+                }
+            }
+            cl_queue.flush();
+            // frames of chunk to files of scanners
+            if (n_frames) {
+                frames.resize(n_scan * n_frames);
+                cl_queue.enqueueReadBuffer(buff_frames, CL_TRUE, 0, sizeof(float) * frames.size(), frames.data());
+                for (uint32_t fr = 0; fr < n_frames; fr++) {
+                    for (auto& sc : scanners) {
+                        if (sizeof(data_t) == sizeof(float)) {
+                            sc.out_file.write((char*)(frames.data() + fr * n_scan + sc.first), sizeof(data_t) * sc.num_elements);
+                        }
+                        else {
+                            std::vector<data_t> tmp(frames.begin() + fr * n_scan + sc.first, frames.begin() + fr * n_scan + sc.first + sc.num_elements);
+                            sc.out_file.write((char*)tmp.data(), sizeof(data_t) * sc.num_elements);
+                        }
+                    }
+                }
+            }
+            n_steps -= steps;
+        }
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't run simulation of batch (fas::field_batch::Run()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+}
+
+data_t * field_batch::Map_p_t_read(uint32_t member) {
+    if (member >= count)
+        throw std::runtime_error("ERR: Index of member is out of range (fas::field_batch::Map_p_t_read())");
+    try {
+        std::vector<float> tmp(Elements());
+        cl_queue.enqueueReadBuffer(p_buff ? buff_B : buff_A, CL_TRUE, sizeof(float) * Elements() * member, sizeof(float) * Elements(), tmp.data());
+        p_host.assign(tmp.begin(), tmp.end());
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't read pressure of member (fas::field_batch::Map_p_t_read()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+    return p_host.data();
+}
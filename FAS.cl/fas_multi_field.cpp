@@ -0,0 +1,293 @@
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include "fas.hpp"
+
+using namespace fas;
+
+std::vector<double> multi_field::MeasureThroughput(const std::vector<device*>& devices, vec3<uint32_t> size, size_t n_steps) {
+    std::vector<double> rv;
+    for (auto d : devices) {
+        // homogeneous test field, thin enough to be fast on slow device
+        field test(*d, vec3<uint32_t>(size.x, size.y, size.z < 32 ? size.z : 32));
+        test.materials = { { 343.0f, 1.2f, 0.0f, "Air" } };
+        material::Recalc(test.materials);
+        test.Prepare();
+        test.Clear();
+        test.SimStep(); // warm-up, first launch may be slower
+        test.Finish();
+        auto t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < n_steps; i++)
+            test.SimStep();
+        test.Finish();
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        double elements = (double)test.size.x * test.size.y * test.size.z;
+        rv.push_back(elements * n_steps / (s > 0.0 ? s : 1e-9));
+    }
+    return rv;
+}
+
+void multi_field::UseNumaNodes(cl::Device& dev, const char* ocl_path) {
+    numa_nodes.clear();
+    numa_devs = device::NumaSubDevices(dev); // device::phy_dev points here, vector isn't resized later
+    devices.clear();
+    for (auto& sub : numa_devs) {
+        numa_nodes.emplace_back(new device(sub, ocl_path));
+        devices.push_back(numa_nodes.back().get());
+    }
+    weights.assign(devices.size(), 1.0); // nodes are symmetric
+}
+
+void multi_field::Prepare(bool want_rms) {
+    size_t n = devices.size();
+    if (n == 0)
+        throw std::runtime_error("ERR: No devices defined (fas::multi_field::Prepare())");
+    if (size.z < 3 * n)
+        throw std::runtime_error("ERR: Field is too thin, each slab needs at least 3 planes (fas::multi_field::Prepare())");
+    if (n > 1 && boundary[4] == field::BOUNDARY_PERIODIC)
+        throw std::runtime_error("ERR: Periodic boundary along z needs single device (fas::multi_field::Prepare())");
+    if (weights.size() != n)
+        weights = MeasureThroughput(devices, size);
+
+    // thickness of slabs proportional to weights, min. 3 planes (plane #1 of field must be inside of first slab)
+    double sum = 0.0;
+    for (auto w : weights)
+        sum += w > 0.0 ? w : 0.0;
+    std::vector<int64_t> own(n);
+    int64_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        double w = weights[i] > 0.0 ? weights[i] : 0.0;
+        own[i] = sum > 0.0 ? (int64_t)(size.z * w / sum) : size.z / n;
+        own[i] = own[i] < 3 ? 3 : own[i];
+        total += own[i];
+    }
+    // distribute rounding error, fastest devices first
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return weights[a] > weights[b]; });
+    for (size_t k = 0; total != (int64_t)size.z; k = (k + 1) % n) {
+        size_t i = order[k];
+        if (total < (int64_t)size.z) {
+            own[i]++;
+            total++;
+        }
+        else if (own[i] > 3) {
+            own[i]--;
+            total--;
+        }
+    }
+    z_begin.resize(n + 1);
+    z_begin[0] = 0;
+    for (size_t i = 0; i < n; i++)
+        z_begin[i + 1] = z_begin[i] + (uint32_t)own[i];
+
+    // create slabs: [low halo] owned planes [upper halo, spare plane]
+    slabs.clear();
+    for (size_t i = 0; i < n; i++) {
+        uint32_t lo = i > 0 ? 1 : 0;
+        uint32_t hi = i < n - 1 ? 2 : 0;
+        std::unique_ptr<field> s(new field(*devices[i], vec3<uint32_t>(size.x, size.y, (uint32_t)own[i] + lo + hi), dx, dt));
+        s->materials = materials;
+        s->rms_window = rms_window;
+        s->sim_kernel = sim_kernel;
+        s->half_storage = half_storage;
+        s->double_precision = double_precision;
+        s->fast_math = fast_math;
+        s->profiling = profiling;
+        s->z_offset = z_begin[i] - lo;
+        s->halo_lo = lo != 0;
+        s->split_edges = n > 1; // owned planes next to halos are calculated first, see ExchangeHalos()
+        for (int f = 0; f < 4; f++)
+            s->boundary[f] = boundary[f];
+        s->boundary[4] = lo ? field::BOUNDARY_DEFAULT : boundary[4]; // halo planes are read as is
+        s->boundary[5] = hi ? field::BOUNDARY_DEFAULT : boundary[5];
+        s->Prepare(want_rms);
+        s->Clear(); // first touch of memory by kernel on slab's own device (local NUMA node of sub-device)
+        slabs.push_back(std::move(s));
+    }
+    halos.assign(n, halo_io());
+    parity = 0;
+    report_step = 0;
+}
+
+void multi_field::Clear() {
+    for (auto& s : slabs)
+        s->Clear();
+    parity = 0;
+    report_step = 0;
+}
+
+void multi_field::SimStep() {
+    for (auto& s : slabs) {
+        s->SimStep();
+        s->cl_queue.flush(); // all devices calculate simultaneously
+    }
+    ExchangeHalos();
+}
+
+void multi_field::ExchangeHalos() {
+    size_t n = slabs.size();
+    if (n < 2)
+        return;
+    int pp = parity;
+    try {
+        // read boundary planes of all slabs (device -> host) by io_queue as soon as they are calculated, interior is still calculated by cl_queue
+        for (size_t i = 0; i < n; i++) {
+            field& s = *slabs[i];
+            halo_io& h = halos[i];
+            size_t plane = s.PSize() * s.size.x * s.size.y;
+            cl::Buffer& buff = s.p_buff ? s.buff_B : s.buff_A;
+            uint32_t first = s.halo_lo ? 1 : 0;
+            uint32_t last = first + z_begin[i + 1] - z_begin[i] - 1;
+            if (!s.edges_done()) // edge planes weren't calculated separately (e.g. SIM_SPLIT), wait for whole step
+                s.cl_queue.enqueueMarkerWithWaitList(NULL, &s.edges_done);
+            std::vector<cl::Event> edges = { s.edges_done };
+            if (i > 0) {
+                if (h.lo_written[pp]())
+                    h.lo_written[pp].wait(); // staging buffer is still source of previous write
+                h.lo[pp].resize(plane);
+                s.io_queue.enqueueReadBuffer(buff, CL_FALSE, plane * first, plane, h.lo[pp].data(), &edges, &h.lo_read);
+            }
+            if (i < n - 1) {
+                if (h.hi_written[pp]())
+                    h.hi_written[pp].wait();
+                h.hi[pp].resize(plane);
+                s.io_queue.enqueueReadBuffer(buff, CL_FALSE, plane * last, plane, h.hi[pp].data(), &edges, &h.hi_read);
+            }
+            s.cl_queue.flush();
+            s.io_queue.flush();
+        }
+        // write them to halos of neighbours (host -> device) by io_queue, devices don't share context so host waits for reads;
+        // interior kernel doesn't write halo planes of p(t+1), so writes may run along with it
+        std::vector<std::vector<cl::Event>> written(n); // writes into each slab
+        for (size_t i = 0; i < n; i++) {
+            halo_io& h = halos[i];
+            if (i > 0) {
+                field& t = *slabs[i - 1];
+                size_t plane = t.PSize() * t.size.x * t.size.y;
+                uint32_t upper = (t.halo_lo ? 1 : 0) + z_begin[i] - z_begin[i - 1];
+                h.lo_read.wait();
+                t.io_queue.enqueueWriteBuffer(t.p_buff ? t.buff_B : t.buff_A, CL_FALSE, plane * upper, plane, h.lo[pp].data(), NULL, &h.lo_written[pp]);
+                t.io_queue.flush();
+                written[i - 1].push_back(h.lo_written[pp]);
+            }
+            if (i < n - 1) {
+                field& t = *slabs[i + 1];
+                size_t plane = t.PSize() * t.size.x * t.size.y;
+                h.hi_read.wait();
+                t.io_queue.enqueueWriteBuffer(t.p_buff ? t.buff_B : t.buff_A, CL_FALSE, 0, plane, h.hi[pp].data(), NULL, &h.hi_written[pp]);
+                t.io_queue.flush();
+                written[i + 1].push_back(h.hi_written[pp]);
+            }
+        }
+        // next work of slab (drivers, scanners, next step) starts after its halos are written
+        for (size_t i = 0; i < n; i++) {
+            slabs[i]->cl_queue.enqueueBarrierWithWaitList(&written[i]);
+            slabs[i]->cl_queue.flush();
+        }
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't exchange halos of slabs (fas::multi_field::ExchangeHalos()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+    parity = pp ? 0 : 1;
+}
+
+void multi_field::Run(size_t n_steps, const std::vector<driver*>& drivers, const std::vector<scanner*>& scanners) {
+    Unmap_p_t();
+    for (size_t i = 0; i < n_steps; i++) {
+        for (auto drv : drivers)
+            drv->Drive((data_t)(StepsCalculated() * dt));
+        SimStep();
+        for (auto sc : scanners)
+            sc->ScanPipelined();
+    }
+    for (auto sc : scanners)
+        sc->Drain();
+}
+
+void multi_field::FinishRms() {
+    for (auto& s : slabs)
+        s->FinishRms();
+}
+
+size_t multi_field::SlabOf(uint32_t z) {
+    size_t i = std::upper_bound(z_begin.begin(), z_begin.end(), z) - z_begin.begin();
+    i = i ? i - 1 : 0;
+    return i < slabs.size() ? i : slabs.size() - 1;
+}
+
+std::vector<double> multi_field::SlabThroughput() {
+    std::vector<double> rv;
+    size_t steps = StepsCalculated() - report_step;
+    report_step = StepsCalculated();
+    for (size_t i = 0; i < slabs.size(); i++) {
+        double ns = (double)slabs[i]->ProfiledTime();
+        double elements = (double)size.x * size.y * (z_begin[i + 1] - z_begin[i]);
+        rv.push_back(ns > 0.0 ? elements * steps * 1e9 / ns : 0.0);
+    }
+    return rv;
+}
+
+std::string multi_field::ThroughputReport() {
+    std::vector<double> tp = SlabThroughput();
+    std::string rv;
+    double total = 0.0;
+    for (size_t i = 0; i < slabs.size(); i++) {
+        rv += "slab " + std::to_string(i) + " (planes " + std::to_string(z_begin[i]) + " - " + std::to_string(z_begin[i + 1] - 1) + ") on ";
+        rv += slabs[i]->d->phy_dev->getInfo<CL_DEVICE_NAME>();
+        rv += " [" + std::to_string(slabs[i]->d->phy_dev->getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()) + " CU]: ";
+        rv += std::to_string(tp[i] * 1e-6) + " Melements * steps / s\n";
+        total += tp[i];
+    }
+    rv += "total (kernels only, sum of slabs): " + std::to_string(total * 1e-6) + " Melements * steps / s\n";
+    return rv;
+}
+
+data_t * multi_field::Map_p_t_read() {
+    Unmap_p_t();
+    size_t plane = (size_t)size.x * size.y;
+    p_host.resize(plane * size.z);
+    for (size_t i = 0; i < slabs.size(); i++) {
+        field& s = *slabs[i];
+        data_t* p = s.Map_p_t_read();
+        memcpy(p_host.data() + plane * z_begin[i], p + plane * (s.halo_lo ? 1 : 0), sizeof(data_t) * plane * (z_begin[i + 1] - z_begin[i]));
+        s.Unmap_p_t();
+    }
+    return p_host.data();
+}
+
+data_t * multi_field::Map_p_t_write() {
+    Unmap_p_t();
+    p_host.assign((size_t)size.x * size.y * size.z, 0.0f);
+    p_host_write = true;
+    return p_host.data();
+}
+
+void multi_field::Unmap_p_t() {
+    if (!p_host_write)
+        return;
+    p_host_write = false;
+    size_t plane = (size_t)size.x * size.y;
+    // whole slab including halos
+    for (auto& s : slabs) {
+        data_t* p = s->Map_p_t_write();
+        memcpy(p, p_host.data() + plane * s->z_offset, sizeof(data_t) * plane * s->size.z);
+        s->Unmap_p_t();
+    }
+}
+
+data_t * multi_field::Map_rms_read() {
+    size_t plane = (size_t)size.x * size.y;
+    rms_host.resize(plane * size.z);
+    for (size_t i = 0; i < slabs.size(); i++) {
+        field& s = *slabs[i];
+        data_t* p = s.Map_rms_read();
+        memcpy(rms_host.data() + plane * z_begin[i], p + plane * (s.halo_lo ? 1 : 0), sizeof(data_t) * plane * (z_begin[i + 1] - z_begin[i]));
+        s.Unmap_rms();
+    }
+    return rms_host.data();
+}
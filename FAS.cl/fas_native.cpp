@@ -0,0 +1,469 @@
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cmath>
+#include "fas.hpp"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	#include <immintrin.h>
+	#define FAS_NATIVE_X86 // SIMD variants compiled by target attribute, selected by CPU at runtime
+#endif
+
+using namespace fas;
+
+worker_pool::worker_pool(unsigned n) {
+    for (unsigned t = 1; t < n; t++) {
+        threads.emplace_back([this, t]() {
+            uint64_t done = 0; // last generation run by this worker
+            for (;;) {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv_job.wait(lock, [&]() { return stop || generation != done; });
+                if (stop)
+                    return;
+                done = generation;
+                const std::function<void(unsigned)>* fn = job;
+                lock.unlock();
+                (*fn)(t);
+                lock.lock();
+                if (--pending == 0)
+                    cv_done.notify_one();
+            }
+        });
+    }
+}
+
+worker_pool::~worker_pool() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+    }
+    cv_job.notify_all();
+    for (auto& th : threads)
+        th.join();
+}
+
+void worker_pool::Run(const std::function<void(unsigned)>& fn) {
+    if (threads.empty()) {
+        fn(0);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        job = &fn;
+        pending = (unsigned)threads.size();
+        generation++;
+    }
+    cv_job.notify_all();
+    fn(0); // first part by calling thread
+    std::unique_lock<std::mutex> lock(mtx);
+    cv_done.wait(lock, [&]() { return pending == 0; });
+    job = nullptr;
+}
+
+worker_pool& field::Workers() {
+    unsigned n = num_threads ? num_threads : std::max(1u, std::thread::hardware_concurrency());
+    if (!workers || workers->Size() != n)
+        workers.reset(new worker_pool(n));
+    return *workers;
+}
+
+// runs fn(begin, end) on sub-ranges of [begin, end) by workers of field, thread t always gets t-th contiguous part
+template<typename F>
+static void ParallelFor(field& f, size_t begin, size_t end, F fn) {
+    size_t n = end > begin ? end - begin : 0;
+    worker_pool& pool = f.Workers();
+    unsigned threads = pool.Size();
+    if (threads == 1 || n < 2) {
+        fn(begin, end);
+        return;
+    }
+    pool.Run([&](unsigned t) {
+        size_t b = begin + n * t / threads, e = begin + n * (t + 1) / threads;
+        if (b < e) // more threads than items
+            fn(b, e);
+    });
+}
+
+// pointers to rows used by calculation of one row (fixed y, z) of field, see sim_step kernel
+struct row_t {
+    const float* p; // p(t), actual row
+    float* p_tm1; // p(t-1), overwritten by p(t+1)
+    const float* yp, * ym, * zp, * zm; // p(t) of adjacent rows, given by boundary mode on faces (yp / ym points to actual row on rigid y boundary)
+    const uint8_t* m, * m_yp, * m_ym, * m_zp, * m_zm; // materials of actual and adjacent rows
+    const float* tr; // table of transmission coefficients
+    const float* k; // (c * dt / dx)^2 of materials
+    uint32_t n_mat;
+    uint32_t x_lo, x_hi; // boundary modes of x faces (FAS_BND_ of fas.cl)
+};
+
+// offset of adjacent element across face with boundary mode, same as face_neighbour() of fas.cl
+// step: offset of adjacent element in memory, wrap: offset of boundary element of opposite face
+static inline ptrdiff_t FaceOffset(uint32_t mode, ptrdiff_t step, ptrdiff_t wrap) {
+    switch (mode) {
+    case field::BOUNDARY_RIGID: return 0;
+    case field::BOUNDARY_MIRROR: return -step;
+    case field::BOUNDARY_PERIODIC: return wrap;
+    default: return step;
+    }
+}
+
+// one element of row, x boundaries are given by boundary modes (rigid: virtual copies of element itself)
+static inline void CellScalar(const row_t& r, uint32_t x, uint32_t x_size) {
+    float my_p = r.p[x];
+    ptrdiff_t xp1 = x == x_size - 2 ? x + FaceOffset(r.x_hi, 1, -(ptrdiff_t)(x_size - 3)) : x + 1;
+    ptrdiff_t xm1 = x == 1 ? x + FaceOffset(r.x_lo, -1, x_size - 3) : x - 1;
+    float xp1_p = r.p[xp1];
+    float xm1_p = r.p[xm1];
+    const float* my_tr = r.tr + (size_t)r.m[x] * r.n_mat;
+    float acc;
+    acc =  my_tr[r.m[xp1]] * (xp1_p - my_p);
+    acc += my_tr[r.m_yp[x]] * (r.yp[x] - my_p);
+    acc += my_tr[r.m_zp[x]] * (r.zp[x] - my_p);
+    acc += my_tr[r.m[xm1]] * (xm1_p - my_p);
+    acc += my_tr[r.m_ym[x]] * (r.ym[x] - my_p);
+    acc += my_tr[r.m_zm[x]] * (r.zm[x] - my_p);
+    r.p_tm1[x] = r.k[r.m[x]] * acc + 2.0f * my_p - r.p_tm1[x];
+}
+
+// elements [x0, x1) of row without x boundaries, returns first not calculated element
+static uint32_t RowScalar(const row_t& r, uint32_t x0, uint32_t x1, uint32_t x_size) {
+    for (uint32_t x = x0; x < x1; x++)
+        CellScalar(r, x, x_size);
+    return x1;
+}
+
+#ifdef FAS_NATIVE_X86
+__attribute__((target("avx2")))
+static uint32_t RowAvx2(const row_t& r, uint32_t x0, uint32_t x1, uint32_t) {
+    const __m256i n_mat = _mm256_set1_epi32((int)r.n_mat);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    uint32_t x = x0;
+    for (; x + 8 <= x1; x += 8) {
+        // materials -> row of transmission table, gather coefficients of neighbours
+        __m256i my_m = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(r.m + x)));
+        __m256i row = _mm256_mullo_epi32(my_m, n_mat);
+        #define FAS_TR8(mp) _mm256_i32gather_ps(r.tr, _mm256_add_epi32(row, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(mp)))), 4)
+        __m256 my_p = _mm256_loadu_ps(r.p + x);
+        __m256 acc;
+        acc = _mm256_mul_ps(FAS_TR8(r.m + x + 1), _mm256_sub_ps(_mm256_loadu_ps(r.p + x + 1), my_p));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(FAS_TR8(r.m_yp + x), _mm256_sub_ps(_mm256_loadu_ps(r.yp + x), my_p)));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(FAS_TR8(r.m_zp + x), _mm256_sub_ps(_mm256_loadu_ps(r.zp + x), my_p)));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(FAS_TR8(r.m + x - 1), _mm256_sub_ps(_mm256_loadu_ps(r.p + x - 1), my_p)));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(FAS_TR8(r.m_ym + x), _mm256_sub_ps(_mm256_loadu_ps(r.ym + x), my_p)));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(FAS_TR8(r.m_zm + x), _mm256_sub_ps(_mm256_loadu_ps(r.zm + x), my_p)));
+        #undef FAS_TR8
+        __m256 k = _mm256_i32gather_ps(r.k, my_m, 4);
+        __m256 out = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(k, acc), _mm256_mul_ps(two, my_p)), _mm256_loadu_ps(r.p_tm1 + x));
+        _mm256_storeu_ps(r.p_tm1 + x, out);
+    }
+    return x;
+}
+
+__attribute__((target("avx512f")))
+static uint32_t RowAvx512(const row_t& r, uint32_t x0, uint32_t x1, uint32_t) {
+    const __m512i n_mat = _mm512_set1_epi32((int)r.n_mat);
+    const __m512 two = _mm512_set1_ps(2.0f);
+    const __m512 zero = _mm512_setzero_ps();
+    // masked (all lanes) forms of gather / conversion: unmasked ones leave source undefined (-Wmaybe-uninitialized)
+    #define FAS_U8_16(mp) _mm512_maskz_cvtepu8_epi32(0xFFFF, _mm_loadu_si128((const __m128i*)(mp)))
+    uint32_t x = x0;
+    for (; x + 16 <= x1; x += 16) {
+        __m512i my_m = FAS_U8_16(r.m + x);
+        __m512i row = _mm512_mullo_epi32(my_m, n_mat);
+        #define FAS_TR16(mp) _mm512_mask_i32gather_ps(zero, 0xFFFF, _mm512_add_epi32(row, FAS_U8_16(mp)), r.tr, 4)
+        __m512 my_p = _mm512_loadu_ps(r.p + x);
+        __m512 acc;
+        acc = _mm512_mul_ps(FAS_TR16(r.m + x + 1), _mm512_sub_ps(_mm512_loadu_ps(r.p + x + 1), my_p));
+        acc = _mm512_add_ps(acc, _mm512_mul_ps(FAS_TR16(r.m_yp + x), _mm512_sub_ps(_mm512_loadu_ps(r.yp + x), my_p)));
+        acc = _mm512_add_ps(acc, _mm512_mul_ps(FAS_TR16(r.m_zp + x), _mm512_sub_ps(_mm512_loadu_ps(r.zp + x), my_p)));
+        acc = _mm512_add_ps(acc, _mm512_mul_ps(FAS_TR16(r.m + x - 1), _mm512_sub_ps(_mm512_loadu_ps(r.p + x - 1), my_p)));
+        acc = _mm512_add_ps(acc, _mm512_mul_ps(FAS_TR16(r.m_ym + x), _mm512_sub_ps(_mm512_loadu_ps(r.ym + x), my_p)));
+        acc = _mm512_add_ps(acc, _mm512_mul_ps(FAS_TR16(r.m_zm + x), _mm512_sub_ps(_mm512_loadu_ps(r.zm + x), my_p)));
+        #undef FAS_TR16
+        __m512 k = _mm512_mask_i32gather_ps(zero, 0xFFFF, my_m, r.k, 4);
+        __m512 out = _mm512_sub_ps(_mm512_add_ps(_mm512_mul_ps(k, acc), _mm512_mul_ps(two, my_p)), _mm512_loadu_ps(r.p_tm1 + x));
+        _mm512_storeu_ps(r.p_tm1 + x, out);
+    }
+    #undef FAS_U8_16
+    return x;
+}
+#endif
+
+typedef uint32_t (*row_fn_t)(const row_t&, uint32_t, uint32_t, uint32_t);
+
+// best variant of row kernel for this CPU
+static row_fn_t RowKernel() {
+#ifdef FAS_NATIVE_X86
+    static const row_fn_t fn = __builtin_cpu_supports("avx512f") ? RowAvx512 :
+                               __builtin_cpu_supports("avx2") ? RowAvx2 : RowScalar;
+    return fn;
+#else
+    return RowScalar;
+#endif
+}
+
+const char* native::SimdName() {
+#ifdef FAS_NATIVE_X86
+    row_fn_t fn = RowKernel();
+    return fn == RowAvx512 ? "AVX-512" : fn == RowAvx2 ? "AVX2" : "scalar";
+#else
+    return "scalar";
+#endif
+}
+
+void native::Clear(field& f) {
+    size_t plane = (size_t)f.size.x * f.size.y;
+    ParallelFor(f, 0, f.size.z, [&](size_t z0, size_t z1) {
+        // each thread touches its own planes first
+        std::fill(f.host_A.begin() + z0 * plane, f.host_A.begin() + z1 * plane, 0.0f);
+        std::fill(f.host_B.begin() + z0 * plane, f.host_B.begin() + z1 * plane, 0.0f);
+        std::fill(f.host_mat.begin() + z0 * plane, f.host_mat.begin() + z1 * plane, (uint8_t)0);
+        if (f.calc_rms)
+            std::fill(f.host_rms.begin() + z0 * plane, f.host_rms.begin() + z1 * plane, 0.0f);
+    });
+}
+
+void native::SimStep(field& f) {
+    const uint32_t x_size = f.size.x, y_size = f.size.y, z_size = f.size.z;
+    const size_t plane = (size_t)x_size * y_size;
+    float* p_t = f.p_buff ? f.host_B.data() : f.host_A.data();
+    float* p_tm1 = f.p_buff ? f.host_A.data() : f.host_B.data();
+    const uint8_t* mat = f.host_mat.data();
+
+    // calculated part of active box: x in [xa, xe], y in [ya, ye), z in [za, ze)
+    const uint32_t xa = std::max<uint32_t>(f.active_lo.x, 1), xe = std::min<uint32_t>(f.active_hi.x, x_size - 2);
+    const uint32_t ya = std::max<uint32_t>(f.active_lo.y, 1), y_end = std::min<uint32_t>(f.active_hi.y + 1, y_size - 1);
+    const uint32_t za = std::max<uint32_t>(f.active_lo.z, 1), ze = std::min<uint32_t>(f.active_hi.z + 1, z_size - 2);
+    if (xa > xe || ya >= y_end)
+        return;
+
+    const uint32_t bnd = f.BoundaryBits();
+    auto mode = [bnd](int face) { return (bnd >> (2 * face)) & 3; };
+
+    // boundary planes (copy before calculation, no race as in kernel), only rows of active box can be non-zero
+    for (uint32_t y = f.active_lo.y; y <= f.active_hi.y; y++) {
+        size_t row = (size_t)y * x_size;
+        if (!f.halo_lo && mode(4) == field::BOUNDARY_DEFAULT)
+            std::copy(p_t + row, p_t + row + x_size, p_t + plane + row);
+        std::copy(p_t + (z_size - 2) * plane + row, p_t + (z_size - 2) * plane + row + x_size, p_t + (z_size - 1) * plane + row);
+    }
+
+    row_fn_t row_fn = RowKernel();
+    // rows of block are reused by calculation of next plane: (block + 2) rows * 3 planes of p and materials should fit in L2
+    uint32_t block = (uint32_t)std::max<size_t>(4, (size_t)(256 * 1024) / ((size_t)x_size * 5 * 3 * 2));
+    ParallelFor(f, za, ze, [&](size_t z0, size_t z1) {
+        for (uint32_t yb = ya; yb < y_end; yb += block) {
+            uint32_t ye = std::min(yb + block, y_end);
+            for (size_t z = z0; z < z1; z++) {
+                for (uint32_t y = yb; y < ye; y++) {
+                    size_t idx = z * plane + (size_t)y * x_size;
+                    row_t r;
+                    r.p = p_t + idx;
+                    r.p_tm1 = p_tm1 + idx;
+                    // adjacent rows, behind faces given by boundary mode
+                    ptrdiff_t row = x_size, pl = plane;
+                    ptrdiff_t yp = y == y_size - 2 ? FaceOffset(mode(3), row, -(ptrdiff_t)(y_size - 3) * row) : row;
+                    ptrdiff_t ym = y == 1 ? FaceOffset(mode(2), -row, (ptrdiff_t)(y_size - 3) * row) : -row;
+                    ptrdiff_t zp = z == z_size - 3 ? FaceOffset(mode(5), pl, -(ptrdiff_t)(z_size - 4) * pl) : pl;
+                    ptrdiff_t zm = z == 1 ? FaceOffset(mode(4), -pl, (ptrdiff_t)(z_size - 4) * pl) : -pl;
+                    r.yp = r.p + yp;
+                    r.ym = r.p + ym;
+                    r.zp = r.p + zp;
+                    r.zm = r.p + zm;
+                    r.m = mat + idx;
+                    r.m_yp = r.m + yp;
+                    r.m_ym = r.m + ym;
+                    r.m_zp = r.m + zp;
+                    r.m_zm = r.m + zm;
+                    r.x_lo = mode(0);
+                    r.x_hi = mode(1);
+                    r.tr = f.host_tr.data();
+                    r.k = f.host_k.data();
+                    r.n_mat = (uint32_t)f.materials.size();
+                    // x boundaries by scalar code, inner part [xs, xi) by SIMD, rest by scalar code
+                    uint32_t xs = xa, xi = xe == x_size - 2 ? xe : xe + 1;
+                    if (xa == 1) {
+                        CellScalar(r, 1, x_size);
+                        xs = 2;
+                    }
+                    uint32_t x = xs < xi ? row_fn(r, xs, xi, x_size) : xs;
+                    RowScalar(r, x, xi, x_size);
+                    if (xe == x_size - 2 && x_size > 3)
+                        CellScalar(r, x_size - 2, x_size);
+                }
+            }
+        }
+    });
+}
+
+void native::RmsSum(field& f, data_t window, uint32_t z0, uint32_t z1) {
+    const float* p_t = f.p_buff ? f.host_B.data() : f.host_A.data();
+    size_t plane = (size_t)f.size.x * f.size.y;
+    ParallelFor(f, z0 * plane, z1 * plane, [&](size_t i0, size_t i1) {
+        for (size_t i = i0; i < i1; i++) {
+            float p = p_t[i] * window; // "windowed" pressure
+            f.host_rms[i] += p * p;
+        }
+    });
+}
+
+void native::RmsFinal(field& f, data_t inv_steps, data_t inv_sqrt_nnpg) {
+    ParallelFor(f, 0, f.host_rms.size(), [&](size_t i0, size_t i1) {
+        for (size_t i = i0; i < i1; i++)
+            f.host_rms[i] = inv_sqrt_nnpg * std::sqrt(inv_steps * f.host_rms[i]);
+    });
+}
+
+void native::PmlStep(field& f) {
+    const uint32_t x_size = f.size.x, y_size = f.size.y, z_size = f.size.z, n = f.pml_cells;
+    const size_t plane = (size_t)x_size * y_size;
+    const float* p_t = f.p_buff ? f.host_A.data() : f.host_B.data(); // buffers are already swapped
+    float* p_new = f.p_buff ? f.host_B.data() : f.host_A.data();
+    const uint8_t* mat = f.host_mat.data();
+    const uint32_t n_mat = (uint32_t)f.materials.size();
+    const float coef = 1.5f * std::log(1.0f / f.pml_reflection) / n;
+    // depth of element in layer along one axis, see pml_depth() in fas.cl
+    auto depth = [n](uint32_t my, uint32_t last) { return my <= n ? n + 1 - my : (my + n > last ? my + n - last : 0); };
+    for (auto& b : f.PmlBoxes()) {
+        ParallelFor(f, 0, b.extent.z, [&](size_t z0, size_t z1) {
+            for (size_t gz = z0; gz < z1; gz++) {
+                for (uint32_t gy = 0; gy < b.extent.y; gy++) {
+                    for (uint32_t gx = 0; gx < b.extent.x; gx++) {
+                        uint32_t x = b.origin.x + gx, y = b.origin.y + gy, z = b.origin.z + (uint32_t)gz;
+                        size_t idx = z * plane + (size_t)y * x_size + x;
+                        float* st = f.host_pml.data() + 6 * (b.base + (gz * b.extent.y + gy) * b.extent.x + gx);
+                        float my_p = p_t[idx];
+                        float xp1_p = x == x_size - 2 ? my_p : p_t[idx + 1];
+                        float xm1_p = x == 1 ? my_p : p_t[idx - 1];
+                        float yp1_p = y == y_size - 2 ? my_p : p_t[idx + x_size];
+                        float ym1_p = y == 1 ? my_p : p_t[idx - x_size];
+                        const float* my_tr = f.host_tr.data() + (size_t)mat[idx] * n_mat;
+                        float my_k = f.host_k[mat[idx]];
+                        float lap[3];
+                        lap[0] = my_tr[mat[idx + 1]] * (xp1_p - my_p) + my_tr[mat[idx - 1]] * (xm1_p - my_p);
+                        lap[1] = my_tr[mat[idx + x_size]] * (yp1_p - my_p) + my_tr[mat[idx - x_size]] * (ym1_p - my_p);
+                        lap[2] = my_tr[mat[idx + plane]] * (p_t[idx + plane] - my_p) + my_tr[mat[idx - plane]] * (p_t[idx - plane] - my_p);
+                        uint32_t d[3] = { depth(x, x_size - 2), depth(y, y_size - 2), depth(z, z_size - 3) };
+                        float corr = (my_p - (st[0] + st[1] + st[2])) * (1.0f / 3.0f);
+                        float sdt_max = coef * std::sqrt(my_k);
+                        float p = 0.0f;
+                        for (int i = 0; i < 3; i++) {
+                            float rel = d[i] ? (d[i] - 0.5f) / n : 0.0f;
+                            float sdt = sdt_max * rel * rel;
+                            float cur = st[i] + corr;
+                            float next = (2.0f * cur - (1.0f - sdt) * st[3 + i] - sdt * sdt * cur + my_k * lap[i]) / (1.0f + sdt);
+                            st[3 + i] = cur;
+                            st[i] = next;
+                            p += next;
+                        }
+                        p_new[idx] = p;
+                    }
+                }
+            }
+        });
+    }
+}
+
+void native::Drive(field& f, const std::vector<uint64_t>& elements, data_t signal) {
+    float* p_t = f.p_buff ? f.host_B.data() : f.host_A.data();
+    for (auto e : elements)
+        p_t[e] = signal;
+}
+
+void native::DriveValues(field& f, const std::vector<uint64_t>& elements, const data_t* values) {
+    float* p_t = f.p_buff ? f.host_B.data() : f.host_A.data();
+    for (size_t i = 0; i < elements.size(); i++)
+        p_t[elements[i]] = values[i];
+}
+
+void native::Scan(field& f, const std::vector<uint64_t>& elements, data_t* out) {
+    const float* p_t = f.p_buff ? f.host_B.data() : f.host_A.data();
+    for (size_t i = 0; i < elements.size(); i++)
+        out[i] = p_t[elements[i]];
+}
+
+void native::ScanPlane(field& f, const data_t* rot_pos, vec2<uint32_t> size, bool trilinear, data_t* out) {
+    const float* p_t = f.p_buff ? f.host_B.data() : f.host_A.data();
+    size_t x_size = f.size.x, y_size = f.size.y;
+    auto mix = [](float a, float b, float w) { return a + (b - a) * w; };
+    for (uint32_t y = 0; y < size.y; y++) {
+        for (uint32_t x = 0; x < size.x; x++) {
+            // rotate, translate and clamp, see scan_plane kernel
+            float my_xf = (float)x, my_yf = (float)y;
+            float px = std::clamp(rot_pos[0] * my_xf + rot_pos[1] * my_yf + rot_pos[9], 0.0f, (float)(f.size.x - 1));
+            float py = std::clamp(rot_pos[3] * my_xf + rot_pos[4] * my_yf + rot_pos[10], 0.0f, (float)(f.size.y - 1));
+            float pz = std::clamp(rot_pos[6] * my_xf + rot_pos[7] * my_yf + rot_pos[11], 0.0f, (float)(f.size.z - 1));
+            uint32_t x0 = (uint32_t)px, y0 = (uint32_t)py, z0 = (uint32_t)pz;
+            data_t& o = out[(size_t)y * size.x + x];
+            if (!trilinear) {
+                o = p_t[INDEX3D(x0, y0, z0)];
+                continue;
+            }
+            uint32_t x1 = std::min(x0 + 1, f.size.x - 1), y1 = std::min(y0 + 1, f.size.y - 1), z1 = std::min(z0 + 1, f.size.z - 1);
+            float wx = px - x0, wy = py - y0, wz = pz - z0;
+            float p00 = mix(p_t[INDEX3D(x0, y0, z0)], p_t[INDEX3D(x1, y0, z0)], wx);
+            float p10 = mix(p_t[INDEX3D(x0, y1, z0)], p_t[INDEX3D(x1, y1, z0)], wx);
+            float p01 = mix(p_t[INDEX3D(x0, y0, z1)], p_t[INDEX3D(x1, y0, z1)], wx);
+            float p11 = mix(p_t[INDEX3D(x0, y1, z1)], p_t[INDEX3D(x1, y1, z1)], wx);
+            o = mix(mix(p00, p10, wy), mix(p01, p11, wy), wz);
+        }
+    }
+}
+
+void native::Object(field& f, shape_t shape, const data_t* rot_pos, vec3<uint32_t> range, uint32_t two_height, uint8_t material) {
+    size_t x_size = f.size.x, y_size = f.size.y;
+    float radius_a = 0.25f * range.x;
+    float radius_b = 0.25f * range.y;
+    float radius_c = 0.25f * range.z;
+    bool centered = shape != SHAPE_RECT && shape != SHAPE_BOX;
+    // rotate, translate and store one point of object, see object_x kernels
+    auto store = [&](float my_xf, float my_yf, float my_zf) {
+        float my_xff = rot_pos[0] * my_xf + rot_pos[1] * my_yf + rot_pos[2] * my_zf + rot_pos[9];
+        float my_yff = rot_pos[3] * my_xf + rot_pos[4] * my_yf + rot_pos[5] * my_zf + rot_pos[10];
+        float my_zff = rot_pos[6] * my_xf + rot_pos[7] * my_yf + rot_pos[8] * my_zf + rot_pos[11];
+        uint32_t my_x = (uint32_t)my_xff, my_y = (uint32_t)my_yff, my_z = (uint32_t)my_zff;
+        if (my_xff >= 0.0f && my_x < f.size.x && my_yff >= 0.0f && my_y < f.size.y && my_zff >= 0.0f && my_z < f.size.z)
+            f.host_mat[INDEX3D(my_x, my_y, my_z)] = material;
+    };
+    for (uint32_t gz = 0; gz < range.z; gz++) {
+        for (uint32_t gy = 0; gy < range.y; gy++) {
+            for (uint32_t gx = 0; gx < range.x; gx++) {
+                // scale by 0.5 (to remove "holes" in rotated object caused by float to int conversion)
+                float my_xf = 0.5f * gx - (centered ? radius_a : 0.0f);
+                float my_yf = 0.5f * gy - (centered ? radius_b : 0.0f);
+                float my_zf = shape == SHAPE_BOX ? 0.5f * gz : shape == SHAPE_ELLIPSOID ? 0.5f * gz - radius_c : 0.0f;
+                if (centered) {
+                    float e = my_xf * my_xf / (radius_a * radius_a) + my_yf * my_yf / (radius_b * radius_b);
+                    if (shape == SHAPE_ELLIPSOID)
+                        e += my_zf * my_zf / (radius_c * radius_c);
+                    if (e > 1.0f)
+                        continue;
+                }
+                if (shape == SHAPE_CYLINDER) {
+                    for (uint32_t i = 0; i < two_height; i++, my_zf += 0.5f)
+                        store(my_xf, my_yf, my_zf);
+                }
+                else {
+                    store(my_xf, my_yf, my_zf);
+                }
+            }
+        }
+    }
+}
+
+std::vector<std::vector<uint64_t>> native::CollectElements(field& f, const std::vector<uint8_t>& wanted_mat) {
+    std::vector<uint8_t> slot_of(256, 0xFF);
+    for (size_t i = 0; i < wanted_mat.size(); i++)
+        slot_of[wanted_mat[i]] = (uint8_t)i;
+    std::vector<std::vector<uint64_t>> rv(wanted_mat.size());
+    for (size_t i = 0; i < f.host_mat.size(); i++) {
+        uint8_t s = slot_of[f.host_mat[i]];
+        if (s != 0xFF)
+            rv[s].push_back(i);
+        f.host_mat[i] &= 0x7F; // MSB is used for transducer creation
+    }
+    f.marked_elements = false;
+    return rv;
+}
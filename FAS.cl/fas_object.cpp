@@ -5,23 +5,48 @@
 
 using namespace fas;
 
+// objects are drawn into dense buffer of materials, see field::Sparsify()
+static void RequireDense(field& f, const char* fn) {
+    if (f.sparse)
+        throw std::runtime_error(std::string("ERR: Objects must be created before field::Sparsify() (fas::object::") + fn + ")");
+}
+
+// tables of coefficients have one row per material of field.materials, MSB marks elements of transducers
+static void RequireMaterial(field& f, uint8_t material, const char* fn) {
+    if ((size_t)(material & 0x7F) >= f.materials.size())
+        throw std::runtime_error("ERR: Material " + std::to_string(material & 0x7F) + " isn't in field.materials (" +
+                                 std::to_string(f.materials.size()) + " materials) (fas::object::" + fn + ")");
+}
+
 void object::CreateRect(field& f, vec3<uint32_t> pos, vec3<double> rot, vec2<uint32_t> size, uint8_t material) {
+    RequireDense(f, "CreateRect");
+    RequireMaterial(f, material, "CreateRect");
     mat3_3<data_t> rmatv = RotationMatrix<data_t>(rot);
     data_t rot_pos[] = {   rmatv.a11, rmatv.a12, rmatv.a13, rmatv.a21, rmatv.a22, rmatv.a23, rmatv.a31, rmatv.a32, rmatv.a33,
-                        pos.x, pos.y, pos.z };
+                        pos.x, pos.y, (data_t)pos.z - (data_t)f.z_offset }; // z relative to slab, see field::z_offset
+
+    if (f.Native()) {
+        native::Object(f, native::SHAPE_RECT, rot_pos, vec3<uint32_t>(size.x * 2, size.y * 2, 1u), 0, material);
+        f.iface_dirty = true;
+        f.marked_elements |= (material & 0x80) != 0;
+        return;
+    }
 
     try {
+        f.prg->Require(program::GROUP_OBJECTS); // compiled on first use
         // alloc buffer for rotation matrix in device's global mem & copy data - will be deallocated by destructor
         cl::Buffer buff_rot_pos = cl::Buffer(f.d->cl_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, sizeof(data_t) * 12, rot_pos);
 
-        f.d->object_rect_kernel.setArg(0, f.buff_mat);
-        f.d->object_rect_kernel.setArg(1, buff_rot_pos);
-        f.d->object_rect_kernel.setArg(2, f.size.x);
-        f.d->object_rect_kernel.setArg(3, f.size.y);
-        f.d->object_rect_kernel.setArg(4, f.size.z);
-        f.d->object_rect_kernel.setArg(5, material);
-        f.cl_queue.enqueueNDRangeKernel(f.d->object_rect_kernel, { 0,0 }, { (size_t)size.x * 2,(size_t)size.y * 2 });
+        f.prg->object_rect_kernel.setArg(0, f.buff_mat);
+        f.prg->object_rect_kernel.setArg(1, buff_rot_pos);
+        f.prg->object_rect_kernel.setArg(2, f.size.x);
+        f.prg->object_rect_kernel.setArg(3, f.size.y);
+        f.prg->object_rect_kernel.setArg(4, f.size.z);
+        f.prg->object_rect_kernel.setArg(5, material);
+        f.cl_queue.enqueueNDRangeKernel(f.prg->object_rect_kernel, { 0,0 }, { (size_t)size.x * 2,(size_t)size.y * 2 });
         f.cl_queue.enqueueBarrierWithWaitList();
+        f.iface_dirty = true;
+        f.marked_elements |= (material & 0x80) != 0;
     }
     catch (cl::Error& e) {
         std::string s;
@@ -32,22 +57,34 @@ void object::CreateRect(field& f, vec3<uint32_t> pos, vec3<double> rot, vec2<uin
 }
 
 void object::CreateEllipse(field& f, vec3<uint32_t> pos, vec3<double> rot, vec2<uint32_t> size, uint8_t material) {
+    RequireDense(f, "CreateEllipse");
+    RequireMaterial(f, material, "CreateEllipse");
     mat3_3<data_t> rmatv = RotationMatrix<data_t>(rot);
     data_t rot_pos[] = { rmatv.a11, rmatv.a12, rmatv.a13, rmatv.a21, rmatv.a22, rmatv.a23, rmatv.a31, rmatv.a32, rmatv.a33,
-                        pos.x, pos.y, pos.z };
+                        pos.x, pos.y, (data_t)pos.z - (data_t)f.z_offset }; // z relative to slab, see field::z_offset
+
+    if (f.Native()) {
+        native::Object(f, native::SHAPE_ELLIPSE, rot_pos, vec3<uint32_t>(size.x * 4, size.y * 4, 1u), 0, material);
+        f.iface_dirty = true;
+        f.marked_elements |= (material & 0x80) != 0;
+        return;
+    }
 
     try {
+        f.prg->Require(program::GROUP_OBJECTS); // compiled on first use
         // alloc buffer for rotation matrix in device's global mem & copy data - will be deallocated by destructor
         cl::Buffer buff_rot_pos = cl::Buffer(f.d->cl_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, sizeof(data_t) * 12, rot_pos);
 
-        f.d->object_ellipse_kernel.setArg(0, f.buff_mat);
-        f.d->object_ellipse_kernel.setArg(1, buff_rot_pos);
-        f.d->object_ellipse_kernel.setArg(2, f.size.x);
-        f.d->object_ellipse_kernel.setArg(3, f.size.y);
-        f.d->object_ellipse_kernel.setArg(4, f.size.z);
-        f.d->object_ellipse_kernel.setArg(5, material);
-        f.cl_queue.enqueueNDRangeKernel(f.d->object_ellipse_kernel, { 0,0 }, { (size_t)size.x * 4,(size_t)size.y * 4 });
+        f.prg->object_ellipse_kernel.setArg(0, f.buff_mat);
+        f.prg->object_ellipse_kernel.setArg(1, buff_rot_pos);
+        f.prg->object_ellipse_kernel.setArg(2, f.size.x);
+        f.prg->object_ellipse_kernel.setArg(3, f.size.y);
+        f.prg->object_ellipse_kernel.setArg(4, f.size.z);
+        f.prg->object_ellipse_kernel.setArg(5, material);
+        f.cl_queue.enqueueNDRangeKernel(f.prg->object_ellipse_kernel, { 0,0 }, { (size_t)size.x * 4,(size_t)size.y * 4 });
         f.cl_queue.enqueueBarrierWithWaitList();
+        f.iface_dirty = true;
+        f.marked_elements |= (material & 0x80) != 0;
     }
     catch (cl::Error& e) {
         std::string s;
@@ -58,22 +95,34 @@ void object::CreateEllipse(field& f, vec3<uint32_t> pos, vec3<double> rot, vec2<
 }
 
 void object::CreateBox(field& f, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material) {
+    RequireDense(f, "CreateBox");
+    RequireMaterial(f, material, "CreateBox");
     mat3_3<data_t> rmatv = RotationMatrix<data_t>(rot);
     data_t rot_pos[] = { rmatv.a11, rmatv.a12, rmatv.a13, rmatv.a21, rmatv.a22, rmatv.a23, rmatv.a31, rmatv.a32, rmatv.a33,
-                        pos.x, pos.y, pos.z };
+                        pos.x, pos.y, (data_t)pos.z - (data_t)f.z_offset }; // z relative to slab, see field::z_offset
+
+    if (f.Native()) {
+        native::Object(f, native::SHAPE_BOX, rot_pos, vec3<uint32_t>(size.x * 2, size.y * 2, size.z * 2), 0, material);
+        f.iface_dirty = true;
+        f.marked_elements |= (material & 0x80) != 0;
+        return;
+    }
 
     try {
+        f.prg->Require(program::GROUP_OBJECTS); // compiled on first use
         // alloc buffer for rotation matrix in device's global mem & copy data - will be deallocated by destructor
         cl::Buffer buff_rot_pos = cl::Buffer(f.d->cl_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, sizeof(data_t) * 12, rot_pos);
 
-        f.d->object_box_kernel.setArg(0, f.buff_mat);
-        f.d->object_box_kernel.setArg(1, buff_rot_pos);
-        f.d->object_box_kernel.setArg(2, f.size.x);
-        f.d->object_box_kernel.setArg(3, f.size.y);
-        f.d->object_box_kernel.setArg(4, f.size.z);
-        f.d->object_box_kernel.setArg(5, material);
-        f.cl_queue.enqueueNDRangeKernel(f.d->object_box_kernel, { 0,0,0 }, { (size_t)size.x * 2,(size_t)size.y * 2,(size_t)size.z * 2 });
+        f.prg->object_box_kernel.setArg(0, f.buff_mat);
+        f.prg->object_box_kernel.setArg(1, buff_rot_pos);
+        f.prg->object_box_kernel.setArg(2, f.size.x);
+        f.prg->object_box_kernel.setArg(3, f.size.y);
+        f.prg->object_box_kernel.setArg(4, f.size.z);
+        f.prg->object_box_kernel.setArg(5, material);
+        f.cl_queue.enqueueNDRangeKernel(f.prg->object_box_kernel, { 0,0,0 }, { (size_t)size.x * 2,(size_t)size.y * 2,(size_t)size.z * 2 });
         f.cl_queue.enqueueBarrierWithWaitList();
+        f.iface_dirty = true;
+        f.marked_elements |= (material & 0x80) != 0;
     }
     catch (cl::Error& e) {
         std::string s;
@@ -84,23 +133,35 @@ void object::CreateBox(field& f, vec3<uint32_t> pos, vec3<double> rot, vec3<uint
 }
 
 void object::CreateCylinder(field& f, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material) {
+    RequireDense(f, "CreateCylinder");
+    RequireMaterial(f, material, "CreateCylinder");
     mat3_3<data_t> rmatv = RotationMatrix<data_t>(rot);
     data_t rot_pos[] = { rmatv.a11, rmatv.a12, rmatv.a13, rmatv.a21, rmatv.a22, rmatv.a23, rmatv.a31, rmatv.a32, rmatv.a33,
-                        pos.x, pos.y, pos.z };
+                        pos.x, pos.y, (data_t)pos.z - (data_t)f.z_offset }; // z relative to slab, see field::z_offset
+
+    if (f.Native()) {
+        native::Object(f, native::SHAPE_CYLINDER, rot_pos, vec3<uint32_t>(size.x * 4, size.y * 4, 1u), size.z * 2, material);
+        f.iface_dirty = true;
+        f.marked_elements |= (material & 0x80) != 0;
+        return;
+    }
 
     try {
+        f.prg->Require(program::GROUP_OBJECTS); // compiled on first use
         // alloc buffer for rotation matrix in device's global mem & copy data - will be deallocated by destructor
         cl::Buffer buff_rot_pos = cl::Buffer(f.d->cl_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, sizeof(data_t) * 12, rot_pos);
 
-        f.d->object_cylinder_kernel.setArg(0, f.buff_mat);
-        f.d->object_cylinder_kernel.setArg(1, buff_rot_pos);
-        f.d->object_cylinder_kernel.setArg(2, f.size.x);
-        f.d->object_cylinder_kernel.setArg(3, f.size.y);
-        f.d->object_cylinder_kernel.setArg(4, f.size.z);
-        f.d->object_cylinder_kernel.setArg(5, material);
-        f.d->object_cylinder_kernel.setArg(6, size.z * 2);
-        f.cl_queue.enqueueNDRangeKernel(f.d->object_cylinder_kernel, { 0,0 }, { (size_t)size.x * 4,(size_t)size.y * 4 });
+        f.prg->object_cylinder_kernel.setArg(0, f.buff_mat);
+        f.prg->object_cylinder_kernel.setArg(1, buff_rot_pos);
+        f.prg->object_cylinder_kernel.setArg(2, f.size.x);
+        f.prg->object_cylinder_kernel.setArg(3, f.size.y);
+        f.prg->object_cylinder_kernel.setArg(4, f.size.z);
+        f.prg->object_cylinder_kernel.setArg(5, material);
+        f.prg->object_cylinder_kernel.setArg(6, size.z * 2);
+        f.cl_queue.enqueueNDRangeKernel(f.prg->object_cylinder_kernel, { 0,0 }, { (size_t)size.x * 4,(size_t)size.y * 4 });
         f.cl_queue.enqueueBarrierWithWaitList();
+        f.iface_dirty = true;
+        f.marked_elements |= (material & 0x80) != 0;
     }
     catch (cl::Error& e) {
         std::string s;
@@ -111,22 +172,34 @@ void object::CreateCylinder(field& f, vec3<uint32_t> pos, vec3<double> rot, vec3
 }
 
 void object::CreateEllipsoid(field& f, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material) {
+    RequireDense(f, "CreateEllipsoid");
+    RequireMaterial(f, material, "CreateEllipsoid");
     mat3_3<data_t> rmatv = RotationMatrix<data_t>(rot);
     data_t rot_pos[] = { rmatv.a11, rmatv.a12, rmatv.a13, rmatv.a21, rmatv.a22, rmatv.a23, rmatv.a31, rmatv.a32, rmatv.a33,
-                        pos.x, pos.y, pos.z };
+                        pos.x, pos.y, (data_t)pos.z - (data_t)f.z_offset }; // z relative to slab, see field::z_offset
+
+    if (f.Native()) {
+        native::Object(f, native::SHAPE_ELLIPSOID, rot_pos, vec3<uint32_t>(size.x * 4, size.y * 4, size.z * 4), 0, material);
+        f.iface_dirty = true;
+        f.marked_elements |= (material & 0x80) != 0;
+        return;
+    }
 
     try {
+        f.prg->Require(program::GROUP_OBJECTS); // compiled on first use
         // alloc buffer for rotation matrix in device's global mem & copy data - will be deallocated by destructor
         cl::Buffer buff_rot_pos = cl::Buffer(f.d->cl_context, CL_MEM_COPY_HOST_PTR | CL_MEM_READ_ONLY, sizeof(data_t) * 12, rot_pos);
 
-        f.d->object_ellipsoid_kernel.setArg(0, f.buff_mat);
-        f.d->object_ellipsoid_kernel.setArg(1, buff_rot_pos);
-        f.d->object_ellipsoid_kernel.setArg(2, f.size.x);
-        f.d->object_ellipsoid_kernel.setArg(3, f.size.y);
-        f.d->object_ellipsoid_kernel.setArg(4, f.size.z);
-        f.d->object_ellipsoid_kernel.setArg(5, material);
-        f.cl_queue.enqueueNDRangeKernel(f.d->object_ellipsoid_kernel, { 0,0,0 }, { (size_t)size.x * 4,(size_t)size.y * 4,(size_t)size.z * 4 });
+        f.prg->object_ellipsoid_kernel.setArg(0, f.buff_mat);
+        f.prg->object_ellipsoid_kernel.setArg(1, buff_rot_pos);
+        f.prg->object_ellipsoid_kernel.setArg(2, f.size.x);
+        f.prg->object_ellipsoid_kernel.setArg(3, f.size.y);
+        f.prg->object_ellipsoid_kernel.setArg(4, f.size.z);
+        f.prg->object_ellipsoid_kernel.setArg(5, material);
+        f.cl_queue.enqueueNDRangeKernel(f.prg->object_ellipsoid_kernel, { 0,0,0 }, { (size_t)size.x * 4,(size_t)size.y * 4,(size_t)size.z * 4 });
         f.cl_queue.enqueueBarrierWithWaitList();
+        f.iface_dirty = true;
+        f.marked_elements |= (material & 0x80) != 0;
     }
     catch (cl::Error& e) {
         std::string s;
@@ -139,9 +212,14 @@ void object::CreateEllipsoid(field& f, vec3<uint32_t> pos, vec3<double> rot, vec
 void object::LoadVoxelMap(field& f, const char *path){
     uint8_t *p_mapped_ptr;
 
-    try {
+    RequireDense(f, "LoadVoxelMap()");
+
+    if (f.Native()) {
+        p_mapped_ptr = f.host_mat.data();
+    }
+    else try {
         p_mapped_ptr = static_cast<uint8_t*>(f.cl_queue.enqueueMapBuffer(f.buff_mat, CL_TRUE, CL_MAP_WRITE, 0, 
-                                            sizeof(uint8_t) * f.size.x * f.size.y * f.size.z));
+                                            sizeof(uint8_t) * f.StorageElements()));
     }
     catch (cl::Error& e) {
         std::string s;
@@ -151,12 +229,14 @@ void object::LoadVoxelMap(field& f, const char *path){
         throw std::runtime_error(s);
     }
 
+    bool marked = false; // voxel map may contain elements of transducers
     try {
         std::ifstream vox_file;
         vox_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 		vox_file.open(path, std::ios_base::binary);
         std::vector<uint8_t> slice;
 		slice.reserve((size_t)f.size.x * f.size.y);
+        vox_file.seekg((std::streamoff)f.z_offset * f.size.x * f.size.y); // slab of multi_field starts at plane z_offset
         for(uint32_t z = 0; z < f.size.z; z++) {
             // read one slice (x, y = var.; z = const)
 			vox_file.read((char*)slice.data(), (size_t)f.size.x * f.size.y);
@@ -169,16 +249,18 @@ void object::LoadVoxelMap(field& f, const char *path){
 					uint8_t material = slice[idx++];
 					if(material != 0)
 					{
+                        RequireMaterial(f, material, "LoadVoxelMap()");
+                        marked |= (material & 0x80) != 0;
 						// store non-zero voxel's to GPU
-                        p_mapped_ptr[z*f.size.x*f.size.y + y*f.size.x + x] = material;
+                        p_mapped_ptr[f.StorageIndex(x, y, z)] = material; // order of elements given by field.layout
 					}
 				}
 			}
         }
     }
     catch (std::exception& e) {
-        // f.cl_queue.enqueueUnmapMemObject(f.buff_mat, p_mapped_ptr);
-        // f.cl_queue.enqueueBarrierWithWaitList(); // for write operation
+        if (!f.Native()) // map isn't used anymore (e.g. rejected material)
+            f.cl_queue.enqueueUnmapMemObject(f.buff_mat, p_mapped_ptr);
         std::string s;
         s = "ERR: Can't load voxel map from file \"" + std::string(path) + "\" (fas::object::LoadVoxelMap()):\n";
         s += e.what();
@@ -186,6 +268,58 @@ void object::LoadVoxelMap(field& f, const char *path){
     }
 
     // unmap material buffer
-    f.cl_queue.enqueueUnmapMemObject(f.buff_mat, p_mapped_ptr);
-    f.cl_queue.enqueueBarrierWithWaitList(); // for write operation
+    if (!f.Native()) {
+        f.cl_queue.enqueueUnmapMemObject(f.buff_mat, p_mapped_ptr);
+        f.cl_queue.enqueueBarrierWithWaitList(); // for write operation
+    }
+    f.iface_dirty = true;
+    f.marked_elements |= marked;
+}
+
+void object::CreateRect(multi_field& mf, vec3<uint32_t> pos, vec3<double> rot, vec2<uint32_t> size, uint8_t material) {
+    for(auto& slab : mf.slabs) CreateRect(*slab, pos, rot, size, material); // each slab draws its part, see field::z_offset
+}
+
+void object::CreateEllipse(multi_field& mf, vec3<uint32_t> pos, vec3<double> rot, vec2<uint32_t> size, uint8_t material) {
+    for(auto& slab : mf.slabs) CreateEllipse(*slab, pos, rot, size, material);
+}
+
+void object::CreateBox(multi_field& mf, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material) {
+    for(auto& slab : mf.slabs) CreateBox(*slab, pos, rot, size, material);
+}
+
+void object::CreateCylinder(multi_field& mf, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material) {
+    for(auto& slab : mf.slabs) CreateCylinder(*slab, pos, rot, size, material);
+}
+
+void object::CreateEllipsoid(multi_field& mf, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material) {
+    for(auto& slab : mf.slabs) CreateEllipsoid(*slab, pos, rot, size, material);
+}
+
+void object::LoadVoxelMap(multi_field& mf, const char *path) {
+    for(auto& slab : mf.slabs) LoadVoxelMap(*slab, path);
+}
+
+void object::CreateRect(stream_field& sf, vec3<uint32_t> pos, vec3<double> rot, vec2<uint32_t> size, uint8_t material) {
+    sf.ForEachSlab([&](field& w) { CreateRect(w, pos, rot, size, material); }); // window of each slab draws its part, see field::z_offset
+}
+
+void object::CreateEllipse(stream_field& sf, vec3<uint32_t> pos, vec3<double> rot, vec2<uint32_t> size, uint8_t material) {
+    sf.ForEachSlab([&](field& w) { CreateEllipse(w, pos, rot, size, material); });
+}
+
+void object::CreateBox(stream_field& sf, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material) {
+    sf.ForEachSlab([&](field& w) { CreateBox(w, pos, rot, size, material); });
+}
+
+void object::CreateCylinder(stream_field& sf, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material) {
+    sf.ForEachSlab([&](field& w) { CreateCylinder(w, pos, rot, size, material); });
+}
+
+void object::CreateEllipsoid(stream_field& sf, vec3<uint32_t> pos, vec3<double> rot, vec3<uint32_t> size, uint8_t material) {
+    sf.ForEachSlab([&](field& w) { CreateEllipsoid(w, pos, rot, size, material); });
+}
+
+void object::LoadVoxelMap(stream_field& sf, const char *path) {
+    sf.ForEachSlab([&](field& w) { LoadVoxelMap(w, path); });
 }
@@ -0,0 +1,259 @@
+#include <algorithm>
+#include <cstring>
+#include "fas.hpp"
+
+using namespace fas;
+
+void stream_field::Prepare() {
+    if (d == nullptr)
+        throw std::runtime_error("ERR: No device defined (fas::stream_field::Prepare())");
+    if (boundary[4] == field::BOUNDARY_PERIODIC || boundary[5] == field::BOUNDARY_PERIODIC)
+        throw std::runtime_error("ERR: Periodic boundary along z isn't supported (fas::stream_field::Prepare())");
+    if (sim_kernel == field::SIM_SPLIT)
+        throw std::runtime_error("ERR: SIM_SPLIT kernel isn't supported, use SIM_NAIVE or SIM_TILED (fas::stream_field::Prepare())");
+    if (slab_planes < 3)
+        slab_planes = 3;
+    if (steps_per_pass < 1)
+        steps_per_pass = 1;
+
+    // slabs of (almost) equal thickness, halo of window must not reach behind neighbouring slab
+    size_t n = size.z / slab_planes;
+    n = n ? n : 1;
+    z_begin.resize(n + 1);
+    for (size_t i = 0; i <= n; i++)
+        z_begin[i] = (uint32_t)((uint64_t)size.z * i / n);
+    uint32_t min_own = size.z / (uint32_t)n;
+    uint32_t max_own = (size.z + (uint32_t)n - 1) / (uint32_t)n;
+    halo = n > 1 ? std::min<uint32_t>(steps_per_pass, min_own - 1) : steps_per_pass;
+    uint32_t planes = std::min<uint32_t>(size.z, max_own + 2 * halo + 1);
+
+    try {
+        host_p[0].assign(Elements(), 0.0f);
+        host_p[1].assign(Elements(), 0.0f);
+        host_mat.assign(Elements(), 0);
+    }
+    catch (std::bad_alloc& e) {
+        throw std::runtime_error("ERR: Can't allocate host memory of field (fas::stream_field::Prepare()):\n" + std::string(e.what()));
+    }
+    for (size_t i = 0; i < 2; i++) {
+        win[i].reset();
+        if (i >= n)
+            continue; // single slab stays in its window
+        std::unique_ptr<field> w(new field(*d, vec3<uint32_t>(size.x, size.y, planes), dx, dt));
+        w->materials = materials;
+        for (int f = 0; f < 6; f++)
+            w->boundary[f] = boundary[f];
+        w->sim_kernel = sim_kernel;
+        w->fast_math = fast_math;
+        w->Prepare();
+        win[i] = std::move(w);
+    }
+    try {
+        up_queue = std::move(cl::CommandQueue(d->cl_context, *(d->phy_dev), 0));
+        down_queue = std::move(cl::CommandQueue(d->cl_context, *(d->phy_dev), 0));
+    }
+    catch (cl::Error& e) {
+        throw std::runtime_error("ERR: Can't create command queue (fas::stream_field::Prepare()):\n" + std::string(e.what()));
+    }
+    down_done.assign(n, cl::Event());
+    win_free[0] = win_free[1] = cl::Event();
+    win_slab[0] = win_slab[1] = -1;
+    drivers.clear();
+    steps_calculated = 0;
+}
+
+void stream_field::Clear() {
+    Finish();
+    std::fill(host_p[0].begin(), host_p[0].end(), 0.0f);
+    std::fill(host_p[1].begin(), host_p[1].end(), 0.0f);
+    std::fill(host_mat.begin(), host_mat.end(), 0);
+    win_slab[0] = win_slab[1] = -1;
+    for (auto& wi : win) {
+        if (wi)
+            wi->marked_elements = false;
+    }
+    steps_calculated = 0;
+}
+
+void stream_field::Window(size_t k, uint32_t& w0, uint32_t& w1) {
+    w0 = z_begin[k] > halo ? z_begin[k] - halo : 0;
+    w1 = std::min<uint32_t>(size.z, z_begin[k + 1] + halo + 1); // plane size.z - 2 of window isn't calculated
+}
+
+void stream_field::SetWindow(field& w, uint32_t w0, uint32_t w1) {
+    // window is calculated as slab of multi_field: boundaries of field only on its own faces, see field::halo_lo
+    w.size.z = w1 - w0;
+    w.z_offset = w0;
+    w.halo_lo = w0 > 0;
+    w.boundary[4] = w0 > 0 ? field::BOUNDARY_DEFAULT : boundary[4];
+    w.boundary[5] = w1 < size.z ? field::BOUNDARY_DEFAULT : boundary[5];
+    w.ActivateAll();
+}
+
+void stream_field::ForEachSlab(const std::function<void(field&)>& fn) {
+    if (Slabs() == 0)
+        throw std::runtime_error("ERR: Field isn't prepared (fas::stream_field::ForEachSlab())");
+    Finish();
+    field& w = *win[0];
+    size_t plane = (size_t)size.x * size.y;
+    bool was_marked = w.marked_elements, marked = false; // state of all slabs is kept by windows, see field::marked_elements
+    for (size_t k = 0; k < Slabs(); k++) {
+        uint32_t z0 = z_begin[k], z1 = z_begin[k + 1];
+        SetWindow(w, z0, z1);
+        try {
+            w.cl_queue.enqueueWriteBuffer(w.buff_mat, CL_TRUE, 0, plane * (z1 - z0), host_mat.data() + plane * z0);
+            w.marked_elements = was_marked;
+            fn(w);
+            marked |= w.marked_elements;
+            w.cl_queue.enqueueReadBuffer(w.buff_mat, CL_TRUE, 0, plane * (z1 - z0), host_mat.data() + plane * z0);
+        }
+        catch (cl::Error& e) {
+            throw std::runtime_error("ERR: Can't transfer materials of slab (fas::stream_field::ForEachSlab()):\n" + std::string(e.what()));
+        }
+    }
+    win_slab[0] = win_slab[1] = -1; // materials of windows are outdated
+    for (auto& wi : win) {
+        if (wi)
+            wi->marked_elements = marked;
+    }
+}
+
+void stream_field::AddDriver(driver& drv, uint8_t my_idx) {
+    // collect elements of each slab in global coordinates
+    std::vector<uint32_t> gx, gy, gz;
+    ForEachSlab([&](field& w) {
+        transducer t(w);
+        t.CollectElements(my_idx, true); // driver may miss some slabs
+        if (t.num_elements == 0)
+            return;
+        std::vector<uint32_t> c = t.GetElementsCoords();
+        for (size_t i = 0; i < t.num_elements; i++) {
+            gx.push_back(c[i]);
+            gy.push_back(c[i + t.num_elements]);
+            gz.push_back(c[i + 2 * t.num_elements] + w.z_offset);
+        }
+    });
+    if (gx.empty())
+        throw std::runtime_error("fas::stream_field::AddDriver(): Driver has zero elements, please remove it.");
+    // each window drives all its elements including halos, same as whole field would do
+    stream_driver sd;
+    sd.drv = &drv;
+    for (size_t k = 0; k < Slabs(); k++) {
+        uint32_t w0, w1;
+        Window(k, w0, w1);
+        std::vector<uint32_t> lx, ly, lz;
+        for (size_t i = 0; i < gz.size(); i++) {
+            if (gz[i] >= w0 && gz[i] < w1) {
+                lx.push_back(gx[i]);
+                ly.push_back(gy[i]);
+                lz.push_back(gz[i] - w0);
+            }
+        }
+        std::vector<uint32_t> local(lx);
+        local.insert(local.end(), ly.begin(), ly.end());
+        local.insert(local.end(), lz.begin(), lz.end());
+        sd.parts.emplace_back();
+        sd.parts.back().transducer::SetElements(*win[k % 2], local);
+    }
+    drivers.push_back(std::move(sd));
+}
+
+void stream_field::Download(size_t k, const std::vector<cl::Event>& wait) {
+    field& w = *win[k % 2];
+    uint32_t w0, w1;
+    Window(k, w0, w1);
+    size_t plane = (size_t)size.x * size.y;
+    size_t own = plane * (z_begin[k + 1] - z_begin[k]);
+    size_t src = plane * (z_begin[k] - w0);
+    // window still holds state of slab k, it isn't reused before this download
+    down_queue.enqueueReadBuffer(w.p_buff ? w.buff_B : w.buff_A, CL_FALSE, sizeof(data_t) * src, sizeof(data_t) * own,
+                                 host_p[0].data() + plane * z_begin[k], &wait);
+    down_queue.enqueueReadBuffer(w.p_buff ? w.buff_A : w.buff_B, CL_FALSE, sizeof(data_t) * src, sizeof(data_t) * own,
+                                 host_p[1].data() + plane * z_begin[k]);
+    down_queue.enqueueMarkerWithWaitList(NULL, &down_done[k]);
+    down_queue.flush();
+    win_free[k % 2] = down_done[k];
+}
+
+void stream_field::Pass(uint32_t steps) {
+    size_t n = Slabs();
+    size_t plane = (size_t)size.x * size.y;
+    steps = std::min(steps, halo);
+    std::vector<cl::Event> up_done(n), calc_done(n);
+    try {
+        for (size_t k = 0; k < n; k++) {
+            int wi = (int)(k % 2);
+            field& w = *win[wi];
+            uint32_t w0, w1;
+            Window(k, w0, w1);
+            SetWindow(w, w0, w1);
+            // window is free and host planes of window are final (downloads of previous pass)
+            std::vector<cl::Event> wait;
+            if (win_free[wi]() != nullptr)
+                wait.push_back(win_free[wi]);
+            for (size_t j = k > 0 ? k - 1 : 0; j < n && z_begin[j] < w1; j++) {
+                if (down_done[j]() != nullptr)
+                    wait.push_back(down_done[j]);
+            }
+            w.p_buff = 0;
+            up_queue.enqueueWriteBuffer(w.buff_A, CL_FALSE, 0, sizeof(data_t) * plane * (w1 - w0), host_p[0].data() + plane * w0, &wait);
+            up_queue.enqueueWriteBuffer(w.buff_B, CL_FALSE, 0, sizeof(data_t) * plane * (w1 - w0), host_p[1].data() + plane * w0);
+            if (win_slab[wi] != (int)k) {
+                up_queue.enqueueWriteBuffer(w.buff_mat, CL_FALSE, 0, plane * (w1 - w0), host_mat.data() + plane * w0);
+                win_slab[wi] = (int)k;
+            }
+            up_queue.enqueueMarkerWithWaitList(NULL, &up_done[k]);
+            up_queue.flush();
+
+            std::vector<cl::Event> uploaded = { up_done[k] };
+            w.cl_queue.enqueueBarrierWithWaitList(&uploaded);
+            for (uint32_t s = 0; s < steps; s++) {
+                for (auto& sd : drivers) {
+                    if (sd.parts[k].num_elements)
+                        sd.parts[k].DriveValue(sd.drv->Sample((data_t)((steps_calculated + s) * dt)));
+                }
+                w.SimStep();
+            }
+            w.cl_queue.enqueueMarkerWithWaitList(NULL, &calc_done[k]);
+            w.cl_queue.flush();
+
+            // own planes of previous slab are lower halo of this one, they are overwritten after upload
+            if (k > 0)
+                Download(k - 1, { calc_done[k - 1], up_done[k] });
+        }
+        Download(n - 1, { calc_done[n - 1] });
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't stream slabs of field (fas::stream_field::Pass()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+    steps_calculated += steps;
+}
+
+void stream_field::Run(size_t n_steps) {
+    if (Slabs() == 0)
+        throw std::runtime_error("ERR: Field isn't prepared (fas::stream_field::Run())");
+    while (n_steps) {
+        uint32_t steps = (uint32_t)std::min<size_t>(halo, n_steps);
+        Pass(steps);
+        n_steps -= steps;
+    }
+}
+
+data_t * stream_field::Map_p_t_read() {
+    Finish();
+    return host_p[0].data();
+}
+
+void stream_field::Finish() {
+    for (auto& w : win) {
+        if (w)
+            w->Finish();
+    }
+    if (up_queue() != nullptr)
+        up_queue.finish();
+    if (down_queue() != nullptr)
+        down_queue.finish();
+}
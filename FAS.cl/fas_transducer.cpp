@@ -1,131 +1,412 @@
+#include <algorithm>
 #include "fas.hpp"
 #include "fas_math.hpp"
 
 using namespace fas;
 
-void transducer::CollectElements(uint8_t my_idx) {
-    
-    // TODO: try-catch, check algorithm & comment well
-
-    cl::Buffer buff_count(f->d->cl_context, CL_MEM_READ_WRITE, sizeof(uint32_t) * f->size.y * f->size.z);
-    cl::Buffer buff_psum(f->d->cl_context, CL_MEM_READ_WRITE, sizeof(uint64_t) * f->size.y * f->size.z);
-    cl::Buffer buff_tmp_last_col( f->d->cl_context, CL_MEM_READ_WRITE, sizeof(uint64_t) * f->size.z );
-
-    // count number of transducer's elements (with MSB set) in each line along the x-axis
-    f->d->tdcr_count_elements_kernel.setArg(0, f->buff_mat);
-    f->d->tdcr_count_elements_kernel.setArg(1, buff_count);
-    f->d->tdcr_count_elements_kernel.setArg(2, f->size.x);
-    f->d->tdcr_count_elements_kernel.setArg(3, my_idx);
-    f->cl_queue.enqueueNDRangeKernel(f->d->tdcr_count_elements_kernel, { 0,0 }, { f->size.y, f->size.z });
-    f->cl_queue.enqueueBarrierWithWaitList();
-
-    // for kernel debug only
-//    uint32_t* count_arr = static_cast<uint32_t*>(f->cl_queue.enqueueMapBuffer(buff_count, CL_TRUE, CL_MAP_READ, 0, sizeof(uint32_t) * f->size.y * f->size.z));
-//    f->cl_queue.enqueueUnmapMemObject(buff_count, count_arr);
-//    f->cl_queue.enqueueBarrierWithWaitList();
-
-    // calc prefix sum of 2D (count array)
-    f->d->horizontal_prefix_sum_uint_ulong_kernel.setArg(0, buff_count);
-    f->d->horizontal_prefix_sum_uint_ulong_kernel.setArg(1, buff_psum);
-    f->d->horizontal_prefix_sum_uint_ulong_kernel.setArg(2, buff_tmp_last_col);
-    f->d->horizontal_prefix_sum_uint_ulong_kernel.setArg(3, f->size.y);
-    f->cl_queue.enqueueNDRangeKernel(f->d->horizontal_prefix_sum_uint_ulong_kernel, 0, f->size.z);
-    f->cl_queue.enqueueBarrierWithWaitList();
-
-    // for kernel debug only
-//    uint64_t* psum_arr = static_cast<uint64_t*>(f->cl_queue.enqueueMapBuffer(buff_psum, CL_TRUE, CL_MAP_READ, 0, sizeof(uint64_t) * f->size.y * f->size.z));
-    // not for debug, must be leaved as is ->>
-    // wait here to finish previous kernel and then map memory (enqueueBarrier & blocking = true)
-    uint64_t* tmp_last_col_arr = static_cast<uint64_t*>(f->cl_queue.enqueueMapBuffer(buff_tmp_last_col, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, sizeof(uint64_t) * f->size.z));
-    for (uint32_t i = 1; i < f->size.z; i++) {
-        tmp_last_col_arr[i] += tmp_last_col_arr[i - 1];
-    }
-    f->cl_queue.enqueueUnmapMemObject(buff_tmp_last_col, tmp_last_col_arr);
-    // <<-
-//    f->cl_queue.enqueueUnmapMemObject(buff_psum, psum_arr);
-    f->cl_queue.enqueueBarrierWithWaitList();
-
-    f->d->vertical_prexix_sum_ulong_kernel.setArg(0, buff_psum);
-    f->d->vertical_prexix_sum_ulong_kernel.setArg(1, buff_tmp_last_col);
-    f->d->vertical_prexix_sum_ulong_kernel.setArg(2, f->size.z);
-    f->cl_queue.enqueueNDRangeKernel(f->d->vertical_prexix_sum_ulong_kernel, 0, f->size.y);
-    f->cl_queue.enqueueBarrierWithWaitList();
-
-    // for kernel debug only
-//    psum_arr = static_cast<uint64_t*>(f->cl_queue.enqueueMapBuffer(buff_psum, CL_TRUE, CL_MAP_READ, 0, sizeof(uint64_t) * f->size.y * f->size.z));
-//    f->cl_queue.enqueueUnmapMemObject(buff_psum, psum_arr);
-//    f->cl_queue.enqueueBarrierWithWaitList();
-
-    // collect element's coordinates into buff_elements array
-    // read total number of elements = buff_tmp_last_col[last]
-    tmp_last_col_arr = static_cast<uint64_t*>(f->cl_queue.enqueueMapBuffer(buff_tmp_last_col, CL_TRUE, CL_MAP_READ, 0, sizeof(uint64_t) * f->size.z));
-    num_elements = tmp_last_col_arr[f->size.z - 1]; // TODO: map only last element
-    f->cl_queue.enqueueUnmapMemObject(buff_tmp_last_col, tmp_last_col_arr);
-    f->cl_queue.enqueueBarrierWithWaitList();
-    // allocate memory on device
-    if(num_elements == 0) {
-        throw std::runtime_error("fas::driver::CollectElements(): Driver has zero elements, please remove it.");
-    }
-    buff_elements = std::move(cl::Buffer( f->d->cl_context, CL_MEM_READ_WRITE, sizeof(uint32_t) * 3 * num_elements ));
-    f->d->tdcr_collect_elements_kernel.setArg(0, f->buff_mat);
-    f->d->tdcr_collect_elements_kernel.setArg(1, buff_psum);
-    f->d->tdcr_collect_elements_kernel.setArg(2, buff_elements);
-    f->d->tdcr_collect_elements_kernel.setArg(3, f->size.x);
-    f->d->tdcr_collect_elements_kernel.setArg(4, static_cast<uint64_t>(num_elements));
-    f->d->tdcr_collect_elements_kernel.setArg(5, my_idx);
-    f->cl_queue.enqueueNDRangeKernel(f->d->tdcr_collect_elements_kernel, { 0,0 }, { f->size.y,f->size.z });
-    f->cl_queue.enqueueBarrierWithWaitList();
-    // now all element's coordinates are stored in buff_elements
-    // clear all MSBs of field.material
-    f->d->tdcr_clear_mat_MSBs_kernel.setArg(0, f->buff_mat);
-    f->cl_queue.enqueueNDRangeKernel(f->d->tdcr_clear_mat_MSBs_kernel, { 0,0,0 }, { f->size.x,f->size.y,f->size.z });
-    f->cl_queue.finish();
+// bounding box of elements given by index
+static void ElementsBox(field& f, const std::vector<uint64_t>& idx, vec3<uint32_t>& lo, vec3<uint32_t>& hi) {
+    lo = { 1,0,0 }; // empty
+    hi = { 0,0,0 };
+    if (idx.empty())
+        return;
+    lo = f.StorageCoords(idx[0]);
+    hi = lo;
+    for (size_t i = 1; i < idx.size(); i++) {
+        vec3<uint32_t> c = f.StorageCoords(idx[i]);
+        lo = { std::min(lo.x, c.x), std::min(lo.y, c.y), std::min(lo.z, c.z) };
+        hi = { std::max(hi.x, c.x), std::max(hi.y, c.y), std::max(hi.z, c.z) };
+    }
 }
 
-std::vector<uint32_t> transducer::GetElementsCoords() {
-    std::vector<uint32_t> rv;
-    rv.resize(num_elements * 3);
-    void* hptr;
+// device buffer of indices of elements, type is element_t of OpenCL source (uint32, or uint64 if field::WideElements())
+static cl::Buffer IndexBuffer(field& f, const std::vector<uint64_t>& idx) {
+    if (f.WideElements())
+        return cl::Buffer(f.d->cl_context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(uint64_t) * idx.size(), (void*)idx.data());
+    std::vector<uint32_t> narrow(idx.begin(), idx.end());
+    return cl::Buffer(f.d->cl_context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(uint32_t) * narrow.size(), narrow.data());
+}
+
+void transducer::CollectElements(uint8_t my_idx, bool allow_empty) {
+    CollectElements(*f, { this }, { my_idx }, allow_empty);
+}
+
+void transducer::CollectElements(field& f, const std::vector<transducer*>& tdcrs, const std::vector<uint8_t>& my_idx, bool allow_empty) {
+    size_t n_slots = tdcrs.size();
+    if (my_idx.size() != n_slots || n_slots == 0 || n_slots > 255)
+        throw std::runtime_error("ERR: One to 255 transducers with one material number each expected (fas::transducer::CollectElements())");
+    // slot (index of transducer) of each material number
+    std::vector<uint8_t> slot_of(256, 0xFF);
+    for (size_t i = 0; i < n_slots; i++) {
+        if (slot_of[my_idx[i]] != 0xFF)
+            throw std::runtime_error("ERR: Material number of transducers must be unique (fas::transducer::CollectElements())");
+        slot_of[my_idx[i]] = (uint8_t)i;
+        tdcrs[i]->f = &f;
+    }
+
+    if (f.Native()) {
+        std::vector<std::vector<uint64_t>> idx = native::CollectElements(f, my_idx);
+        for (size_t i = 0; i < n_slots; i++)
+            tdcrs[i]->SetIndices(f, idx[i]);
+    }
+    else {
+        if (f.sparse)
+            throw std::runtime_error("ERR: Elements must be collected before field::Sparsify() (fas::transducer::CollectElements())");
+        f.prg->Require(program::GROUP_INDEXING); // compiled on first use
+        // buffers of field are split into chunks (multiple of work-group size), one chunk per work-group
+        uint64_t n = f.StorageElements();
+        size_t esize = f.ElementIndexSize();
+        uint64_t groups = std::min<uint64_t>((n + FAS_COMPACT_WG - 1) / FAS_COMPACT_WG, FAS_COMPACT_GROUPS);
+        uint64_t chunk = (n + groups - 1) / groups;
+        chunk = (chunk + FAS_COMPACT_WG - 1) / FAS_COMPACT_WG * FAS_COMPACT_WG;
+        groups = (n + chunk - 1) / chunk;
+        std::vector<uint64_t> totals(n_slots), base(n_slots);
+        try {
+            cl::Buffer buff_slot_of(f.d->cl_context, CL_MEM_READ_ONLY, 256);
+            cl::Buffer buff_offsets(f.d->cl_context, CL_MEM_READ_WRITE, sizeof(uint64_t) * n_slots * groups);
+            cl::Buffer buff_totals(f.d->cl_context, CL_MEM_READ_WRITE, sizeof(uint64_t) * n_slots);
+            cl::Buffer buff_base(f.d->cl_context, CL_MEM_READ_ONLY, sizeof(uint64_t) * n_slots);
+            f.cl_queue.enqueueWriteBuffer(buff_slot_of, CL_FALSE, 0, 256, slot_of.data());
+
+            // count elements of each transducer in each chunk
+            cl::Kernel& count = f.prg->tdcr_count_chunks_kernel;
+            count.setArg(0, f.buff_mat);
+            count.setArg(1, buff_slot_of);
+            count.setArg(2, buff_offsets);
+            count.setArg(3, f.size.x);
+            count.setArg(4, f.size.y);
+            count.setArg(5, f.size.z);
+            count.setArg(6, n);
+            count.setArg(7, chunk);
+            count.setArg(8, (uint32_t)n_slots);
+            f.cl_queue.enqueueNDRangeKernel(count, 0, groups * FAS_COMPACT_WG, FAS_COMPACT_WG);
+
+            // offsets of chunks = exclusive prefix sum of counts, one work-group per transducer
+            cl::Kernel& scan = f.prg->tdcr_scan_counts_kernel;
+            scan.setArg(0, buff_offsets);
+            scan.setArg(1, buff_totals);
+            scan.setArg(2, (uint32_t)groups);
+            f.cl_queue.enqueueNDRangeKernel(scan, 0, n_slots * FAS_COMPACT_WG, FAS_COMPACT_WG);
+
+            // only sizes of element buffers are needed by host
+            f.cl_queue.enqueueReadBuffer(buff_totals, CL_TRUE, 0, sizeof(uint64_t) * n_slots, totals.data());
+            uint64_t all = 0;
+            for (size_t i = 0; i < n_slots; i++) {
+                base[i] = all;
+                all += totals[i];
+            }
+            // single transducer gets its elements directly, else elements of all are stored one after another and copied
+            cl::Buffer buff_all(f.d->cl_context, CL_MEM_READ_WRITE, esize * std::max<uint64_t>(all, 1));
+            f.cl_queue.enqueueWriteBuffer(buff_base, CL_FALSE, 0, sizeof(uint64_t) * n_slots, base.data());
+            cl::Kernel& compact = f.prg->tdcr_compact_kernel;
+            compact.setArg(0, f.buff_mat);
+            compact.setArg(1, buff_slot_of);
+            compact.setArg(2, buff_offsets);
+            compact.setArg(3, buff_base);
+            compact.setArg(4, buff_all);
+            compact.setArg(5, f.size.x);
+            compact.setArg(6, f.size.y);
+            compact.setArg(7, f.size.z);
+            compact.setArg(8, n);
+            compact.setArg(9, chunk);
+            compact.setArg(10, (uint32_t)n_slots);
+            f.cl_queue.enqueueNDRangeKernel(compact, 0, groups * FAS_COMPACT_WG, FAS_COMPACT_WG);
+
+            for (size_t i = 0; i < n_slots; i++) {
+                transducer& t = *tdcrs[i];
+                t.num_elements = totals[i];
+                if (totals[i] == 0) {
+                    t.buff_elements = cl::Buffer();
+                }
+                else if (n_slots == 1) {
+                    t.buff_elements = buff_all;
+                }
+                else {
+                    t.buff_elements = std::move(cl::Buffer(f.d->cl_context, CL_MEM_READ_WRITE, esize * totals[i]));
+                    f.cl_queue.enqueueCopyBuffer(buff_all, t.buff_elements, esize * base[i], 0, esize * totals[i]);
+                }
+            }
+            f.cl_queue.finish();
+        }
+        catch (cl::Error& e) {
+            throw std::runtime_error("ERR: Can't collect elements of transducers (fas::transducer::CollectElements()):\n" + std::string(e.what()));
+        }
+        f.iface_dirty = true;
+        f.marked_elements = false; // MSBs of all materials cleared
+        // seeds active box of field when driven, see field::Activate()
+        for (auto t : tdcrs)
+            ElementsBox(f, t->GetIndices(), t->bbox_lo, t->bbox_hi);
+    }
+    for (auto t : tdcrs) {
+        if (t->num_elements == 0 && !allow_empty)
+            throw std::runtime_error("fas::driver::CollectElements(): Driver has zero elements, please remove it.");
+    }
+}
+
+std::vector<uint64_t> transducer::GetIndices() {
+    if (f->Native())
+        return host_elements;
+    std::vector<uint64_t> rv(num_elements);
+    if (num_elements == 0)
+        return rv;
     try {
-        hptr = f->cl_queue.enqueueMapBuffer(buff_elements, CL_TRUE, CL_MAP_READ, 0, sizeof(uint32_t) * 3 * num_elements);
-        memcpy(rv.data(), hptr, sizeof(uint32_t) * 3 * num_elements);
-        f->cl_queue.enqueueUnmapMemObject(buff_elements, hptr);
-        f->cl_queue.enqueueBarrierWithWaitList();
+        if (f->WideElements()) {
+            f->cl_queue.enqueueReadBuffer(buff_elements, CL_TRUE, 0, sizeof(uint64_t) * num_elements, rv.data());
+        }
+        else {
+            std::vector<uint32_t> narrow(num_elements);
+            f->cl_queue.enqueueReadBuffer(buff_elements, CL_TRUE, 0, sizeof(uint32_t) * num_elements, narrow.data());
+            rv.assign(narrow.begin(), narrow.end());
+        }
     }
     catch (cl::Error& e) {
-        std::string s;
-        s = "ERR: Can't map device buffer. (fas::transducer::GetElementsCoords()):\n";
-        s += e.what();
-        throw std::runtime_error(s);
+        throw std::runtime_error("ERR: Can't read device buffer (fas::transducer::GetIndices()):\n" + std::string(e.what()));
     }
+    return rv;
+}
 
-    return std::move(rv);
+void transducer::SetIndices(field& _f, const std::vector<uint64_t>& idx) {
+    f = &_f;
+    num_elements = idx.size();
+    ElementsBox(*f, idx, bbox_lo, bbox_hi);
+    if (f->Native()) {
+        host_elements = idx;
+        return;
+    }
+    if (num_elements == 0) {
+        buff_elements = cl::Buffer();
+        return;
+    }
+    try {
+        buff_elements = IndexBuffer(*f, idx);
+    }
+    catch (cl::Error& e) {
+        throw std::runtime_error("ERR: Can't allocate memory on device (fas::transducer::SetIndices()):\n" + std::string(e.what()));
+    }
 }
 
-void driver::Drive(data_t time) {
+std::vector<uint32_t> transducer::GetElementsCoords() {
+    std::vector<uint64_t> idx = GetIndices();
+    std::vector<uint32_t> rv(num_elements * 3);
+    for (size_t i = 0; i < num_elements; i++) {
+        vec3<uint32_t> c = f->StorageCoords(idx[i]);
+        rv[i] = c.x;
+        rv[i + num_elements] = c.y;
+        rv[i + 2 * num_elements] = c.z;
+    }
+    return rv;
+}
+
+void transducer::SetElements(field& _f, const std::vector<uint32_t>& coords) {
+    size_t n = coords.size() / 3;
+    std::vector<uint64_t> idx(n);
+    for (size_t i = 0; i < n; i++)
+        idx[i] = _f.StorageIndex(coords[i], coords[i + n], coords[i + 2 * n]);
+    std::sort(idx.begin(), idx.end()); // coalesced access
+    SetIndices(_f, idx);
+}
+
+void driver::CollectElements(uint8_t my_idx) {
+    CollectElements({ this }, { my_idx });
+}
+
+void driver::CollectElements(const std::vector<driver*>& drvs, const std::vector<uint8_t>& my_idx) {
+    if(drvs.empty())
+        return;
+    multi_field* m = drvs[0]->mf;
+    for(auto drv : drvs) {
+        if(drv->mf != m || (m == nullptr && drv->f != drvs[0]->f))
+            throw std::runtime_error("ERR: Drivers must be in the same field (fas::driver::CollectElements())");
+    }
+    if(m == nullptr) {
+        transducer::CollectElements(*drvs[0]->f, std::vector<transducer*>(drvs.begin(), drvs.end()), my_idx);
+        return;
+    }
+    for(auto drv : drvs) {
+        drv->parts.clear();
+        drv->parts.reserve(m->slabs.size());
+        drv->num_elements = 0;
+    }
+    for(auto& slab : m->slabs) {
+        std::vector<transducer*> t;
+        for(auto drv : drvs) {
+            drv->parts.emplace_back(*slab);
+            t.push_back(&drv->parts.back());
+        }
+        transducer::CollectElements(*slab, t, my_idx, true); // driver may miss some slabs
+        for(auto drv : drvs)
+            drv->num_elements += drv->parts.back().num_elements;
+    }
+    for(auto drv : drvs) {
+        if(drv->num_elements == 0) {
+            throw std::runtime_error("fas::driver::CollectElements(): Driver has zero elements, please remove it.");
+        }
+    }
+}
+
+std::vector<uint32_t> driver::GetElementsCoords() {
+    if(mf == nullptr) {
+        return transducer::GetElementsCoords();
+    }
+    std::vector<uint32_t> rv(num_elements * 3);
+    size_t n = 0;
+    for(auto& part : parts) {
+        if(part.num_elements == 0) continue;
+        std::vector<uint32_t> c = part.transducer::GetElementsCoords();
+        for(size_t i = 0; i < part.num_elements; i++) {
+            rv[n + i] = c[i];
+            rv[n + i + num_elements] = c[i + part.num_elements];
+            rv[n + i + 2 * num_elements] = c[i + 2 * part.num_elements] + part.f->z_offset;
+        }
+        n += part.num_elements;
+    }
+    return rv;
+}
+
+// time [samples] of signal sampled by fs, split into integer and fractional part
+static void SignalTime(data_t time, data_t fs, uint32_t& t_int, data_t& t_frac) {
+    // product in single precision, as signal[time * fs] was picked before interpolation existed
+    data_t t = time * fs;
+    data_t i = std::floor(t);
+    t_int = (uint32_t)i;
+    t_frac = t - i;
+}
+
+// sin(2 * pi * cycles), same as sin_cycles() of OpenCL source
+static data_t SinCycles(data_t cycles) {
+    return std::sin(2.0f * (data_t)M_PI * (cycles - std::floor(cycles)));
+}
+
+// same as generator_value() of OpenCL source
+static data_t GeneratorValue(const driver::generator& g, data_t t) {
+    switch (g.type) {
+    case driver::generator::CW:
+        return t < 0.0f ? 0.0f : g.amplitude * SinCycles(g.freq * t);
+    case driver::generator::TONE_BURST:
+        if (t < 0.0f || t >= g.duration)
+            return 0.0f;
+        return g.amplitude * 0.5f * (1.0f - std::cos(2.0f * (data_t)M_PI * t / g.duration)) * SinCycles(g.freq * t);
+    case driver::generator::CHIRP:
+        if (t < 0.0f || t >= g.duration)
+            return 0.0f;
+        return g.amplitude * SinCycles(g.freq * t + 0.5f * (g.freq_end - g.freq) * t * t / g.duration);
+    case driver::generator::GAUSSIAN: {
+        data_t u = (t - g.centre) / g.width;
+        data_t env = g.amplitude * std::exp(-0.5f * u * u);
+        return g.freq == 0.0f ? env : env * SinCycles(g.freq * (t - g.centre));
+    }
+    default:
+        return 0.0f;
+    }
+}
+
+data_t driver::Sample(data_t time) {
+    if (gen.type != generator::SAMPLES)
+        return GeneratorValue(gen, time);
+    uint32_t t_int;
+    data_t t_frac;
+    SignalTime(time, sig_samp_freq, t_int, t_frac);
+    // same as signal_value() of OpenCL source, 0 outside of signal
+    auto at = [&](int64_t i) { return i >= 0 && i < (int64_t)signal.size() ? signal[i] : 0.0f; };
+    if (interp == INTERP_LINEAR)
+        return at(t_int) + t_frac * (at((int64_t)t_int + 1) - at(t_int));
+    if (interp == INTERP_SINC && t_frac != 0.0f) {
+        data_t sum = 0.0f;
+        for (int k = 1 - FAS_SINC_TAPS; k <= FAS_SINC_TAPS; k++) {
+            data_t d = t_frac - (data_t)k;
+            data_t w = 0.5f * (1.0f + std::cos((data_t)M_PI * d / FAS_SINC_TAPS));
+            sum += at((int64_t)t_int + k) * w * std::sin((data_t)M_PI * d) / ((data_t)M_PI * d);
+        }
+        return sum;
+    }
+    return at(t_int);
+}
+
+void driver::UploadSignal() {
+    if ((gen.type == generator::TONE_BURST || gen.type == generator::CHIRP) && gen.duration <= 0.0f)
+        throw std::runtime_error("ERR: Duration of generator must be positive (fas::driver::UploadSignal())");
+    if (gen.type == generator::GAUSSIAN && gen.width <= 0.0f)
+        throw std::runtime_error("ERR: Width of Gaussian pulse must be positive (fas::driver::UploadSignal())");
+    if (f->Native())
+        return; // signal is sampled by host
+    data_t g[6] = { gen.amplitude, gen.freq, gen.freq_end, gen.duration, gen.centre, gen.width };
     try {
+        buff_gen = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(g), g));
+        if (signal.empty()) {
+            buff_signal = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_ONLY, sizeof(data_t))); // buffer can't be empty
+        }
+        else {
+            buff_signal = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(data_t) * signal.size(), signal.data()));
+        }
+    }
+    catch (cl::Error& e) {
+        throw std::runtime_error("ERR: Can't allocate memory on device (fas::driver::UploadSignal()):\n" + std::string(e.what()));
+    }
+}
+
+void driver::Drive(data_t time) {
+    if(mf != nullptr) {
         // calculate immediate value of drive-signal
-        data_t sample;
-        size_t sample_nr = time * sig_samp_freq;
-        if(sample_nr >= signal.size()) {
-            sample = 0; // no driving signal
-        } else {
-            sample = signal[sample_nr];
-        }
-        // drive
+        data_t sample = Sample(time);
+        for(auto& part : parts) {
+            if(part.num_elements) part.DriveValue(sample);
+        }
+        return;
+    }
+    if(f->Native()) {
+        DriveValue(Sample(time));
+        return;
+    }
+    // signal is evaluated on device
+    f->Activate(bbox_lo, bbox_hi);
+    if(buff_gen() == nullptr)
+        UploadSignal();
+    uint32_t t_int;
+    data_t t_frac;
+    SignalTime(time, sig_samp_freq, t_int, t_frac);
+    try {
+        cl::Kernel& k = f->prg->drive_signal_kernel;
+        k.setArg(0, f->p_buff ? f->buff_B : f->buff_A);
+        k.setArg(1, buff_elements);
+        k.setArg(2, buff_signal);
+        k.setArg(3, (uint32_t)signal.size());
+        k.setArg(4, buff_gen);
+        k.setArg(5, (uint32_t)gen.type);
+        k.setArg(6, (uint32_t)interp);
+        k.setArg(7, time);
+        k.setArg(8, t_int);
+        k.setArg(9, t_frac);
+        k.setArg(10, f->size.x);
+        k.setArg(11, f->size.y);
+        f->BricksArg(k, 12);
+        f->cl_queue.enqueueNDRangeKernel(k, 0, num_elements);
+    }
+    catch (cl::Error& e) {
+        throw std::runtime_error("ERR: Can't drive acoustic pressure (fas::driver::Drive()):\n" + std::string(e.what()));
+    }
+}
+
+void driver::DriveValue(data_t sample) {
+    f->Activate(bbox_lo, bbox_hi);
+    if (f->Native()) {
+        native::Drive(*f, host_elements, sample);
+        return;
+    }
+    try {
         if (f->p_buff == 0) {
-            f->d->drive_kernel.setArg(0, f->buff_A);
+            f->prg->drive_kernel.setArg(0, f->buff_A);
         }
         else {
-            f->d->drive_kernel.setArg(0, f->buff_B);
+            f->prg->drive_kernel.setArg(0, f->buff_B);
         }
-        f->d->drive_kernel.setArg(1, sample);
-        f->d->drive_kernel.setArg(2, buff_elements);
-        f->d->drive_kernel.setArg(3, f->size.x);
-        f->d->drive_kernel.setArg(4, f->size.y);
+        f->prg->drive_kernel.setArg(1, sample);
+        f->prg->drive_kernel.setArg(2, buff_elements);
+        f->prg->drive_kernel.setArg(3, f->size.x);
+        f->prg->drive_kernel.setArg(4, f->size.y);
+        f->BricksArg(f->prg->drive_kernel, 5);
 
         cl::Event evt;
-        f->cl_queue.enqueueNDRangeKernel(f->d->drive_kernel, 0, num_elements, cl::NullRange, NULL, &evt);
+        f->cl_queue.enqueueNDRangeKernel(f->prg->drive_kernel, 0, num_elements, cl::NullRange, NULL, &evt);
         //f->cl_queue.finish(); // wait for device
         /*evt.wait();
         static int64_t duration_ns = 0;
@@ -133,53 +414,238 @@ void driver::Drive(data_t time) {
     }
     catch (cl::Error& e) {
         std::string s;
-        s = "ERR: Can't drive acoustic pressure - set field.buff_A/B (fas::driver::Drive()):\n";
+        s = "ERR: Can't drive acoustic pressure - set field.buff_A/B (fas::driver::DriveValue()):\n";
         s += e.what();
         throw std::runtime_error(s);
     }
 }
 
-void scanner::Prepare(field &_f, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size, std::string out_file_name, uint32_t _store_every_nth_frame)
+void driver_array::CollectElements(const std::vector<uint8_t>& my_idx) {
+    size_t n_ch = my_idx.size();
+    std::vector<transducer> ch(n_ch, transducer(*f));
+    std::vector<transducer*> ptr;
+    for (auto& t : ch)
+        ptr.push_back(&t);
+    transducer::CollectElements(*f, ptr, my_idx);
+
+    // elements of all channels sorted by address, channel of each element is kept
+    std::vector<std::pair<uint64_t, uint32_t>> elements;
+    centre.assign(n_ch, vec3<data_t>(0.0f, 0.0f, 0.0f));
+    for (size_t i = 0; i < n_ch; i++) {
+        for (auto idx : ch[i].GetIndices()) {
+            vec3<uint32_t> c = f->StorageCoords(idx);
+            centre[i].x += c.x;
+            centre[i].y += c.y;
+            centre[i].z += c.z;
+            elements.push_back({ idx, (uint32_t)i });
+        }
+        centre[i] = centre[i] * (1.0f / ch[i].num_elements);
+    }
+    std::sort(elements.begin(), elements.end());
+    std::vector<uint64_t> idx(elements.size());
+    host_channel.resize(elements.size());
+    for (size_t e = 0; e < elements.size(); e++) {
+        idx[e] = elements[e].first;
+        host_channel[e] = elements[e].second;
+    }
+    if (delay.size() != n_ch)
+        delay.assign(n_ch, 0.0f);
+    if (gain.size() != n_ch)
+        gain.assign(n_ch, 1.0f);
+    if (signal_idx.size() != n_ch)
+        signal_idx.assign(n_ch, 0);
+    SetIndices(*f, idx);
+    if (f->Native())
+        return;
+    try {
+        buff_channel = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_ONLY, sizeof(uint32_t) * num_elements));
+        f->cl_queue.enqueueWriteBuffer(buff_channel, CL_TRUE, 0, sizeof(uint32_t) * num_elements, host_channel.data());
+    }
+    catch (cl::Error& e) {
+        throw std::runtime_error("ERR: Can't allocate memory on device (fas::driver_array::CollectElements()):\n" + std::string(e.what()));
+    }
+    buff_delay = cl::Buffer(); // parameters of channels will be uploaded by Drive()
+}
+
+void driver_array::Focus(vec3<data_t> point, data_t c) {
+    std::vector<data_t> dist(Channels());
+    data_t max_dist = 0;
+    for (size_t i = 0; i < Channels(); i++) {
+        data_t dx = point.x - centre[i].x, dy = point.y - centre[i].y, dz = point.z - centre[i].z;
+        dist[i] = std::sqrt(dx * dx + dy * dy + dz * dz) * f->dx;
+        max_dist = std::max(max_dist, dist[i]);
+    }
+    delay.resize(Channels());
+    for (size_t i = 0; i < Channels(); i++)
+        delay[i] = (max_dist - dist[i]) / c; // farthest channel starts first
+}
+
+void driver_array::Update() {
+    if (delay.size() != Channels() || gain.size() != Channels() || signal_idx.size() != Channels())
+        throw std::runtime_error("ERR: Delay, gain and signal index of each channel expected (fas::driver_array::Update())");
+    for (auto s : signal_idx) {
+        if (s >= signals.size())
+            throw std::runtime_error("ERR: Signal index out of range (fas::driver_array::Update())");
+    }
+    if (f->Native())
+        return; // host vectors are used directly
+    std::vector<data_t> all, delay_samples(Channels());
+    std::vector<uint32_t> range;
+    for (auto& s : signals) {
+        range.push_back((uint32_t)all.size());
+        range.push_back((uint32_t)s.size());
+        all.insert(all.end(), s.begin(), s.end());
+    }
+    if (all.empty())
+        all.push_back(0.0f); // buffer can't be empty
+    for (size_t i = 0; i < Channels(); i++)
+        delay_samples[i] = delay[i] * sig_samp_freq;
+    try {
+        buff_signals = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(data_t) * all.size(), all.data()));
+        buff_sig_range = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(uint32_t) * range.size(), range.data()));
+        buff_delay = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(data_t) * Channels(), delay_samples.data()));
+        buff_gain = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(data_t) * Channels(), gain.data()));
+        buff_sig_idx = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(uint32_t) * Channels(), signal_idx.data()));
+    }
+    catch (cl::Error& e) {
+        throw std::runtime_error("ERR: Can't allocate memory on device (fas::driver_array::Update()):\n" + std::string(e.what()));
+    }
+}
+
+void driver_array::Drive(data_t time) {
+    if (num_elements == 0)
+        return;
+    f->Activate(bbox_lo, bbox_hi);
+    // time in samples, split same as by driver::Sample()
+    uint32_t t_int;
+    data_t t_frac;
+    SignalTime(time, sig_samp_freq, t_int, t_frac);
+    if (f->Native()) {
+        Update(); // checks parameters only
+        std::vector<data_t> values(num_elements);
+        for (size_t e = 0; e < num_elements; e++) {
+            // same as drive_array kernel
+            uint32_t ch = host_channel[e];
+            const std::vector<data_t>& s = signals[signal_idx[ch]];
+            data_t rel = t_frac - delay[ch] * sig_samp_freq;
+            data_t rel_int = std::floor(rel);
+            data_t frac = rel - rel_int;
+            int64_t i = (int64_t)t_int + (int64_t)rel_int;
+            data_t s0 = i >= 0 && i < (int64_t)s.size() ? s[i] : 0.0f;
+            data_t s1 = i + 1 >= 0 && i + 1 < (int64_t)s.size() ? s[i + 1] : 0.0f;
+            values[e] = gain[ch] * (s0 + frac * (s1 - s0));
+        }
+        native::DriveValues(*f, host_elements, values.data());
+        return;
+    }
+    if (buff_delay() == nullptr)
+        Update();
+    try {
+        cl::Kernel& k = f->prg->drive_array_kernel;
+        k.setArg(0, f->p_buff ? f->buff_B : f->buff_A);
+        k.setArg(1, buff_elements);
+        k.setArg(2, buff_channel);
+        k.setArg(3, buff_delay);
+        k.setArg(4, buff_gain);
+        k.setArg(5, buff_sig_idx);
+        k.setArg(6, buff_signals);
+        k.setArg(7, buff_sig_range);
+        k.setArg(8, t_int);
+        k.setArg(9, t_frac);
+        k.setArg(10, f->size.x);
+        k.setArg(11, f->size.y);
+        f->BricksArg(k, 12);
+        f->cl_queue.enqueueNDRangeKernel(k, 0, num_elements);
+    }
+    catch (cl::Error& e) {
+        throw std::runtime_error("ERR: Can't drive acoustic pressure of array (fas::driver_array::Drive()):\n" + std::string(e.what()));
+    }
+}
+
+std::vector<uint32_t> scanner::PlaneCoords(vec3<uint32_t> limits, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size)
 {
-    f = &_f;
-    num_elements = (size_t)(size.x) * size.y;
-    store_every_nth_frame = _store_every_nth_frame;
+    size_t n = (size_t)(size.x) * size.y;
+    std::vector<uint32_t> rv(n * 3);
+    mat3_3 rot = RotationMatrix<data_t>(rotation);
+    for(uint32_t y = 0; y < size.y; y++)
+    {
+        for(uint32_t x = 0; x < size.x; x++)
+        {
+            // rotate & translate, note: "z" is alway 0 so not used
+            float new_xf = rot.a11 * (data_t)x + rot.a12 * (data_t)y + (data_t)(position.x);
+            float new_yf = rot.a21 * (data_t)x + rot.a22 * (data_t)y + (data_t)(position.y);
+            float new_zf = rot.a31 * (data_t)x + rot.a32 * (data_t)y + (data_t)(position.z);
+            // convert to integer and check for field boundary
+            uint32_t new_x = (new_xf < 0.0f) ? 0 : new_xf;
+            uint32_t new_y = (new_yf < 0.0f) ? 0 : new_yf;
+            uint32_t new_z = (new_zf < 0.0f) ? 0 : new_zf;
+            new_x = (new_x >= limits.x) ? limits.x - 1 : new_x;
+            new_y = (new_y >= limits.y) ? limits.y - 1 : new_y;
+            new_z = (new_z >= limits.z) ? limits.z - 1 : new_z;
+            // store
+            rv[(size_t)y * size.x + x] = new_x;
+            rv[(size_t)y * size.x + x + n] = new_y;
+            rv[(size_t)y * size.x + x + 2 * n] = new_z;
+        }
+    }
+    return rv;
+}
 
+void scanner::SetElements(field &_f, const std::vector<uint32_t>& coords)
+{
+    f = &_f;
+    plane_size = vec2<uint32_t>(0u, 0u); // scanned by scan kernel
+    num_elements = coords.size() / 3;
+    if(num_elements == 0) {
+        return; // part of multi_field scanner outside of its slab
+    }
+    // index of each element, order of frame is kept
+    std::vector<uint64_t> idx(num_elements);
+    for(size_t i = 0; i < num_elements; i++)
+        idx[i] = f->StorageIndex(coords[i], coords[i + num_elements], coords[i + 2 * num_elements]);
+    if(f->Native()) {
+        host_elements = std::move(idx);
+        host_data.resize(num_elements);
+        return;
+    }
     try {
         // allocate memory for scanned data on device
         buff_data = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_WRITE/*CL_MEM_WRITE_ONLY*/, sizeof(data_t) * num_elements));
-        buff_elements = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_WRITE/*CL_MEM_READ_ONLY*/, sizeof(uint32_t) * num_elements * 3));
+        buff_elements = IndexBuffer(*f, idx);
+    }
+    catch (cl::Error& e) {
+        throw std::runtime_error("ERR: Can't allocate memory on device (fas::scanner::SetElements()):\n" + std::string(e.what()));
+    }
+}
 
-        //calc & store coordinates
-        uint32_t *tmp_elements = static_cast<uint32_t*>(f->cl_queue.enqueueMapBuffer(buff_elements, CL_TRUE, CL_MAP_WRITE, 0, sizeof(uint32_t) * 3 * num_elements));
-        mat3_3 rot = RotationMatrix<data_t>(rotation);
-        for(uint32_t y = 0; y < size.y; y++)
-        {
-            for(uint32_t x = 0; x < size.x; x++)
-            {
-                // rotate & translate, note: "z" is alway 0 so not used
-                float new_xf = rot.a11 * (data_t)x + rot.a12 * (data_t)y + (data_t)(position.x);
-                float new_yf = rot.a21 * (data_t)x + rot.a22 * (data_t)y + (data_t)(position.y);
-                float new_zf = rot.a31 * (data_t)x + rot.a32 * (data_t)y + (data_t)(position.z);
-                // convert to integer and check for field boundary
-                uint32_t new_x = (new_xf < 0.0f) ? 0 : new_xf;
-                uint32_t new_y = (new_yf < 0.0f) ? 0 : new_yf;
-                uint32_t new_z = (new_zf < 0.0f) ? 0 : new_zf;
-                new_x = (new_x >= f->size.x) ? f->size.x - 1 : new_x;
-                new_y = (new_y >= f->size.y) ? f->size.y - 1 : new_y;
-                new_z = (new_z >= f->size.z) ? f->size.z - 1 : new_z;
-                // store
-                tmp_elements[(size_t)y * size.x + x] = new_x;
-                tmp_elements[(size_t)y * size.x + x + num_elements] = new_y;
-                tmp_elements[(size_t)y * size.x + x + 2 * num_elements] = new_z;
-            }
-        }
-        f->cl_queue.enqueueUnmapMemObject(buff_elements, tmp_elements);
+void scanner::SetPlane(field &_f, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size, interp_t _interp)
+{
+    f = &_f;
+    interp = _interp;
+    plane_size = size;
+    num_elements = (size_t)(size.x) * size.y;
+    mat3_3<data_t> rot = RotationMatrix<data_t>(rotation);
+    data_t rp[] = { rot.a11, rot.a12, rot.a13, rot.a21, rot.a22, rot.a23, rot.a31, rot.a32, rot.a33,
+                    (data_t)(position.x), (data_t)(position.y), (data_t)(position.z) };
+    std::copy(rp, rp + 12, rot_pos);
+    if(num_elements == 0) {
+        return;
+    }
+    if(f->Native()) {
+        host_data.resize(num_elements);
+        return;
+    }
+    try {
+        buff_data = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_WRITE, sizeof(data_t) * num_elements));
+        buff_rot_pos = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(data_t) * 12, rot_pos));
     }
     catch (cl::Error& e) {
-        throw std::runtime_error("ERR: Can't allocate memory on device (fas::scanner::Prepare()):\n" + std::string(e.what()));
+        throw std::runtime_error("ERR: Can't allocate memory on device (fas::scanner::SetPlane()):\n" + std::string(e.what()));
     }
-    // output file
+}
+
+void scanner::OpenFile(std::string out_file_name)
+{
     try {
         out_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
         out_file.open(out_file_name, std::ios::binary | std::ios::trunc); // sdt::exception will go higher, if thrown
@@ -188,25 +654,71 @@ void scanner::Prepare(field &_f, vec3<uint32_t> position, vec3<double> rotation,
     {
         throw std::runtime_error("ERR: Can't write to file \"" + out_file_name + "\" (fas::scanner::Prepare()):\n" + std::string(e.what()));
     }
+}
 
+void scanner::Prepare(field &_f, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size, std::string out_file_name, uint32_t _store_every_nth_frame, interp_t _interp)
+{
+    store_every_nth_frame = _store_every_nth_frame;
+    // positions of pixels are calculated by kernel
+    SetPlane(_f, position, rotation, size, _interp);
+    // output file
+    OpenFile(out_file_name);
+}
+
+void scanner::Prepare(multi_field &_mf, vec3<uint32_t> position, vec3<double> rotation, vec2<uint32_t> size, std::string out_file_name, uint32_t _store_every_nth_frame, interp_t _interp)
+{
+    if(_interp != INTERP_NEAREST)
+        throw std::runtime_error("ERR: Interpolating scanner isn't supported by multi_field (fas::scanner::Prepare())");
+    mf = &_mf;
+    store_every_nth_frame = _store_every_nth_frame;
+    std::vector<uint32_t> coords = PlaneCoords(mf->size, position, rotation, size);
+    num_elements = coords.size() / 3;
+    frame.resize(num_elements);
+
+    // each element is scanned by slab owning its plane, z relative to slab
+    std::vector<std::vector<uint32_t>> part_coords(mf->slabs.size());
+    part_index.assign(mf->slabs.size(), {});
+    for(size_t i = 0; i < num_elements; i++) {
+        size_t s = mf->SlabOf(coords[i + 2 * num_elements]);
+        part_index[s].push_back(i);
+    }
+    parts.clear();
+    parts.resize(mf->slabs.size());
+    for(size_t s = 0; s < mf->slabs.size(); s++) {
+        const std::vector<size_t>& idx = part_index[s];
+        std::vector<uint32_t> c(idx.size() * 3);
+        for(size_t i = 0; i < idx.size(); i++) {
+            c[i] = coords[idx[i]];
+            c[i + idx.size()] = coords[idx[i] + num_elements];
+            c[i + 2 * idx.size()] = coords[idx[i] + 2 * num_elements] - mf->slabs[s]->z_offset;
+        }
+        parts[s].store_every_nth_frame = store_every_nth_frame;
+        parts[s].SetElements(*mf->slabs[s], c);
+    }
+    OpenFile(out_file_name);
 }
 
 void scanner::Scan2devmem()
 {
+    if(mf != nullptr) {
+        for(auto& part : parts) {
+            if(part.num_elements) part.Scan2devmem();
+        }
+        return;
+    }
     if(f->steps_calculated % store_every_nth_frame != 0)
     {
         return; // nothing to do - don't store this frame
     }
-    try {
-        if (f->p_buff == 0)
-            f->d->scan_kernel.setArg(0, f->buff_A);
+    if(f->Native()) {
+        if(plane_size.x)
+            native::ScanPlane(*f, rot_pos, plane_size, interp == INTERP_TRILINEAR, host_data.data());
         else
-            f->d->scan_kernel.setArg(0, f->buff_B);
-        f->d->scan_kernel.setArg(1, buff_elements);
-        f->d->scan_kernel.setArg(2, buff_data);
-        f->d->scan_kernel.setArg(3, f->size.x);
-        f->d->scan_kernel.setArg(4, f->size.y);
-        f->cl_queue.enqueueNDRangeKernel(f->d->scan_kernel, 0, num_elements);
+            native::Scan(*f, host_elements, host_data.data());
+        return;
+    }
+    try {
+        EnqueueScan(buff_data);
     }
     catch (cl::Error& e) {
         std::string s;
@@ -216,11 +728,64 @@ void scanner::Scan2devmem()
     }
 }
 
+void scanner::EnqueueScan(cl::Buffer& out, cl::Event* evt)
+{
+    if(plane_size.x) {
+        cl::Kernel& k = f->prg->scan_plane_kernel;
+        k.setArg(0, f->p_buff ? f->buff_B : f->buff_A);
+        k.setArg(1, out);
+        k.setArg(2, buff_rot_pos);
+        k.setArg(3, (uint32_t)(interp == INTERP_TRILINEAR));
+        k.setArg(4, f->size.x);
+        k.setArg(5, f->size.y);
+        k.setArg(6, f->size.z);
+        f->BricksArg(k, 7);
+        f->cl_queue.enqueueNDRangeKernel(k, cl::NullRange, cl::NDRange(plane_size.x, plane_size.y), cl::NullRange, NULL, evt);
+        return;
+    }
+    cl::Kernel& k = f->prg->scan_kernel;
+    k.setArg(0, f->p_buff ? f->buff_B : f->buff_A);
+    k.setArg(1, buff_elements);
+    k.setArg(2, out);
+    k.setArg(3, f->size.x);
+    k.setArg(4, f->size.y);
+    f->BricksArg(k, 5);
+    f->cl_queue.enqueueNDRangeKernel(k, 0, num_elements, cl::NullRange, NULL, evt);
+}
+
 void scanner::Scan2file() {
+    if(mf != nullptr) {
+        if(mf->StepsCalculated() % store_every_nth_frame != 0)
+        {
+            return; // nothing to do - don't store this frame
+        }
+        try {
+            // gather frame from slabs
+            std::vector<data_t> tmp;
+            for(size_t s = 0; s < parts.size(); s++) {
+                scanner& part = parts[s];
+                if(part.num_elements == 0) continue;
+                tmp.resize(part.num_elements);
+                part.f->cl_queue.enqueueReadBuffer(part.buff_data, CL_TRUE, 0, sizeof(data_t) * part.num_elements, tmp.data());
+                for(size_t i = 0; i < part.num_elements; i++) {
+                    frame[part_index[s][i]] = tmp[i];
+                }
+            }
+            out_file.write((char*)frame.data(), sizeof(data_t) * num_elements);
+        }
+        catch (cl::Error& e) {
+            throw std::runtime_error("ERR: Can't read data from device to file. (fas::scanner::Scan2file()):\n" + std::string(e.what()));
+        }
+        return;
+    }
     if(f->steps_calculated % store_every_nth_frame != 0)
     {
         return; // nothing to do - don't store this frame
     }
+    if(f->Native()) {
+        out_file.write((char*)host_data.data(), sizeof(data_t) * num_elements);
+        return;
+    }
     void* hptr = nullptr;
     try {
         hptr = f->cl_queue.enqueueMapBuffer(buff_data, CL_TRUE, CL_MAP_READ, 0, sizeof(data_t) * num_elements);
@@ -236,3 +801,67 @@ void scanner::Scan2file() {
         throw std::runtime_error(s);
     }
 }
+
+void scanner::ScanPipelined() {
+    if(mf != nullptr) {
+        // frame is assembled from several devices, not pipelined
+        Scan2devmem();
+        Scan2file();
+        return;
+    }
+    if(f->steps_calculated % store_every_nth_frame != 0)
+    {
+        return; // nothing to do - don't store this frame
+    }
+    if(f->Native()) {
+        Scan2devmem(); // host memory, nothing to overlap
+        Scan2file();
+        return;
+    }
+    int slot = pipe_slot;
+    try {
+        if (slot && buff_data_pipe() == nullptr)
+            buff_data_pipe = std::move(cl::Buffer(f->d->cl_context, CL_MEM_READ_WRITE, sizeof(data_t) * num_elements));
+        // frame scanned two frames ago must be stored before its buffers are reused
+        if (pipe_pending[slot]) {
+            pipe_read[slot].wait();
+            out_file.write((char*)pipe_host[slot].data(), sizeof(data_t) * num_elements);
+            pipe_pending[slot] = false;
+        }
+        pipe_host[slot].resize(num_elements);
+        cl::Buffer& buff = slot ? buff_data_pipe : buff_data;
+        std::vector<cl::Event> scanned(1);
+        EnqueueScan(buff, &scanned[0]);
+        f->cl_queue.flush(); // io_queue waits for this event
+        f->io_queue.enqueueReadBuffer(buff, CL_FALSE, 0, sizeof(data_t) * num_elements, pipe_host[slot].data(), &scanned, &pipe_read[slot]);
+        f->io_queue.flush();
+        pipe_pending[slot] = true;
+        pipe_slot = slot ? 0 : 1;
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't scan acoustic pressure (fas::scanner::ScanPipelined()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+}
+
+void scanner::Drain() {
+    try {
+        // oldest frame is in slot which will be used next
+        for (int i = 0; i < 2; i++) {
+            int slot = (pipe_slot + i) % 2;
+            if (pipe_pending[slot]) {
+                pipe_read[slot].wait();
+                out_file.write((char*)pipe_host[slot].data(), sizeof(data_t) * num_elements);
+                pipe_pending[slot] = false;
+            }
+        }
+    }
+    catch (cl::Error& e) {
+        std::string s;
+        s = "ERR: Can't read data from device to file. (fas::scanner::Drain()):\n";
+        s += e.what();
+        throw std::runtime_error(s);
+    }
+}